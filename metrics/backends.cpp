@@ -1,12 +1,9 @@
 #include "stdafx.h"
 #include "backends.h"
 #include "metrics_server.h"
-#include <fstream> 
-#include <ctime>
+#include "json_writer.h"
 #include <string>
-#include <sstream>
-#include <iomanip>
-#include <list>
+#include <stdarg.h>
 
 
 namespace metrics
@@ -27,178 +24,390 @@ namespace metrics
         }
     }
 
+    // appends formatted text to the buffer, without allocating a temporary string
+    static void append(std::string& buffer, const char* fmt, ...)
+    {
+        char txt[128];
+        va_list args;
+        va_start(args, fmt);
+        int len = _vsnprintf_s(txt, _countof(txt), _TRUNCATE, fmt, args);
+        va_end(args);
+        buffer.append(txt, len < 0 ? strlen(txt) : len);
+    }
+
+    // appends the metric name from a stats key, without the tags
+    static void append_name(std::string& out, const std::string& key, const char* suffix)
+    {
+        out.append(key, 0, name_length(key));
+        out += suffix;
+    }
+
+    // appends the tags from a stats key in DogStatsD format, "|#k:v,k2:v2"
+    static void append_tags(std::string& out, const std::string& key)
+    {
+        size_t len = name_length(key);
+        if (len < key.size()) out.append(key, len, std::string::npos);
+    }
+
     void file_backend::operator()(const stats& stats)
     {
-        std::ofstream ofs;
-        ofs.open(m_filename, std::ofstream::out | std::ofstream::app);
+        serialize(stats, m_sink->buffer());
+        m_sink->write();
+    }
+
+    void file_backend::operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded)
+    {
+        m_sink->write(*encoded);
+    }
+
+    void file_backend::serialize(const stats& stats, std::string& buf)
+    {
 
-        ofs << "@ TS: " << timer::to_string(stats.timestamp) << "\n";
+        buf += "@ TS: ";
+        buf += timer::to_string(stats.timestamp);
+        buf += "\n";
 
         FOR_EACH (auto& c, stats.counters)
         {
-            ofs << " C: " << c.first.c_str() << " - " << c.second << "1/s\n";
+            buf += " C: ";
+            buf += c.first;
+            append(buf, " - %g1/s\n", c.second);
         }
         FOR_EACH (auto& g, stats.gauges)
         {
-            ofs << " G: " << g.first.c_str() << " - " << g.second << "\n";
+            buf += " G: ";
+            buf += g.first;
+            append(buf, " - %lld\n", g.second);
         }
         FOR_EACH (auto& t, stats.timers)
         {
-            ofs << " H: " << t.second.dump() << "\n";
+            // same as timer_data::dump(), without the temporary string
+            auto& td = t.second;
+            buf += " H: ";
+            buf += td.metric;
+            append(buf, " - cnt: %d, min: %d, max: %d, sum: %lld, avg: %.2f, stddev: %.2f\n",
+                td.count, td.min, td.max, td.sum, td.avg, td.stddev);
         }
-        ofs << "----------------------------------------------\n";
+        buf += "----------------------------------------------\n";
+    }
 
-        ofs.close();
+    // appends a tag name or value, replacing characters which Graphite doesn't
+    // accept in it, or which would end the line or field, with '_'
+    static void graphite_tag(std::string& out, const std::string& key, size_t begin, size_t end, bool value)
+    {
+        for (size_t i = begin; i < end; ++i) {
+            char c = key[i];
+            bool invalid = c == ';' || (unsigned char)c <= ' ' || c == 0x7F
+                || (value ? c == '~' && i == begin : c == '!' || c == '^' || c == '=');
+            out += invalid ? '_' : c;
+        }
     }
 
-	void json_file_backend::operator()(const stats& stats)
-	{
-		const char indent[] = "    ";
-		std::ofstream ofs;
-		ofs.open(m_filename, std::ofstream::out | std::ofstream::app);
+    // appends "<name><suffix>;k=v;k2=v2", tags in Graphite format. Tags without
+    // value get value "true", as Graphite requires one
+    static void graphite_name(std::string& out, const std::string& key, const char* suffix)
+    {
+        size_t pos = name_length(key);
+        out.append(key, 0, pos);
+        out += suffix;
+        if (pos == key.size()) return;
 
-		int current_line = 0;
+        pos += strlen(TAGS_SEPARATOR);
+        while (pos < key.size()) {
+            size_t end = key.find(',', pos);
+            if (end == std::string::npos) end = key.size();
+            size_t colon = key.find(':', pos);
+            if (colon > end) colon = end;
 
-		ofs << "{\n";
+            out += ';';
+            graphite_tag(out, key, pos, colon, false);
+            out += '=';
+            if (colon + 1 < end) graphite_tag(out, key, colon + 1, end, true);
+            else out += "true";
+            pos = end + 1;
+        }
+    }
 
-		ofs << indent << to_quoted_string("_timestamp") << ": " << to_quoted_string(timer::to_string(stats.timestamp).c_str());
+    // appends one "<name><suffix> <value> <timestamp>" line of Graphite plaintext protocol
+    static void graphite_line(std::string& out, const std::string& name, const char* suffix, double value, const char* timestamp)
+    {
+        if (value != value || value - value != 0) return; // Carbon doesn't accept NaN
+        graphite_name(out, name, suffix);
+        out += ' ';
+        json_writer::write_double(out, value);
+        out += timestamp;
+    }
 
-		FOR_EACH(auto& c, stats.counters)
-		{
-			ofs << ",\n" << indent << to_quoted_string(c.first.c_str()) << ": " << double_to_string(c.second);
-		}
+    static void graphite_line(std::string& out, const std::string& name, const char* suffix, long long value, const char* timestamp)
+    {
+        graphite_name(out, name, suffix);
+        append(out, " %lld", value);
+        out += timestamp;
+    }
 
-		FOR_EACH(auto& g, stats.gauges)
-		{
-			ofs << ",\n" << indent << to_quoted_string(g.first.c_str()) << ": " << g.second;
-		}
+    void graphite_backend::operator()(const stats& stats)
+    {
+        serialize(stats, m_client->buffer());
+        m_client->send();
+    }
 
-		FOR_EACH(auto& t, stats.timers)
-		{
-			ofs << ",\n" << indent << to_quoted_string(t.first.c_str()) << ": ";
-			ofs << "{ ";
-			ofs << to_quoted_string("avg") << ": " << double_to_string(t.second.avg) << ", ";
-			ofs << to_quoted_string("count") << ": " << t.second.count << ", ";
-			ofs << to_quoted_string("min") << ": " << double_to_string(t.second.min) << ", ";
-			ofs << to_quoted_string("max") << ": " << double_to_string(t.second.max) << ", ";
-			ofs << to_quoted_string("stddev") << ": " << double_to_string(t.second.stddev);
-			ofs << " }";
-		}
+    void graphite_backend::operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded)
+    {
+        m_client->buffer() += *encoded; // copied, as it may have to be spooled
+        m_client->send();
+    }
 
-		ofs << "\n}\n";
+    void graphite_backend::serialize(const stats& stats, std::string& out)
+    {
+        char timestamp[32];
+        _snprintf_s(timestamp, _countof(timestamp), _TRUNCATE, " %lld\n", timer::to_unix_ms(stats.timestamp) / 1000);
 
-		ofs.close();
-	}
+        FOR_EACH (auto& c, stats.counters) graphite_line(out, c.first, "", c.second, timestamp);
+        FOR_EACH (auto& g, stats.gauges) graphite_line(out, g.first, "", g.second, timestamp);
+        FOR_EACH (auto& t, stats.timers)
+        {
+            auto& td = t.second;
+            graphite_line(out, t.first, ".count", (long long)td.count, timestamp);
+            graphite_line(out, t.first, ".min", (long long)td.min, timestamp);
+            graphite_line(out, t.first, ".max", (long long)td.max, timestamp);
+            graphite_line(out, t.first, ".sum", td.sum, timestamp);
+            graphite_line(out, t.first, ".avg", td.avg, timestamp);
+            graphite_line(out, t.first, ".stddev", td.stddev, timestamp);
+        }
+    }
 
-	std::string json_file_backend::to_quoted_string(const char *value)
-	{
-		if (strpbrk(value, "\"\\\b\f\n\r\t") == NULL && !contains_control_character(value)) {
-			return std::string("\"") + value + "\"";
-		}
+    syslog_udp_backend::syslog_udp_backend(const char* host, unsigned int port) :
+        m_client(new udp_client(host, port)),
+        m_hostname("-"),
+        m_app("metrics"),
+        m_priority(16 * 8 + 6), // local0.info
+        m_pack(0)
+    {
+        char name[256];
+        if (gethostname(name, sizeof(name)) == 0 && name[0]) m_hostname = name;
+    }
 
-		std::string::size_type maxsize = strlen(value) * 2 + 3;
-		std::string result;
-		result.reserve(maxsize);
-		result += "\"";
+    syslog_udp_backend& syslog_udp_backend::priority(unsigned int facility, unsigned int severity)
+    {
+        if (facility > 23) throw config_exception("Valid syslog facility is 0-23");
+        if (severity > 7) throw config_exception("Valid syslog severity is 0-7");
 
-		for (const char* c = value; *c != 0; ++c)
-		{
-			switch (*c)
-			{
-			case '\"':
-				result += "\\\"";
-				break;
-			case '\\':
-				result += "\\\\";
-				break;
-			case '\b':
-				result += "\\b";
-				break;
-			case '\f':
-				result += "\\f";
-				break;
-			case '\n':
-				result += "\\n";
-				break;
-			case '\r':
-				result += "\\r";
-				break;
-			case '\t':
-				result += "\\t";
-				break;
-			default:
-				if (is_control_character(*c))
-				{
-					std::ostringstream oss;
-					oss << "\\u" << std::hex << std::uppercase << std::setfill('0') << std::setw(4) << static_cast<int>(*c);
-					result += oss.str();
-				}
-				else
-				{
-					result += *c;
-				}
-				break;
-			}
-		}
-		result += "\"";
-		return result;
-	}
+        m_priority = facility * 8 + severity;
+        return *this;
+    }
 
-	bool json_file_backend::contains_control_character(const char* str)
+    syslog_udp_backend& syslog_udp_backend::app_name(const char* name)
+    {
+        size_t len = strlen(name);
+        if (len < 1 || len > 48) throw config_exception("syslog app name must have 1-48 characters");
+        for (size_t i = 0; i < len; ++i) {
+            if (name[i] < 33 || name[i] > 126) throw config_exception("syslog app name must be printable, without spaces");
+        }
+
+        m_app = name;
+        return *this;
+    }
+
+    syslog_udp_backend& syslog_udp_backend::pack(size_t max_datagram)
+    {
+        if (max_datagram != 0 && (max_datagram < 480 || max_datagram > 65507)) {
+            throw config_exception("Valid syslog datagram size is 480-65507 bytes");
+        }
+        m_pack = max_datagram;
+        return *this;
+    }
+
+    // queues the formatted message, packing it with the previous ones if allowed
+    void syslog_udp_backend::add_message(const std::string& header, const char* msgid)
+    {
+        udp_client& client = *m_client;
+        size_t size = header.size() + strlen(msgid) + 3 + m_message.size();
+        if (m_pack == 0 || client.pending() + 1 + size > m_pack) client.end_datagram();
+
+        std::string& buf = client.buffer();
+        if (client.pending() > 0) buf += '\n';
+        buf += header;
+        buf += msgid;
+        buf += " - ";
+        buf += m_message;
+    }
+
+    void syslog_udp_backend::operator()(const stats& stats)
+    {
+        // RFC 3339 timestamp, in UTC
+        ULARGE_INTEGER ticks;
+        ticks.QuadPart = (timer::to_unix_ms(stats.timestamp) + 11644473600000LL) * 10000;
+        FILETIME ft = { ticks.LowPart, ticks.HighPart };
+        SYSTEMTIME st;
+        FileTimeToSystemTime(&ft, &st);
+
+        // everything up to MSGID is the same for all messages of the flush
+        std::string header;
+        append(header, "<%u>1 %04d-%02d-%02dT%02d:%02d:%02d.%03dZ ", m_priority,
+            st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+        header += m_hostname;
+        header += ' ';
+        header += m_app;
+        append(header, " %lu ", GetCurrentProcessId());
+
+        FOR_EACH (auto& c, stats.counters)
+        {
+            if (c.second != c.second || c.second - c.second != 0) continue; // NaN/Inf
+            m_message.assign(c.first).append(" ");
+            json_writer::write_double(m_message, c.second);
+            add_message(header, "counter");
+        }
+        FOR_EACH (auto& g, stats.gauges)
+        {
+            m_message.assign(g.first);
+            append(m_message, " %lld", g.second);
+            add_message(header, "gauge");
+        }
+        FOR_EACH (auto& t, stats.timers)
+        {
+            auto& td = t.second;
+            m_message.assign(t.first);
+            append(m_message, " count=%d min=%d max=%d sum=%lld avg=", td.count, td.min, td.max, td.sum);
+            json_writer::write_double(m_message, td.avg);
+            m_message += " stddev=";
+            json_writer::write_double(m_message, td.stddev);
+            add_message(header, "timer");
+        }
+
+        unsigned int failed = m_client->send();
+        if (failed > 0) count_internal(builtin::internal_syslog_errors, failed);
+    }
+
+    statsd_backend::statsd_backend(const char* host, unsigned int port, statsd_transport transport) :
+        m_mtu(1432),
+        m_rate_limit(0)
+    {
+        if (transport == StatsdTcp) m_tcp.reset(new tcp_client(host, port));
+        else m_udp.reset(new udp_client(host, port));
+    }
+
+    statsd_backend& statsd_backend::mtu(size_t bytes)
+    {
+        if (bytes < 64 || bytes > 65507) throw config_exception("Valid MTU is 64-65507 bytes");
+
+        m_mtu = bytes;
+        return *this;
+    }
+
+    // queues the formatted line, unless it doesn't fit into the budget
+    bool statsd_backend::add_line(size_t* budget)
+    {
+        if (m_line.size() + 1 > *budget) return false;
+        *budget -= m_line.size() + 1;
+
+        if (m_tcp) {
+            m_tcp->buffer() += m_line;
+            m_tcp->buffer() += '\n';
+            return true;
+        }
+
+        if (m_udp->pending() > 0 && m_udp->pending() + 1 + m_line.size() > m_mtu) m_udp->end_datagram();
+        if (m_udp->pending() > 0) m_udp->buffer() += '\n';
+        m_udp->buffer() += m_line;
+        return true;
+    }
+
+    void statsd_backend::operator()(const stats& stats)
+    {
+        double period = stats.period_ms / 1000.0;
+        size_t budget = m_rate_limit > 0 ? (size_t)(m_rate_limit * period) : (size_t)-1;
+        unsigned int dropped = 0;
+
+        FOR_EACH (auto& c, stats.counters)
+        {
+            // rounded half away from zero, VS2010 has no llround
+            double total = c.second * period;
+            append_name(m_line.assign(m_prefix), c.first, "");
+            append(m_line, ":%lld|c", (long long)(total < 0 ? total - 0.5 : total + 0.5));
+            append_tags(m_line, c.first);
+            if (!add_line(&budget)) dropped++;
+        }
+        FOR_EACH (auto& g, stats.gauges)
+        {
+            // a signed value would be taken as a delta, so negative gauges are reset first
+            append_name(m_line.assign(m_prefix), g.first, "");
+            if (g.second < 0) {
+                m_line.append(":0|g");
+                append_tags(m_line, g.first);
+                append_name(m_line.append("\n").append(m_prefix), g.first, "");
+            }
+            append(m_line, ":%lld|g", g.second);
+            append_tags(m_line, g.first);
+            if (!add_line(&budget)) dropped++;
+        }
+        FOR_EACH (auto& t, stats.timers)
+        {
+            auto& td = t.second;
+            append_name(m_line.assign(m_prefix), t.first, ".count");
+            append(m_line, ":%d|c", td.count);
+            append_tags(m_line, t.first);
+            if (!add_line(&budget)) dropped++;
+
+            append_name(m_line.assign(m_prefix), t.first, ".sum");
+            append(m_line, ":%lld|c", td.sum);
+            append_tags(m_line, t.first);
+            if (!add_line(&budget)) dropped++;
+
+            append_name(m_line.assign(m_prefix), t.first, ".min");
+            append(m_line, ":%d|ms", td.min);
+            append_tags(m_line, t.first);
+            if (!add_line(&budget)) dropped++;
+
+            append_name(m_line.assign(m_prefix), t.first, ".max");
+            append(m_line, ":%d|ms", td.max);
+            append_tags(m_line, t.first);
+            if (!add_line(&budget)) dropped++;
+        }
+
+        if (m_tcp) m_tcp->send();
+        else m_udp->send();
+        if (dropped > 0) count_internal(builtin::internal_forward_dropped, dropped);
+    }
+
+	void json_file_backend::operator()(const stats& stats)
 	{
-		while (*str)
-		{
-			if (is_control_character(*(str++)))
-				return true;
-		}
-		return false;
+		serialize(stats, m_sink->buffer());
+		m_sink->write();
 	}
 
-
-	inline bool json_file_backend::is_control_character(char ch)
+	void json_file_backend::operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded)
 	{
-		return ch > 0 && ch <= 0x1f;
+		m_sink->write(*encoded);
 	}
 
-	std::string json_file_backend::double_to_string(double value)
+	void json_file_backend::serialize(const stats& stats, std::string& out)
 	{
-		char buffer[32];
-		sprintf_s(buffer, sizeof(buffer), "%#.16g", value);
-		
-		char* ch = buffer + strlen(buffer) - 1;
-		if (*ch != '0') {
-			return buffer; // nothing to truncate, so save time
+		json_writer json(out);
+		json.begin_object();
+		json.key("_timestamp").value(timer::to_string(stats.timestamp));
+
+		FOR_EACH(auto& c, stats.counters)
+		{
+			json.key(c.first).value(c.second);
 		}
 
-		while (ch > buffer && *ch == '0') {
-			--ch;
+		FOR_EACH(auto& g, stats.gauges)
+		{
+			json.key(g.first).value(g.second);
 		}
 
-		char* last_nonzero = ch;
-		while (ch >= buffer) {
-			switch (*ch) {
-				case '0':
-				case '1':
-				case '2':
-				case '3':
-				case '4':
-				case '5':
-				case '6':
-				case '7':
-				case '8':
-				case '9':
-					--ch;
-					continue;
-				case '.':
-					// Truncate zeroes to save bytes in output, but keep one.
-					*(last_nonzero + 2) = '\0';
-					return buffer;
-				default:
-					return buffer;
-			}
+		FOR_EACH(auto& t, stats.timers)
+		{
+			json.key(t.first).begin_object()
+				.key("avg").value(t.second.avg)
+				.key("count").value(t.second.count)
+				.key("min").value((double)t.second.min)
+				.key("max").value((double)t.second.max)
+				.key("stddev").value(t.second.stddev)
+				.end_object();
 		}
 
-		return buffer;	
+		json.end_object();
+		json.end_line();
 	}
-
 }
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <string>
+#include <memory>
+#include "file_sink.h"
+#include "tcp_client.h"
+#include "udp_client.h"
 
 namespace metrics
 {
@@ -17,64 +21,334 @@ namespace metrics
         void operator()(const stats& stats);
     };
 
-    /// Simple backend to dump stats to file
+    /**
+    * Simple backend to dump stats to file. The file is kept open between
+    * flushes, and each flush is written with a single write. Copies of the
+    * backend share the file.
+    */
     class file_backend
     {
-        std::string m_filename;
+        std::shared_ptr<file_sink> m_sink;
     public:
         /**
         * Creates an instance of file_backend
         * @param filename name of the file where stats will be written
         */
-        file_backend(const char* filename) : m_filename(filename){ ; }
+        file_backend(const char* filename) : m_sink(new file_sink(filename)){ ; }
+
+        /**
+        * Specifies when the written stats are forced to disk. By default, 
+        * this is left to the OS.
+        * @param policy Sync policy
+        * @param period For SyncPeriodically, minimum time between syncs, in seconds
+        * @throws config_exception Thrown if periodic sync is requested with 0 period
+        */
+        file_backend& sync(file_sync policy, unsigned int period = 0) {
+            m_sink->sync(policy, period);
+            return *this;
+        }
+
+        /**
+        * Specifies whether the file is compressed. Each flush is written as a
+        * complete gzip member (zstd frame), so e.g. `zcat` can read the file
+        * up to the last flush while it is still being written.
+        * @param method Compression method
+        * @param level Compression level, 0 for library default
+        * @throws config_exception Thrown if compression method is not
+        *         compiled in, or if level is out of range
+        */
+        file_backend& compress(file_compression method, int level = 0) {
+            m_sink->compress(method, level);
+            return *this;
+        }
+
+        /**
+        * Specifies when the file is rotated. Rotation is done by the backend,
+        * so an external tool doesn't race with it. Only the rename of the
+        * current file is done during flush; older files are shifted and
+        * compressed in the background.
+        * @see file_sink::rotate()
+        */
+        file_backend& rotate(unsigned long long max_bytes, unsigned int max_age, unsigned int keep,
+            file_compression compression = NoCompression) {
+            m_sink->rotate(max_bytes, max_age, keep, compression);
+            return *this;
+        }
+
         /**
         * Dumps the provided statistics data to file
         * @param stats Statistic data resulting from last flush
         */
         void operator()(const stats& stats);
+
+        /**
+        * Writes the stats already encoded by serialize(), shared with other
+        * backends. See server_config::add_backend(ENCODER_FN, ENCODED_BACKEND_FN)
+        * @param stats Statistic data resulting from last flush
+        * @param encoded Result of serialize() for the stats
+        */
+        void operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded);
+
+        /**
+        * Appends the text for the stats to the buffer
+        * @param stats Statistic data to be serialized
+        * @param out Buffer to which the text is appended
+        */
+        static void serialize(const stats& stats, std::string& out);
     };
 
-	/// Simple backend that dums stats to JSON file. 
+	/**
+	* Simple backend that dumps stats to JSON file. Each flush is written as
+	* a single line containing one JSON object (NDJSON), so the file can be
+	* processed line by line. The file is kept open between flushes.
+	*/
 	class json_file_backend
 	{
-		std::string m_filename;
+		std::shared_ptr<file_sink> m_sink;
 	public:
 		/**
 		* Creates an instance of json_file_backend
 		* @param filename name of the file where stats will be written
 		*/
-		json_file_backend(const char* filename) : m_filename(filename){ ; }
+		json_file_backend(const char* filename) : m_sink(new file_sink(filename)){ ; }
+		/**
+		* Specifies whether the file is compressed, see file_backend::compress()
+		* @param method Compression method
+		* @param level Compression level, 0 for library default
+		* @throws config_exception Thrown if compression method is not
+		*         compiled in, or if level is out of range
+		*/
+		json_file_backend& compress(file_compression method, int level = 0) {
+			m_sink->compress(method, level);
+			return *this;
+		}
+		/**
+		* Specifies when the file is rotated, see file_backend::rotate()
+		*/
+		json_file_backend& rotate(unsigned long long max_bytes, unsigned int max_age, unsigned int keep,
+			file_compression compression = NoCompression) {
+			m_sink->rotate(max_bytes, max_age, keep, compression);
+			return *this;
+		}
 		/**
 		* Dumps the provided statistics data to file
 		* @param stats Statistic data resulting from last flush
 		*/
 		void operator()(const stats& stats);
-	private:
-		std::string to_quoted_string(const char *value);
-		static bool contains_control_character(const char* str);
-		static bool is_control_character(char ch);
-		static std::string double_to_string(double value);
+		/// writes the line already encoded by serialize(), see file_backend
+		void operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded);
+		/**
+		* Appends the JSON line for the stats to the buffer
+		* @param stats Statistic data to be serialized
+		* @param out Buffer to which the line is appended
+		*/
+		static void serialize(const stats& stats, std::string& out);
 	};
 
-    /*
-    class event_log_backend
+    /**
+    * Backend which sends stats to Graphite (Carbon), using the plaintext
+    * protocol. The connection is kept open between flushes, and each flush is
+    * sent in large chunks from a single buffer. If Carbon is not reachable,
+    * flushes are kept in a bounded spool and sent after reconnecting. Copies
+    * of the backend share the connection.
+    *
+    * Timers are sent as `<name>.count`, `<name>.min`, `<name>.max`,
+    * `<name>.sum`, `<name>.avg` and `<name>.stddev`.
+    */
+    class graphite_backend
     {
+        std::shared_ptr<tcp_client> m_client;
     public:
-    event_log_backend();
-    virtual void process_stats(const stats& stats);
+        /**
+        * Creates an instance of graphite_backend
+        * @param host Name or address of the Carbon server
+        * @param port Port of Carbon plaintext listener
+        * @throws config_exception Thrown if host name can't be resolved
+        */
+        graphite_backend(const char* host, unsigned int port = 2003) : m_client(new tcp_client(host, port)){ ; }
+
+        /// see tcp_client::backoff()
+        graphite_backend& backoff(unsigned int min_ms, unsigned int max_ms) {
+            m_client->backoff(min_ms, max_ms);
+            return *this;
+        }
+
+        /// see tcp_client::spool_limit()
+        graphite_backend& spool_limit(size_t bytes) {
+            m_client->spool_limit(bytes);
+            return *this;
+        }
+
+        /**
+        * Sends the provided statistics data to Carbon
+        * @param stats Statistic data resulting from last flush
+        */
+        void operator()(const stats& stats);
+
+        /**
+        * Sends the lines already encoded by serialize(). They are copied to
+        * the spool, so the shared buffer isn't kept
+        */
+        void operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded);
+
+        /// returns the connection, e.g. to check whether data is being spooled
+        const tcp_client& client() const { return *m_client; }
+
+        /**
+        * Appends the plaintext lines for the stats to the buffer
+        * @param stats Statistic data to be serialized
+        * @param out Buffer to which the lines are appended
+        */
+        static void serialize(const stats& stats, std::string& out);
     };
 
-    class graphite_backend
+    /**
+    * Backend which sends stats to a syslog collector over UDP, as RFC 5424
+    * messages with one metric per message. MSGID tells the metric type:
+    *
+    *     <134>1 2014-05-02T10:20:30.000Z host metrics 1234 counter - app.logins 1.5
+    *     <134>1 2014-05-02T10:20:30.000Z host metrics 1234 timer - app.login count=2 min=10 max=20 sum=30 avg=15.0 stddev=5.0
+    *
+    * All datagrams of a flush are sent with a single call, through a
+    * connected socket. Datagrams which couldn't be sent are counted in the
+    * builtin::internal_syslog_errors counter. Copies of the backend share
+    * the socket.
+    */
+    class syslog_udp_backend
     {
+        std::shared_ptr<udp_client> m_client;
+        std::string m_hostname;
+        std::string m_app;
+        unsigned int m_priority;
+        size_t m_pack;
+        std::string m_message;  // reused for formatting
     public:
-    graphite_backend(const char* host, int port);
-    virtual void process_stats(const stats& stats);
+        /**
+        * Creates an instance of syslog_udp_backend
+        * @param host Name or address of the syslog collector
+        * @param port Port of the collector
+        * @throws config_exception Thrown if host name can't be resolved
+        */
+        syslog_udp_backend(const char* host, unsigned int port = 514);
+
+        /**
+        * Specifies the facility and severity of the messages. The default is
+        * local0 (16) and informational (6).
+        * @throws config_exception Thrown if facility is not in [0,23] or
+        *         severity is not in [0,7]
+        */
+        syslog_udp_backend& priority(unsigned int facility, unsigned int severity);
+
+        /**
+        * Specifies APP-NAME of the messages. The default is `metrics`.
+        * @throws config_exception Thrown if name is empty, longer than 48
+        *         characters, or contains spaces or non-printable characters
+        */
+        syslog_udp_backend& app_name(const char* name);
+
+        /**
+        * Packs several messages into each datagram, separated by newlines.
+        * RFC 5426 specifies one message per datagram, so use this only if
+        * the collector splits datagrams on newlines (e.g. rsyslog, syslog-ng).
+        * @param max_datagram Maximum datagram size in bytes, [480,65507].
+        *        0 sends one message per datagram (default)
+        * @throws config_exception Thrown if size is out of range
+        */
+        syslog_udp_backend& pack(size_t max_datagram);
+
+        /**
+        * Sends the provided statistics data to the collector
+        * @param stats Statistic data resulting from last flush
+        */
+        void operator()(const stats& stats);
+
+        /// returns the socket, e.g. to check the number of failed datagrams
+        const udp_client& client() const { return *m_client; }
+
+    private:
+        void add_message(const std::string& header, const char* msgid);
+    };
+
+    /// transport used by statsd_backend
+    enum statsd_transport
+    {
+        StatsdUdp,  ///< lines are packed into datagrams up to the MTU
+        StatsdTcp   ///< lines are sent over a persistent connection
     };
 
-    class syslog_udp_backend 
+    /**
+    * Backend which forwards flushed stats to an upstream statsd server, e.g.
+    * a regional metrics::server which aggregates stats of many hosts. Each
+    * metric becomes a statsd line, and the lines are packed into as few
+    * datagrams as the MTU allows (or sent over a persistent TCP stream):
+    *
+    * - counters are sent as totals for the flush period: `<name>:<total>|c`
+    * - gauges are sent as absolute values: `<name>:<value>|g`
+    * - timers are sent as summaries which the upstream merges exactly:
+    *   `<name>.count` and `<name>.sum` counters, and `<name>.min` and
+    *   `<name>.max` timers; the upstream's min of `<name>.min` is the
+    *   minimum over all hosts, and the same goes for the max.
+    *
+    * Copies of the backend share the socket.
+    */
+    class statsd_backend
     {
+        std::shared_ptr<udp_client> m_udp;
+        std::shared_ptr<tcp_client> m_tcp;
+        std::string m_prefix;
+        size_t m_mtu;
+        size_t m_rate_limit;
+        std::string m_line;  // reused for formatting
     public:
-    syslog_udp_backend(const char* host, int port);
+        /**
+        * Creates an instance of statsd_backend
+        * @param host Name or address of the upstream server
+        * @param port Port of the upstream server
+        * @param transport Specifies whether lines are sent over UDP or TCP
+        * @throws config_exception Thrown if host name can't be resolved
+        */
+        statsd_backend(const char* host, unsigned int port, statsd_transport transport = StatsdUdp);
+
+        /// specifies the prefix of forwarded metric names, e.g. `"host1."`
+        statsd_backend& prefix(const char* prefix) {
+            m_prefix = prefix;
+            return *this;
+        }
+
+        /**
+        * Specifies the maximum datagram size. The default is 1432 bytes,
+        * which fits into an Ethernet frame. metrics::server receives
+        * datagrams up to 4095 bytes.
+        * @throws config_exception Thrown if size is not in [64,65507]
+        */
+        statsd_backend& mtu(size_t bytes);
+
+        /**
+        * Limits the forwarded traffic. Lines which don't fit into the limit
+        * for the flush period are dropped, and counted in the
+        * builtin::internal_forward_dropped counter.
+        * @param bytes_per_second Maximum average traffic, 0 for no limit (default)
+        */
+        statsd_backend& rate_limit(size_t bytes_per_second) {
+            m_rate_limit = bytes_per_second;
+            return *this;
+        }
+
+        /**
+        * Forwards the provided statistics data upstream
+        * @param stats Statistic data resulting from last flush
+        */
+        void operator()(const stats& stats);
+
+    private:
+        bool add_line(size_t* budget);
+    };
+
+    /*
+    class event_log_backend
+    {
+    public:
+    event_log_backend();
     virtual void process_stats(const stats& stats);
     };
 
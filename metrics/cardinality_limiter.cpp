@@ -0,0 +1,121 @@
+#include "stdafx.h"
+#include "cardinality_limiter.h"
+#include "metrics_server.h"
+#include <algorithm>
+
+namespace metrics
+{
+    // offending prefixes reported with each flush
+    const size_t TOP_PREFIXES = 5;
+    // rejected values of further prefixes are counted only in the total
+    const size_t MAX_REJECTED_PREFIXES = 1000;
+
+    cardinality_limiter::cardinality_limiter(unsigned int max_names, unsigned int max_per_prefix, unsigned int prefix_segments) :
+        m_max_names(max_names),
+        m_max_per_prefix(max_per_prefix),
+        m_prefix_segments(prefix_segments),
+        m_rejected_total(0)
+    {
+    }
+
+    std::string cardinality_limiter::prefix(const std::string& key) const
+    {
+        size_t len = name_length(key);
+        size_t pos = 0;
+        for (unsigned int i = 0; i < m_prefix_segments; ++i) {
+            pos = key.find('.', pos);
+            if (pos == std::string::npos || pos >= len) return key.substr(0, len);
+            if (i + 1 < m_prefix_segments) ++pos;
+        }
+        return key.substr(0, pos);
+    }
+
+    // names with the prefix admitted in current interval, and kept ones
+    unsigned int cardinality_limiter::admitted(const std::string& prefix) const
+    {
+        auto it = m_prefixes.find(prefix);
+        auto kept = m_kept_prefixes.find(prefix);
+        return (it != m_prefixes.end() ? it->second : 0) + (kept != m_kept_prefixes.end() ? kept->second : 0);
+    }
+
+    bool cardinality_limiter::admit(const std::string& key, bool kept)
+    {
+        if (m_kept.find(key) != m_kept.end()) return true;
+        auto name = m_names.find(key);
+        if (name != m_names.end() && !kept) return true;
+
+        std::string p = prefix(key);
+        if (name != m_names.end()) {
+            // admitted in this interval with another type, now also kept
+            m_names.erase(name);
+            if (--m_prefixes[p] == 0) m_prefixes.erase(p);
+            m_kept.insert(key);
+            m_kept_prefixes[p]++;
+            return true;
+        }
+
+        bool full = m_max_names > 0 && m_names.size() + m_kept.size() >= m_max_names;
+        if (!full && m_max_per_prefix > 0) full = admitted(p) >= m_max_per_prefix;
+
+        if (full) {
+            m_rejected_total++;
+            auto r = m_rejected.find(p);
+            if (r != m_rejected.end()) r->second++;
+            else if (m_rejected.size() < MAX_REJECTED_PREFIXES) m_rejected[p] = 1;
+            return false;
+        }
+
+        if (kept) {
+            m_kept.insert(key);
+            m_kept_prefixes[p]++;
+        }
+        else {
+            m_names.insert(key);
+            m_prefixes[p]++;
+        }
+        return true;
+    }
+
+    void cardinality_limiter::release(const std::string& key)
+    {
+        if (m_kept.erase(key) == 0) return;
+
+        std::string p = prefix(key);
+        if (--m_kept_prefixes[p] == 0) m_kept_prefixes.erase(p);
+    }
+
+    static bool more_rejected(const std::pair<std::string, unsigned int>& lhs, const std::pair<std::string, unsigned int>& rhs)
+    {
+        return lhs.second > rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first);
+    }
+
+    void cardinality_limiter::flush(unsigned int period_ms, stats& stats) const
+    {
+        if (m_rejected_total == 0) return;
+
+        auto period = period_ms / 1000.0;
+        stats.counters[builtin::internal_cardinality_rejected] = m_rejected_total / period;
+
+        std::vector<std::pair<std::string, unsigned int> > top(m_rejected.begin(), m_rejected.end());
+        size_t count = top.size() < TOP_PREFIXES ? top.size() : TOP_PREFIXES;
+        std::partial_sort(top.begin(), top.begin() + count, top.end(), more_rejected);
+
+        for (size_t i = 0; i < count; ++i) {
+            std::string name = builtin::internal_cardinality_rejected;
+            name.append(TAGS_SEPARATOR).append("prefix:").append(top[i].first);
+            stats.counters[name] = top[i].second / period;
+        }
+    }
+
+    void cardinality_limiter::clear(bool all)
+    {
+        if (all) {
+            m_kept.clear();
+            m_kept_prefixes.clear();
+        }
+        m_names.clear();
+        m_prefixes.clear();
+        m_rejected.clear();
+        m_rejected_total = 0;
+    }
+}
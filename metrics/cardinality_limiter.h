@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace metrics
+{
+    struct stats;
+
+    /**
+    * Limits the number of distinct metrics stored in one flush interval, so
+    * that a client which puts e.g. request IDs into metric names can't grow
+    * the server storage without bounds.
+    *
+    * Each distinct metric (name and tags) is admitted until the total limit,
+    * or the limit for its prefix, is reached. The server stores values of
+    * metrics which are not admitted in the overflow series instead, and the
+    * limiter counts them per prefix, so that the offending prefixes can be
+    * reported with the next flush. Admitted metrics are forgotten with each
+    * flush, except kept series (gauges kept between flushes), which count
+    * against the limits until they are released.
+    */
+    class cardinality_limiter
+    {
+        unsigned int m_max_names;       // per interval, 0 for no limit
+        unsigned int m_max_per_prefix;  // per interval, 0 for no limit
+        unsigned int m_prefix_segments; // number of name segments in a prefix
+
+        std::unordered_set<std::string> m_names;                   // admitted in current interval
+        std::unordered_map<std::string, unsigned int> m_prefixes;  // admitted names per prefix
+        std::unordered_set<std::string> m_kept;                    // admitted kept series
+        std::unordered_map<std::string, unsigned int> m_kept_prefixes; // kept series per prefix
+        std::unordered_map<std::string, unsigned int> m_rejected;  // rejected values per prefix
+        unsigned int m_rejected_total;
+
+    public:
+        /**
+        * Creates a limiter
+        * @param max_names Maximum number of distinct metrics per interval, or 0 for no limit
+        * @param max_per_prefix Maximum number of distinct metrics with the same prefix, or 0
+        * @param prefix_segments Number of leading name segments which form a prefix
+        */
+        cardinality_limiter(unsigned int max_names, unsigned int max_per_prefix, unsigned int prefix_segments);
+
+        /**
+        * Admits the metric, unless it would exceed a limit
+        * @param key Storage key of the metric
+        * @param kept The metric is kept between flushes, until released
+        * @return false if the metric would exceed a limit
+        */
+        bool admit(const std::string& key, bool kept = false);
+
+        /// forgets a kept series, e.g. an expired gauge
+        void release(const std::string& key);
+
+        /// adds the number of rejected values, and the top offending prefixes, to the stats
+        void flush(unsigned int period_ms, stats& stats) const;
+
+        /// starts the next interval, forgetting also kept series if all is true
+        void clear(bool all = false);
+
+        /// prefix of the metric name in the storage key, which is subject to per prefix limit
+        std::string prefix(const std::string& key) const;
+
+    private:
+        unsigned int admitted(const std::string& prefix) const;
+    };
+}
@@ -0,0 +1,109 @@
+#include "stdafx.h"
+#include "compressor.h"
+
+// compression libraries are optional, projects which want them define these
+// and add zlib/libzstd to include paths and linker input
+#ifdef METRICS_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef METRICS_USE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace metrics
+{
+    compressor::compressor(file_compression method, int level) :
+        m_method(method),
+        m_level(level),
+        m_context(NULL)
+    {
+        switch (method) {
+        case GzipCompression:
+#ifdef METRICS_USE_ZLIB
+            {
+                if (level < 0 || level > 9) throw config_exception("Valid gzip compression level is 0-9");
+
+                z_stream* zs = new z_stream();
+                // window bits + 16 makes zlib write gzip header and trailer
+                if (deflateInit2(zs, level == 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                    delete zs;
+                    throw config_exception("Failed initializing zlib");
+                }
+                m_context = zs;
+            }
+            break;
+#else
+            throw config_exception("gzip compression requires building with METRICS_USE_ZLIB");
+#endif
+
+        case ZstdCompression:
+#ifdef METRICS_USE_ZSTD
+            if (level < 0 || level > ZSTD_maxCLevel()) throw config_exception("Valid zstd compression level is 0-22");
+
+            m_context = ZSTD_createCCtx();
+            if (!m_context) throw config_exception("Failed initializing zstd");
+            break;
+#else
+            throw config_exception("zstd compression requires building with METRICS_USE_ZSTD");
+#endif
+
+        default:
+            throw config_exception("Invalid compression method");
+        }
+    }
+
+    compressor::~compressor()
+    {
+#ifdef METRICS_USE_ZLIB
+        if (m_method == GzipCompression) {
+            deflateEnd((z_stream*)m_context);
+            delete (z_stream*)m_context;
+        }
+#endif
+#ifdef METRICS_USE_ZSTD
+        if (m_method == ZstdCompression) ZSTD_freeCCtx((ZSTD_CCtx*)m_context);
+#endif
+    }
+
+    bool compressor::compress(const char* data, size_t size, std::string& out)
+    {
+        size_t start = out.size();
+
+#ifdef METRICS_USE_ZLIB
+        if (m_method == GzipCompression) {
+            z_stream* zs = (z_stream*)m_context;
+            deflateReset(zs); // starts a new gzip member, keeping the allocated state
+
+            out.resize(start + deflateBound(zs, (uLong)size));
+            zs->next_in = (Bytef*)data;
+            zs->avail_in = (uInt)size;
+            zs->next_out = (Bytef*)&out[start];
+            zs->avail_out = (uInt)(out.size() - start);
+
+            if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+                dbg_print("gzip compression failed: %s", zs->msg ? zs->msg : "");
+                out.resize(start);
+                return false;
+            }
+            out.resize(out.size() - zs->avail_out);
+            return true;
+        }
+#endif
+#ifdef METRICS_USE_ZSTD
+        if (m_method == ZstdCompression) {
+            size_t bound = ZSTD_compressBound(size);
+            out.resize(start + bound);
+
+            size_t written = ZSTD_compressCCtx((ZSTD_CCtx*)m_context, &out[start], bound, data, size, m_level);
+            if (ZSTD_isError(written)) {
+                dbg_print("zstd compression failed: %s", ZSTD_getErrorName(written));
+                out.resize(start);
+                return false;
+            }
+            out.resize(start + written);
+            return true;
+        }
+#endif
+        return false;
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include "metrics.h"
+
+namespace metrics
+{
+    /**
+    * Compression applied to the data written to a file. Compression
+    * libraries are optional: gzip requires building with `METRICS_USE_ZLIB`
+    * and linking zlib, zstd requires `METRICS_USE_ZSTD` and linking libzstd.
+    */
+    enum file_compression
+    {
+        NoCompression,    ///< data is written as is (default)
+        GzipCompression,  ///< each write is a complete gzip member
+        ZstdCompression   ///< each write is a complete zstd frame
+    };
+
+    /**
+    * Compresses each block of data into a self-contained gzip member or zstd
+    * frame. Concatenated members (frames) form a valid gzip (zstd) file, so a
+    * file written this way can be decompressed with standard tools up to the
+    * last complete write, even while it is still being written to.
+    *
+    * Compression state is allocated once and reused for every block.
+    */
+    class compressor
+    {
+        file_compression m_method;
+        int m_level;
+        void* m_context;  // z_stream or ZSTD_CCtx, depending on method
+
+    public:
+        /**
+        * Creates a compressor
+        * @param method Compression method, can't be NoCompression
+        * @param level Compression level, 1-9 for gzip and 1-22 for zstd.
+        *        0 uses the library default (6 for gzip, 3 for zstd)
+        * @throws config_exception Thrown if method isn't compiled in, or
+        *         if level is out of range
+        */
+        compressor(file_compression method, int level = 0);
+        ~compressor();
+
+        /**
+        * Appends compressed data to the output buffer
+        * @param data Data to be compressed
+        * @param size Size of the data, in bytes
+        * @param out Buffer to which the complete member/frame is appended
+        * @return `false` if compression failed, output is left unchanged
+        */
+        bool compress(const char* data, size_t size, std::string& out);
+
+        file_compression method() const { return m_method; }
+
+    private:
+        compressor(const compressor&);
+        compressor& operator=(const compressor&);
+    };
+}
@@ -0,0 +1,190 @@
+#include "stdafx.h"
+#include "default_metrics.h"
+#include <psapi.h>
+#include <climits>
+
+#pragma comment (lib, "psapi.lib")
+
+namespace metrics
+{
+    const ULONGLONG KB = 1024;
+    const ULONGLONG MB = 1024 * 1024;
+
+    static ULONGLONG to_ull(const FILETIME& ft)
+    {
+        ULARGE_INTEGER ui;
+        ui.LowPart = ft.dwLowDateTime;
+        ui.HighPart = ft.dwHighDateTime;
+        return ui.QuadPart;
+    }
+
+    // share of part in total, in %
+    static long long percent(ULONGLONG part, ULONGLONG total)
+    {
+        return total == 0 ? 0 : (long long)(part * 100 / total);
+    }
+
+    default_metrics::default_metrics(builtin_metric which, unsigned int period) :
+        m_which(which),
+        m_period_ms(period * 1000),
+        m_thread(NULL),
+        m_stop(NULL),
+        m_size(0)
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        m_cpus = si.dwNumberOfProcessors > 0 ? si.dwNumberOfProcessors : 1;
+        sample_cpu(m_sys_idle, m_sys_busy, m_proc_kernel, m_proc_user);
+        m_errors = get_client_errors();
+
+        m_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (m_stop) m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+        if (!m_thread) {
+            if (m_stop) CloseHandle(m_stop);
+            throw std::runtime_error("Failed creating default metrics thread");
+        }
+    }
+
+    default_metrics::~default_metrics()
+    {
+        SetEvent(m_stop);
+        WaitForSingleObject(m_thread, INFINITE);
+        CloseHandle(m_thread);
+        CloseHandle(m_stop);
+    }
+
+    DWORD WINAPI default_metrics::thread_proc(LPVOID params)
+    {
+        static_cast<default_metrics*>(params)->run();
+        return 0;
+    }
+
+    void default_metrics::run()
+    {
+        while (WaitForSingleObject(m_stop, m_period_ms) == WAIT_TIMEOUT) collect();
+    }
+
+    void default_metrics::sample_cpu(ULONGLONG& sys_idle, ULONGLONG& sys_busy, ULONGLONG& proc_kernel, ULONGLONG& proc_user)
+    {
+        FILETIME now, idle, kernel, user, created, exited;
+        GetSystemTimeAsFileTime(&now);
+        m_sampled_at = to_ull(now);
+
+        sys_idle = sys_busy = 0;
+        if (GetSystemTimes(&idle, &kernel, &user)) {
+            sys_idle = to_ull(idle);
+            sys_busy = to_ull(kernel) + to_ull(user) - sys_idle; // kernel time includes idle time
+        }
+
+        proc_kernel = proc_user = 0;
+        if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+            proc_kernel = to_ull(kernel);
+            proc_user = to_ull(user);
+        }
+    }
+
+    void default_metrics::collect()
+    {
+        m_size = 0;
+
+        if (m_which & system) {
+            MEMORYSTATUSEX ms;
+            ms.dwLength = sizeof(ms);
+            if (GlobalMemoryStatusEx(&ms)) {
+                add(builtin::sys_mem_phys_used, ms.ullTotalPhys / KB);
+                add(builtin::sys_mem_phys_free, ms.ullAvailPhys / KB);
+                add(builtin::sys_mem_phys_load, ms.dwMemoryLoad);
+                add(builtin::sys_mem_virtual_used, ms.ullTotalVirtual / KB);
+                add(builtin::sys_mem_virtual_free, ms.ullAvailVirtual / KB);
+                add(builtin::sys_mem_pagefile_used, ms.ullTotalPageFile / KB);
+                add(builtin::sys_mem_pagefile_free, ms.ullAvailPageFile / KB);
+            }
+
+            PERFORMANCE_INFORMATION pi;
+            if (GetPerformanceInfo(&pi, sizeof(pi))) {
+                add(builtin::sys_count_handles, pi.HandleCount);
+                add(builtin::sys_count_processes, pi.ProcessCount);
+                add(builtin::sys_count_threads, pi.ThreadCount);
+            }
+
+            ULARGE_INTEGER free_bytes;
+            if (GetDiskFreeSpaceEx("C:\\", &free_bytes, NULL, NULL)) add(builtin::sys_disk_free_c, free_bytes.QuadPart / MB);
+            if (GetDiskFreeSpaceEx("D:\\", &free_bytes, NULL, NULL)) add(builtin::sys_disk_free_d, free_bytes.QuadPart / MB);
+        }
+
+        if (m_which & process) {
+            PROCESS_MEMORY_COUNTERS pmc;
+            if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+                add(builtin::proc_mem_workingset, pmc.WorkingSetSize / KB);
+                add(builtin::proc_mem_workingset_peek, pmc.PeakWorkingSetSize / KB);
+                add(builtin::proc_mem_pagefaults, pmc.PageFaultCount);
+                add(builtin::proc_mem_pagefile, pmc.PagefileUsage / KB);
+                add(builtin::proc_mem_pagefile_peek, pmc.PeakPagefileUsage / KB);
+            }
+        }
+
+        ULONGLONG sampled_at = m_sampled_at;
+        ULONGLONG sys_idle, sys_busy, proc_kernel, proc_user;
+        sample_cpu(sys_idle, sys_busy, proc_kernel, proc_user);
+
+        if (m_which & system) {
+            ULONGLONG busy = sys_busy - m_sys_busy;
+            add(builtin::sys_cpu_load, percent(busy, busy + sys_idle - m_sys_idle));
+        }
+        if (m_which & process) {
+            // process times are summed over all CPUs
+            ULONGLONG elapsed = (m_sampled_at - sampled_at) * m_cpus;
+            ULONGLONG kernel = proc_kernel - m_proc_kernel;
+            ULONGLONG user = proc_user - m_proc_user;
+            add(builtin::proc_cpu_load, percent(kernel + user, elapsed));
+            add(builtin::proc_cpu_kernel, percent(kernel, elapsed));
+            add(builtin::proc_cpu_user, percent(user, elapsed));
+        }
+
+        m_sys_idle = sys_idle;
+        m_sys_busy = sys_busy;
+        m_proc_kernel = proc_kernel;
+        m_proc_user = proc_user;
+
+        if (m_which & client) {
+            client_errors errors = get_client_errors();
+            add(builtin::client_send_errors, errors.send_errors - m_errors.send_errors, "c");
+            add(builtin::client_would_block, errors.would_block - m_errors.would_block, "c");
+            add(builtin::client_oversized, errors.oversized - m_errors.oversized, "c");
+            add(builtin::client_unresolved, errors.unresolved - m_errors.unresolved, "c");
+            m_errors = errors;
+        }
+
+        send();
+    }
+
+    void default_metrics::add(const char* metric, long long value, const char* type)
+    {
+        // server stores values as int
+        if (value > INT_MAX) value = INT_MAX;
+
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            char* line = m_datagram + m_size;
+            size_t room = sizeof(m_datagram) - m_size;
+            const char* fmt = m_size == 0 ? "%s.%s:%lld|%s" : "\n%s.%s:%lld|%s";
+            int ret = _snprintf_s(line, room, _TRUNCATE, fmt, g_client.get_namespace(), metric, value, type);
+            if (ret > 0) {
+                m_size += ret;
+                return;
+            }
+            m_datagram[m_size] = '\0';
+            if (m_size == 0) break;
+            send(); // doesn't fit anymore, the rest goes into the next datagram
+        }
+        count_oversized();
+        dbg_print("error: metric %s didn't fit", metric);
+    }
+
+    void default_metrics::send()
+    {
+        if (m_size == 0) return;
+        send_to_server(m_datagram, m_size);
+        dbg_print("%s", m_datagram);
+        m_size = 0;
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "metrics.h"
+
+namespace metrics
+{
+    /**
+    * Periodically collects the metrics listed in metrics::builtin, and sends
+    * them to the server as gauges. Client errors are sent as counters, with
+    * the number of metrics dropped since the previous collection. All values
+    * collected in one period are packed into as few datagrams as possible
+    * (normally just one).
+    *
+    * Collection runs on its own thread, and doesn't allocate: system and
+    * process counters are read into fixed structures, and formatted into a
+    * fixed buffer. CPU usage is calculated from the difference between two
+    * samples, so it is first reported after one full period.
+    */
+    class default_metrics
+    {
+        builtin_metric m_which;
+        unsigned int m_period_ms;
+        HANDLE m_thread;
+        HANDLE m_stop;
+
+        // previous CPU sample, in 100 ns units
+        ULONGLONG m_sys_idle;
+        ULONGLONG m_sys_busy;
+        ULONGLONG m_proc_kernel;
+        ULONGLONG m_proc_user;
+        ULONGLONG m_sampled_at;
+        unsigned int m_cpus;
+
+        client_errors m_errors; // previous sample of client errors
+
+        char m_datagram[1432]; // fits into a single ethernet frame
+        size_t m_size;
+
+    public:
+        /**
+        * Starts the collector thread
+        * @param which Groups of metrics to collect, builtin_metric flags
+        * @param period How often are metrics collected, in seconds
+        * @throws std::runtime_error Thrown if the thread can't be created
+        */
+        default_metrics(builtin_metric which, unsigned int period);
+
+        /// stops the collector thread and waits for it to finish
+        ~default_metrics();
+
+        /// collects all metrics once, and sends them to the server
+        void collect();
+
+    private:
+        static DWORD WINAPI thread_proc(LPVOID params);
+        void run();
+        void sample_cpu(ULONGLONG& sys_idle, ULONGLONG& sys_busy, ULONGLONG& proc_kernel, ULONGLONG& proc_user);
+        void add(const char* metric, long long value, const char* type = "g");
+        void send();
+
+        default_metrics(const default_metrics&);
+        default_metrics& operator=(const default_metrics&);
+    };
+}
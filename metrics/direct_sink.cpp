@@ -0,0 +1,169 @@
+#include "stdafx.h"
+#include "direct_sink.h"
+#include "metrics_server.h"
+#include "sync.h"
+#include <vector>
+
+#define thread_local __declspec( thread )
+
+namespace metrics
+{
+    // metrics buffered by one thread in one flush interval, ~10 MB
+    const size_t MAX_DIRECT_ENTRIES = 256 * 1024;
+    const unsigned int NO_TAGS = 0xFFFFFFFF;
+
+    void store_metric(storage* storage, std::string& metric_name, metric_type metric, long long value, const char* tags);
+
+    struct direct_entry
+    {
+        metric_type type;
+        int value;
+        unsigned int name; // offset of zero terminated name in the text
+        unsigned int tags; // offset of zero terminated tags in the text, or NO_TAGS
+    };
+
+    // metrics recorded by a single thread
+    struct direct_buffer
+    {
+        CRITICAL_SECTION lock;
+        std::vector<direct_entry> entries;
+        std::vector<char> text;
+        HANDLE thread; // signaled when the owning thread exits, may be NULL
+
+        direct_buffer() : thread(OpenThread(SYNCHRONIZE, FALSE, GetCurrentThreadId())) { InitializeCriticalSection(&lock); }
+        ~direct_buffer() {
+            if (thread) CloseHandle(thread);
+            DeleteCriticalSection(&lock);
+        }
+
+    private:
+        direct_buffer(const direct_buffer&);
+        direct_buffer& operator=(const direct_buffer&);
+    };
+
+    // entries and text drained from the buffer of one thread
+    struct drained_buffer
+    {
+        std::vector<direct_entry> entries;
+        std::vector<char> text;
+    };
+
+    // buffers of all threads which recorded a metric, and the server side
+    // copies of entries and text, which are swapped with those of the buffers
+    struct direct_registry
+    {
+        CRITICAL_SECTION lock;
+        std::vector<direct_buffer*> buffers;
+        std::vector<drained_buffer> drained;
+
+        direct_registry() { InitializeCriticalSection(&lock); }
+        ~direct_registry() {
+            FOR_EACH (auto b, buffers) delete b;
+            DeleteCriticalSection(&lock);
+        }
+    };
+
+    static direct_registry g_registry;
+    static volatile LONG g_direct_enabled = 0;
+    thread_local static direct_buffer* t_buffer = NULL;
+
+    static void append(std::vector<char>& text, const char* txt)
+    {
+        text.insert(text.end(), txt, txt + strlen(txt));
+    }
+
+    direct_result record_direct(metric_type type, const char* ns, METRIC_ID metric, int value, METRIC_TAGS tags)
+    {
+        if (!g_direct_enabled) return direct_off;
+
+        direct_buffer* buffer = t_buffer;
+        if (!buffer) {
+            buffer = new direct_buffer();
+            scoped_lock _(&g_registry.lock);
+            g_registry.buffers.push_back(buffer);
+            t_buffer = buffer;
+        }
+
+        scoped_lock _(&buffer->lock);
+        if (buffer->entries.size() >= MAX_DIRECT_ENTRIES) return direct_full;
+
+        std::vector<char>& text = buffer->text;
+        direct_entry entry;
+        entry.type = type;
+        entry.value = value;
+        entry.name = (unsigned int)text.size();
+        append(text, ns);
+        text.push_back('.');
+        append(text, metric);
+        text.push_back('\0');
+        entry.tags = NO_TAGS;
+        if (tags && *tags) {
+            entry.tags = (unsigned int)text.size();
+            append(text, tags);
+            text.push_back('\0');
+        }
+        buffer->entries.push_back(entry);
+        return direct_recorded;
+    }
+
+    void enable_direct(bool enabled)
+    {
+        InterlockedExchange(&g_direct_enabled, enabled ? 1 : 0);
+
+        scoped_lock _(&g_registry.lock);
+        FOR_EACH (auto b, g_registry.buffers) {
+            scoped_lock l(&b->lock);
+            b->entries.clear();
+            b->text.clear();
+        }
+    }
+
+    void drain_direct(storage* storage)
+    {
+        // only the server thread drains, so the drained copies can be used
+        // after the lock is released
+        auto& drained = g_registry.drained;
+        size_t count = 0;
+        {
+            // the buffers are only swapped under the lock, so that new threads
+            // don't wait for the metrics to be stored
+            scoped_lock _(&g_registry.lock);
+            auto& buffers = g_registry.buffers;
+            if (drained.size() < buffers.size()) drained.resize(buffers.size());
+
+            for (size_t i = 0; i < buffers.size(); ) {
+                direct_buffer* b = buffers[i];
+                // checked first, so that nothing can be added after the last drain
+                bool exited = b->thread && WaitForSingleObject(b->thread, 0) == WAIT_OBJECT_0;
+                {
+                    scoped_lock l(&b->lock);
+                    b->entries.swap(drained[count].entries);
+                    b->text.swap(drained[count].text);
+                }
+                count++;
+
+                if (exited) {
+                    delete b;
+                    buffers.erase(buffers.begin() + i);
+                }
+                else {
+                    ++i;
+                }
+            }
+        }
+
+        std::string name;
+        for (size_t i = 0; i < count; ++i) {
+            auto& entries = drained[i].entries;
+            auto& text = drained[i].text;
+            FOR_EACH (auto& e, entries) {
+                name = &text[e.name];
+                store_metric(storage, name, e.type, e.value, e.tags == NO_TAGS ? NULL : &text[e.tags]);
+            }
+            // keeps the capacity, for the buffer which is swapped in at the next drain
+            entries.clear();
+            text.clear();
+        }
+        if (drained.size() > count) drained.resize(count); // threads which exited
+    }
+}
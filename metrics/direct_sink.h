@@ -0,0 +1,35 @@
+#pragma once
+
+#include "metrics.h"
+
+namespace metrics
+{
+    struct storage;
+
+    /// outcome of recording a metric in direct mode
+    enum direct_result
+    {
+        direct_off,      ///< no in-process server is running, metric has to be sent
+        direct_recorded, ///< metric is buffered until the next flush
+        direct_full      ///< buffer of the calling thread is full, metric was dropped
+    };
+
+    /**
+    * Appends the metric to the buffer of the calling thread, which the
+    * in-process server drains at the next flush. The metric is stored as it
+    * is, without formatting, and the strings are copied, so they don't have
+    * to outlive the call. The buffer is locked only by its own thread, and
+    * by the server thread while draining it.
+    * @see client_config::set_direct
+    */
+    direct_result record_direct(metric_type type, const char* ns, METRIC_ID metric, int value, METRIC_TAGS tags);
+
+    // starts or stops accepting metrics in direct mode. Both discard metrics
+    // which are still buffered, since they belong to a server which is gone.
+    // Called on the server thread
+    void enable_direct(bool enabled);
+
+    // stores metrics buffered by all threads, and releases buffers of threads
+    // which have exited. Called on the server thread
+    void drain_direct(storage* storage);
+}
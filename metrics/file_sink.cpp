@@ -0,0 +1,314 @@
+#include "stdafx.h"
+#include "file_sink.h"
+#include "sync.h"
+#include <deque>
+
+namespace metrics
+{
+    const DWORD SHARE_ALL = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    // rotated files are compressed in chunks of this size
+    const DWORD COMPRESS_CHUNK = 1024 * 1024;
+
+    /**
+    * Rotation settings, and the queue of renamed files waiting to be shifted
+    * into place. Shared with the work items, so it outlives the sink if
+    * they are still running.
+    */
+    struct file_sink::rotation
+    {
+        std::string filename;
+        unsigned long long max_bytes;
+        unsigned int max_age;
+        unsigned int keep;
+        std::string suffix;                  // of rotated files, depends on compression
+        std::unique_ptr<compressor> packer;  // used only while holding work_lock
+
+        CRITICAL_SECTION queue_lock;         // held only briefly, by the writing thread too
+        CRITICAL_SECTION work_lock;          // serializes the shifting
+        std::deque<std::string> pending;     // renamed files, the oldest first
+        unsigned int outstanding;            // work items not finished yet
+        unsigned int sequence;               // makes names of renamed files unique
+        HANDLE idle;                         // set when there are no outstanding work items
+
+        rotation() : outstanding(0), sequence(0)
+        {
+            InitializeCriticalSection(&queue_lock);
+            InitializeCriticalSection(&work_lock);
+            idle = CreateEvent(NULL, TRUE, TRUE, NULL);
+        }
+        ~rotation()
+        {
+            CloseHandle(idle);
+            DeleteCriticalSection(&work_lock);
+            DeleteCriticalSection(&queue_lock);
+        }
+
+        std::string rotated_name(unsigned int index) const
+        {
+            char name[16];
+            _snprintf_s(name, _countof(name), _TRUNCATE, ".%u", index);
+            return filename + name + suffix;
+        }
+
+        void process();
+        bool compress_file(const std::string& source, const std::string& target);
+        static DWORD WINAPI work_item(LPVOID param);
+
+    private:
+        rotation(const rotation&);
+        rotation& operator=(const rotation&);
+    };
+
+    DWORD WINAPI file_sink::rotation::work_item(LPVOID param)
+    {
+        std::shared_ptr<rotation>* owner = static_cast<std::shared_ptr<rotation>*>(param);
+        (*owner)->process();
+        delete owner;
+        return 0;
+    }
+
+    // shifts the rotated files and moves the oldest pending file into place
+    void file_sink::rotation::process()
+    {
+        scoped_lock _(&work_lock);
+
+        std::string source;
+        {
+            scoped_lock queue(&queue_lock);
+            source = pending.front();
+            pending.pop_front();
+        }
+
+        DeleteFile(rotated_name(keep).c_str());
+        for (unsigned int i = keep - 1; i > 0; --i) {
+            MoveFileEx(rotated_name(i).c_str(), rotated_name(i + 1).c_str(), MOVEFILE_REPLACE_EXISTING);
+        }
+
+        std::string target = rotated_name(1);
+        bool moved = packer ? compress_file(source, target)
+            : MoveFileEx(source.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+        if (!moved) dbg_print("cannot move rotated %s to %s, error: %d", source.c_str(), target.c_str(), GetLastError());
+
+        scoped_lock queue(&queue_lock);
+        if (--outstanding == 0) SetEvent(idle);
+    }
+
+    // compresses the file chunk by chunk, and deletes it when done
+    bool file_sink::rotation::compress_file(const std::string& source, const std::string& target)
+    {
+        std::string temp = target + ".tmp";
+        HANDLE in = CreateFile(source.c_str(), GENERIC_READ, SHARE_ALL, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        HANDLE out = CreateFile(temp.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+        bool ok = in != INVALID_HANDLE_VALUE && out != INVALID_HANDLE_VALUE;
+        std::string chunk, compressed;
+        chunk.resize(COMPRESS_CHUNK);
+        while (ok) {
+            DWORD read = 0, written = 0;
+            ok = ReadFile(in, &chunk[0], COMPRESS_CHUNK, &read, NULL) != 0;
+            if (!ok || read == 0) break;
+
+            compressed.clear();
+            ok = packer->compress(chunk.data(), read, compressed)
+                && WriteFile(out, compressed.data(), (DWORD)compressed.size(), &written, NULL) != 0;
+        }
+
+        if (in != INVALID_HANDLE_VALUE) CloseHandle(in);
+        if (out != INVALID_HANDLE_VALUE) CloseHandle(out);
+        if (ok) ok = MoveFileEx(temp.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+        DeleteFile(ok ? source.c_str() : temp.c_str()); // uncompressed file is kept if anything failed
+        return ok;
+    }
+
+    file_sink::file_sink(const std::string& filename) :
+        m_filename(filename),
+        m_file(INVALID_HANDLE_VALUE),
+        m_volume(0),
+        m_index_high(0),
+        m_index_low(0),
+        m_size(0),
+        m_opened(0),
+        m_sync(NoSync),
+        m_sync_period(0),
+        m_last_sync(timer::now())
+    {
+        m_buffer.reserve(64 * 1024);
+    }
+
+    file_sink::~file_sink()
+    {
+        close();
+        wait_for_rotation();
+    }
+
+    void file_sink::sync(file_sync policy, unsigned int period)
+    {
+        if (policy == SyncPeriodically && period == 0) {
+            throw config_exception("sync period must be greater than 0");
+        }
+        m_sync = policy;
+        m_sync_period = period;
+    }
+
+    void file_sink::compress(file_compression method, int level)
+    {
+        m_compressor.reset(method == NoCompression ? NULL : new compressor(method, level));
+    }
+
+    void file_sink::rotate(unsigned long long max_bytes, unsigned int max_age, unsigned int keep, file_compression compression)
+    {
+        if (max_bytes == 0 && max_age == 0) throw config_exception("rotation requires size or age limit");
+        if (max_age > 7 * 24 * 3600) throw config_exception("Valid rotation age is 0-604800 s");
+        if (keep < 1) throw config_exception("at least one rotated file must be kept");
+
+        std::shared_ptr<rotation> r(new rotation());
+        r->filename = m_filename;
+        r->max_bytes = max_bytes;
+        r->max_age = max_age;
+        r->keep = keep;
+        if (compression != NoCompression) {
+            r->packer.reset(new compressor(compression));
+            r->suffix = compression == GzipCompression ? ".gz" : ".zst";
+        }
+        m_rotation = r;
+    }
+
+    void file_sink::wait_for_rotation()
+    {
+        if (m_rotation) WaitForSingleObject(m_rotation->idle, INFINITE);
+    }
+
+    bool file_sink::open()
+    {
+        // FILE_APPEND_DATA without FILE_WRITE_DATA makes every write an append
+        m_file = CreateFile(m_filename.c_str(), FILE_APPEND_DATA, SHARE_ALL, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            dbg_print("cannot open %s, error: %d", m_filename.c_str(), GetLastError());
+            return false;
+        }
+
+        BY_HANDLE_FILE_INFORMATION info;
+        if (GetFileInformationByHandle(m_file, &info)) {
+            m_volume = info.dwVolumeSerialNumber;
+            m_index_high = info.nFileIndexHigh;
+            m_index_low = info.nFileIndexLow;
+        }
+
+        LARGE_INTEGER size;
+        m_size = GetFileSizeEx(m_file, &size) ? size.QuadPart : 0;
+        m_opened = timer::now();
+        return true;
+    }
+
+    bool file_sink::rotated() const
+    {
+        // a file which was renamed or deleted is still valid through our handle,
+        // so the path must be checked to see whether it still leads to it
+        HANDLE h = CreateFile(m_filename.c_str(), FILE_READ_ATTRIBUTES, SHARE_ALL, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (h == INVALID_HANDLE_VALUE) return true;
+
+        BY_HANDLE_FILE_INFORMATION info;
+        bool same = GetFileInformationByHandle(h, &info)
+            && info.dwVolumeSerialNumber == m_volume
+            && info.nFileIndexHigh == m_index_high
+            && info.nFileIndexLow == m_index_low;
+        CloseHandle(h);
+        return !same;
+    }
+
+    void file_sink::close()
+    {
+        if (m_file == INVALID_HANDLE_VALUE) return;
+        if (m_sync != NoSync) FlushFileBuffers(m_file);
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+
+    bool file_sink::write()
+    {
+        bool ok = write(m_buffer);
+        m_buffer.clear();
+        return ok;
+    }
+
+    bool file_sink::write(const std::string& content)
+    {
+        if (m_file != INVALID_HANDLE_VALUE && rotated()) {
+            dbg_print("%s was rotated, reopening", m_filename.c_str());
+            close();
+        }
+        if (m_file == INVALID_HANDLE_VALUE && !open()) return false;
+
+        const std::string* data = &content;
+        if (m_compressor && !content.empty()) {
+            m_compressed.clear();
+            if (!m_compressor->compress(content.data(), content.size(), m_compressed)) return false;
+            data = &m_compressed;
+        }
+
+        if (m_rotation && rotation_due(data->size())) {
+            rotate_now();
+            if (m_file == INVALID_HANDLE_VALUE && !open()) return false;
+        }
+
+        DWORD written = 0;
+        bool ok = data->empty()
+            || WriteFile(m_file, data->data(), (DWORD)data->size(), &written, NULL) != 0;
+        if (!ok) {
+            dbg_print("writing to %s failed, error: %d", m_filename.c_str(), GetLastError());
+            close(); // try again with a fresh handle next time
+        }
+        else {
+            m_size += written;
+            sync_if_needed();
+        }
+        return ok;
+    }
+
+    void file_sink::sync_if_needed()
+    {
+        if (m_sync == NoSync) return;
+        if (m_sync == SyncPeriodically && (unsigned int)timer::since(m_last_sync) < m_sync_period * 1000) return;
+
+        FlushFileBuffers(m_file);
+        m_last_sync = timer::now();
+    }
+
+    bool file_sink::rotation_due(size_t next_write) const
+    {
+        if (m_size == 0) return false; // never leave an empty rotated file
+        if (m_rotation->max_bytes > 0 && m_size + next_write > m_rotation->max_bytes) return true;
+        return m_rotation->max_age > 0 && (unsigned int)timer::since(m_opened) >= m_rotation->max_age * 1000;
+    }
+
+    // renames the file and leaves the rest to a thread pool thread
+    void file_sink::rotate_now()
+    {
+        std::string pending;
+        {
+            scoped_lock _(&m_rotation->queue_lock);
+            char suffix[32];
+            _snprintf_s(suffix, _countof(suffix), _TRUNCATE, ".rotating.%u", ++m_rotation->sequence);
+            pending = m_filename + suffix;
+        }
+
+        close();
+        if (!MoveFileEx(m_filename.c_str(), pending.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            dbg_print("cannot rotate %s, error: %d", m_filename.c_str(), GetLastError());
+            m_opened = timer::now(); // don't retry age based rotation on every write
+            return;
+        }
+
+        {
+            scoped_lock _(&m_rotation->queue_lock);
+            m_rotation->pending.push_back(pending);
+            if (m_rotation->outstanding++ == 0) ResetEvent(m_rotation->idle);
+        }
+
+        auto owner = new std::shared_ptr<rotation>(m_rotation);
+        ULONG flags = m_rotation->packer ? WT_EXECUTELONGFUNCTION : WT_EXECUTEDEFAULT;
+        if (!QueueUserWorkItem(rotation::work_item, owner, flags)) {
+            rotation::work_item(owner); // better late than never
+        }
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include "metrics.h"
+#include "compressor.h"
+
+namespace metrics
+{
+    /// specifies when the data written to a file is forced to disk
+    enum file_sync
+    {
+        NoSync,           ///< leave it to the OS (default)
+        SyncEveryWrite,   ///< flush file buffers after every write
+        SyncPeriodically  ///< flush file buffers at most once per specified period
+    };
+
+    /**
+    * Appends data to a file which is kept open between writes. Data is
+    * formatted into a reusable buffer, which is then written with a single
+    * WriteFile call.
+    *
+    * The file is opened with full sharing, so other processes can read,
+    * rename or delete it. Before each write, the sink checks whether the file
+    * at its path is still the one it holds open, and reopens it if it was
+    * rotated externally.
+    *
+    * Optionally, each write is compressed into a complete gzip member or
+    * zstd frame, so the file is always readable up to the last write.
+    *
+    * The sink can also rotate the file itself, by size and/or age. Only the
+    * rename of the current file is done by the writing thread; the older
+    * files are shifted and compressed on a thread pool thread.
+    */
+    class file_sink
+    {
+        struct rotation;
+
+        std::string m_filename;
+        HANDLE m_file;
+        DWORD m_volume;       // identity of the open file, to detect rotation
+        DWORD m_index_high;
+        DWORD m_index_low;
+        std::string m_buffer;
+        std::unique_ptr<compressor> m_compressor;
+        std::string m_compressed;  // reused output of the compressor
+        std::shared_ptr<rotation> m_rotation;
+        unsigned long long m_size; // size of the open file
+        timer::time_point m_opened;
+        file_sync m_sync;
+        unsigned int m_sync_period;
+        timer::time_point m_last_sync;
+
+    public:
+        /**
+        * Creates a sink for the file. File is opened on the first write.
+        * @param filename Name of the file, created if it doesn't exist
+        */
+        explicit file_sink(const std::string& filename);
+        ~file_sink();
+
+        /**
+        * Specifies when the written data is forced to disk.
+        * @param policy Sync policy
+        * @param period For SyncPeriodically, minimum time between syncs, in seconds
+        * @throws config_exception Thrown if periodic sync is requested with 0 period
+        */
+        void sync(file_sync policy, unsigned int period = 0);
+
+        /**
+        * Specifies whether the written data is compressed.
+        * @param method Compression method
+        * @param level Compression level, see compressor::compressor()
+        * @throws config_exception Thrown if compression method is not
+        *         compiled in, or if level is out of range
+        */
+        void compress(file_compression method, int level = 0);
+
+        /**
+        * Specifies when the file is rotated. The rotated file is renamed to
+        * `<filename>.1`, and the previously rotated files are shifted to
+        * `<filename>.2`, `<filename>.3`... up to `keep`; older ones are deleted.
+        * @param max_bytes The file is rotated before a write which would make
+        *        it bigger than this. 0 means no size limit
+        * @param max_age The file is rotated after it was written to for this
+        *        many seconds, up to a week. 0 means no time limit
+        * @param keep Number of rotated files which are kept
+        * @param compression Compression of rotated files, `.gz` or `.zst` is
+        *        appended to their names. Use it only with uncompressed writes
+        * @throws config_exception Thrown if neither limit is set, if a limit
+        *         or keep is out of range or if compression is not compiled in
+        */
+        void rotate(unsigned long long max_bytes, unsigned int max_age, unsigned int keep,
+            file_compression compression = NoCompression);
+
+        /// waits until the rotated files are shifted and compressed
+        void wait_for_rotation();
+
+        /// buffer to be filled with the data for the next write. It keeps
+        /// its capacity between writes
+        std::string& buffer() { return m_buffer; }
+
+        /**
+        * Appends the buffer content to the file and clears the buffer.
+        * @return `false` if the file can't be opened or written to
+        */
+        bool write();
+
+        /**
+        * Appends the data to the file, bypassing the buffer. Used to write
+        * data which was formatted once and is shared with other writers.
+        * @return `false` if the file can't be opened or written to
+        */
+        bool write(const std::string& data);
+
+        /// closes the file. It is reopened on the next write
+        void close();
+
+        const std::string& filename() const { return m_filename; }
+
+    private:
+        bool open();
+        bool rotated() const;
+        bool rotation_due(size_t next_write) const;
+        void rotate_now();
+        void sync_if_needed();
+
+        file_sink(const file_sink&);
+        file_sink& operator=(const file_sink&);
+    };
+}
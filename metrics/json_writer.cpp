@@ -0,0 +1,427 @@
+#include "stdafx.h"
+#include "json_writer.h"
+#include <string.h>
+
+namespace metrics
+{
+    // Shortest round-trip double formatting, using Grisu2 (Florian Loitsch,
+    // "Printing floating-point numbers quickly and accurately with integers").
+    // Output always parses back to the same double, and is the shortest such
+    // representation for all but a tiny fraction of values. It is several
+    // times faster than printing with increasing precision until strtod agrees.
+    typedef unsigned long long u64;
+
+    // a floating point number as f * 2^e, with 64 bit significand
+    struct diy_fp
+    {
+        u64 f;
+        int e;
+
+        diy_fp() : f(0), e(0) { ; }
+        diy_fp(u64 fp, int exp) : f(fp), e(exp) { ; }
+
+        explicit diy_fp(double d)
+        {
+            u64 bits;
+            memcpy(&bits, &d, sizeof(bits));
+            int biased_e = (int)((bits & EXPONENT_MASK) >> SIGNIFICAND_SIZE);
+            u64 significand = bits & SIGNIFICAND_MASK;
+            if (biased_e != 0) {
+                f = significand + HIDDEN_BIT;
+                e = biased_e - EXPONENT_BIAS;
+            }
+            else { // denormal
+                f = significand;
+                e = 1 - EXPONENT_BIAS;
+            }
+        }
+
+        diy_fp operator-(const diy_fp& rhs) const { return diy_fp(f - rhs.f, e); }
+
+        // product, rounded to upper 64 bits
+        diy_fp operator*(const diy_fp& rhs) const
+        {
+            const u64 M32 = 0xFFFFFFFF;
+            u64 a = f >> 32, b = f & M32, c = rhs.f >> 32, d = rhs.f & M32;
+            u64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+            u64 tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+            tmp += 1U << 31;
+            return diy_fp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), e + rhs.e + 64);
+        }
+
+        diy_fp normalize() const
+        {
+            diy_fp res = *this;
+            while (!(res.f & (1ULL << 63))) {
+                res.f <<= 1;
+                res.e--;
+            }
+            return res;
+        }
+
+        // boundaries m- and m+ of the interval which rounds to this value,
+        // both with the exponent of normalized m+
+        void normalized_boundaries(diy_fp* minus, diy_fp* plus) const
+        {
+            diy_fp pl((f << 1) + 1, e - 1);
+            while (!(pl.f & (HIDDEN_BIT << 1))) {
+                pl.f <<= 1;
+                pl.e--;
+            }
+            pl.f <<= 64 - SIGNIFICAND_SIZE - 2;
+            pl.e -= 64 - SIGNIFICAND_SIZE - 2;
+
+            // lower boundary is closer if f is a power of two
+            diy_fp mi = (f == HIDDEN_BIT) ? diy_fp((f << 2) - 1, e - 2) : diy_fp((f << 1) - 1, e - 1);
+            mi.f <<= mi.e - pl.e;
+            mi.e = pl.e;
+            *plus = pl;
+            *minus = mi;
+        }
+
+        static const int SIGNIFICAND_SIZE = 52;
+        static const int EXPONENT_BIAS = 0x3FF + SIGNIFICAND_SIZE;
+        static const u64 EXPONENT_MASK = 0x7FF0000000000000ULL;
+        static const u64 SIGNIFICAND_MASK = 0x000FFFFFFFFFFFFFULL;
+        static const u64 HIDDEN_BIT = 0x0010000000000000ULL;
+    };
+
+    // 10^k for k = -348, -340, ..., 340, normalized to 64 bit significands
+    static diy_fp cached_power(int e, int* K)
+    {
+        static const u64 powers_f[] = {
+        0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+        0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+        0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+        0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+        0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+        0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+        0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+        0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+        0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+        0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+        0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+        0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+        0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+        0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+        0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+        0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+        0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+        0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+        0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+        0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+        0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+        0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+        };
+        static const short powers_e[] = {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+        -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661,
+        -635, -608, -582, -555, -529, -502, -475, -449, -422, -396, -369,
+        -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77,
+        -50, -24, 3, 30, 56, 83, 109, 136, 162, 189, 216,
+        242, 269, 295, 322, 348, 375, 402, 428, 455, 481, 508,
+        534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800,
+        827, 853, 880, 907, 933, 960, 986, 1013, 1039, 1066,
+        };
+
+        // k = ceil((-61 - e) * log10(2))
+        double dk = (-61 - e) * 0.30102999566398114 + 347;
+        int k = (int)dk;
+        if (dk - k > 0.0) k++;
+
+        unsigned int index = (unsigned int)((k >> 3) + 1);
+        *K = -(-348 + (int)(index << 3));
+        return diy_fp(powers_f[index], powers_e[index]);
+    }
+
+    static const u64 POW10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+        100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+        10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+    };
+
+    static void grisu_round(char* buffer, int len, u64 delta, u64 rest, u64 ten_kappa, u64 wp_w)
+    {
+        while (rest < wp_w && delta - rest >= ten_kappa &&
+            (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+            buffer[len - 1]--;
+            rest += ten_kappa;
+        }
+    }
+
+    static int count_digits(unsigned int n)
+    {
+        int digits = 1;
+        while (digits < 10 && n >= POW10[digits]) digits++;
+        return digits;
+    }
+
+    static void digit_gen(const diy_fp& W, const diy_fp& Mp, u64 delta, char* buffer, int* len, int* K)
+    {
+        const diy_fp one(1ULL << -Mp.e, Mp.e);
+        const diy_fp wp_w = Mp - W;
+        unsigned int p1 = (unsigned int)(Mp.f >> -one.e);
+        u64 p2 = Mp.f & (one.f - 1);
+        int kappa = count_digits(p1);
+        *len = 0;
+
+        // integral part
+        while (kappa > 0) {
+            unsigned int pow = (unsigned int)POW10[kappa - 1];
+            unsigned int d = p1 / pow;
+            p1 %= pow;
+            if (d || *len) buffer[(*len)++] = (char)('0' + d);
+            kappa--;
+            u64 tmp = ((u64)p1 << -one.e) + p2;
+            if (tmp <= delta) {
+                *K += kappa;
+                grisu_round(buffer, *len, delta, tmp, POW10[kappa] << -one.e, wp_w.f);
+                return;
+            }
+        }
+
+        // fractional part
+        for (;;) {
+            p2 *= 10;
+            delta *= 10;
+            char d = (char)(p2 >> -one.e);
+            if (d || *len) buffer[(*len)++] = (char)('0' + d);
+            p2 &= one.f - 1;
+            kappa--;
+            if (p2 < delta) {
+                *K += kappa;
+                int index = -kappa;
+                grisu_round(buffer, *len, delta, p2, one.f, wp_w.f * (index < 20 ? POW10[index] : 0));
+                return;
+            }
+        }
+    }
+
+    // writes the digits of a positive value to buffer, value = digits * 10^K
+    static void grisu2(double value, char* buffer, int* len, int* K)
+    {
+        const diy_fp v(value);
+        diy_fp w_m, w_p;
+        v.normalized_boundaries(&w_m, &w_p);
+
+        const diy_fp c_mk = cached_power(w_p.e, K);
+        const diy_fp W = v.normalize() * c_mk;
+        diy_fp Wp = w_p * c_mk;
+        diy_fp Wm = w_m * c_mk;
+        Wm.f++;
+        Wp.f--;
+        digit_gen(W, Wp, Wp.f - Wm.f, buffer, len, K);
+    }
+
+    static char* write_exponent(int K, char* buffer)
+    {
+        if (K < 0) {
+            *buffer++ = '-';
+            K = -K;
+        }
+        if (K >= 100) {
+            *buffer++ = (char)('0' + K / 100);
+            K %= 100;
+            *buffer++ = (char)('0' + K / 10);
+            *buffer++ = (char)('0' + K % 10);
+        }
+        else if (K >= 10) {
+            *buffer++ = (char)('0' + K / 10);
+            *buffer++ = (char)('0' + K % 10);
+        }
+        else {
+            *buffer++ = (char)('0' + K);
+        }
+        return buffer;
+    }
+
+    // turns digits * 10^k into decimal or exponential notation, returns the end
+    static char* prettify(char* buffer, int length, int k)
+    {
+        const int kk = length + k;  // 10^(kk - 1) <= v < 10^kk
+
+        if (0 <= k && kk <= 21) {
+            // 1234e7 -> 12340000000.0
+            for (int i = length; i < kk; i++) buffer[i] = '0';
+            buffer[kk] = '.';
+            buffer[kk + 1] = '0';
+            return &buffer[kk + 2];
+        }
+        if (0 < kk && kk <= 21) {
+            // 1234e-2 -> 12.34
+            memmove(&buffer[kk + 1], &buffer[kk], length - kk);
+            buffer[kk] = '.';
+            return &buffer[length + 1];
+        }
+        if (-6 < kk && kk <= 0) {
+            // 1234e-6 -> 0.001234
+            const int offset = 2 - kk;
+            memmove(&buffer[offset], &buffer[0], length);
+            buffer[0] = '0';
+            buffer[1] = '.';
+            for (int i = 2; i < offset; i++) buffer[i] = '0';
+            return &buffer[length + offset];
+        }
+        if (length == 1) {
+            // 1e30
+            buffer[1] = 'e';
+            return write_exponent(kk - 1, &buffer[2]);
+        }
+        // 1234e30 -> 1.234e33
+        memmove(&buffer[2], &buffer[1], length - 1);
+        buffer[1] = '.';
+        buffer[length + 1] = 'e';
+        return write_exponent(kk - 1, &buffer[length + 2]);
+    }
+
+    json_writer::json_writer(std::string& out) : m_out(out), m_depth(0), m_keyed(false)
+    {
+        m_first[0] = true;
+    }
+
+    void json_writer::separate()
+    {
+        if (!m_first[m_depth]) m_out += ',';
+        m_first[m_depth] = false;
+    }
+
+    void json_writer::begin_value()
+    {
+        if (m_keyed) m_keyed = false; // value of a key, already separated
+        else separate();
+    }
+
+    json_writer& json_writer::begin_object()
+    {
+        if (m_depth + 1 >= MAX_DEPTH) return *this; // too deep, caller's bug
+        begin_value();
+        m_out += '{';
+        m_first[++m_depth] = true;
+        return *this;
+    }
+
+    json_writer& json_writer::end_object()
+    {
+        if (m_depth > 0) --m_depth;
+        m_out += '}';
+        return *this;
+    }
+
+    json_writer& json_writer::key(const char* name)
+    {
+        separate();
+        write_string(m_out, name, strlen(name));
+        m_out += ':';
+        m_keyed = true;
+        return *this;
+    }
+
+    json_writer& json_writer::key(const std::string& name)
+    {
+        separate();
+        write_string(m_out, name.c_str(), name.size());
+        m_out += ':';
+        m_keyed = true;
+        return *this;
+    }
+
+    json_writer& json_writer::value(const char* text)
+    {
+        begin_value();
+        write_string(m_out, text, strlen(text));
+        return *this;
+    }
+
+    json_writer& json_writer::value(const std::string& text)
+    {
+        begin_value();
+        write_string(m_out, text.c_str(), text.size());
+        return *this;
+    }
+
+    json_writer& json_writer::value(double number)
+    {
+        begin_value();
+        write_double(m_out, number);
+        return *this;
+    }
+
+    json_writer& json_writer::value(long long number)
+    {
+        begin_value();
+        char txt[24];
+        int len = _snprintf_s(txt, _countof(txt), _TRUNCATE, "%lld", number);
+        m_out.append(txt, len);
+        return *this;
+    }
+
+    json_writer& json_writer::value(int number)
+    {
+        return value((long long)number);
+    }
+
+    void json_writer::end_line()
+    {
+        m_out += '\n';
+        m_depth = 0;
+        m_first[0] = true;
+        m_keyed = false;
+    }
+
+    void json_writer::write_string(std::string& out, const char* text, size_t len)
+    {
+        static const char hex[] = "0123456789ABCDEF";
+
+        out += '"';
+        const char* run = text;  // start of characters which need no escaping
+        const char* end = text + len;
+        for (const char* c = text; c < end; ++c) {
+            unsigned char ch = (unsigned char)*c;
+            if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+
+            out.append(run, c - run);
+            run = c + 1;
+            switch (ch) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default: {
+                    char esc[] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+                    out.append(esc, sizeof(esc));
+                }
+            }
+        }
+        out.append(run, end - run);
+        out += '"';
+    }
+
+    void json_writer::write_double(std::string& out, double number)
+    {
+        if (number != number || number - number != 0) { // NaN or infinity
+            out += "null";
+            return;
+        }
+
+        char txt[32];
+        char* pos = txt;
+        if (number < 0 || (number == 0 && 1 / number < 0)) {
+            *pos++ = '-';
+            number = -number;
+        }
+        if (number == 0) {
+            out.append(txt, pos - txt);
+            out += "0.0";
+            return;
+        }
+
+        int length, K;
+        grisu2(number, pos, &length, &K);
+        char* end = prettify(pos, length, K);
+        out.append(txt, end - txt);
+    }
+}
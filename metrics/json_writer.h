@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+
+namespace metrics
+{
+    /**
+    * Streaming JSON encoder which appends to a caller-provided buffer. It
+    * doesn't allocate anything itself, so when the buffer is reused, encoding
+    * doesn't allocate at all once the buffer has grown large enough.
+    *
+    * The writer takes care of commas, but not of the structure: it is up to
+    * the caller to produce a valid sequence of calls.
+    *
+    * ~~~{.cpp}
+    * std::string buffer;
+    * metrics::json_writer json(buffer);
+    * json.begin_object().key("count").value(42).end_object();  // {"count":42}
+    * ~~~
+    */
+    class json_writer
+    {
+        static const int MAX_DEPTH = 16;
+
+        std::string& m_out;
+        bool m_first[MAX_DEPTH]; // no value written yet at this nesting level
+        int m_depth;
+        bool m_keyed;            // key was written, its value is expected
+
+    public:
+        /// creates a writer which appends to the `out` buffer
+        explicit json_writer(std::string& out);
+
+        json_writer& begin_object();
+        json_writer& end_object();
+
+        /// writes the key of the next value in the current object
+        json_writer& key(const char* name);
+        json_writer& key(const std::string& name);
+
+        json_writer& value(const char* text);
+        json_writer& value(const std::string& text);
+        json_writer& value(double number);
+        json_writer& value(long long number);
+        json_writer& value(int number);
+
+        /// ends a top level value with a newline, e.g. for NDJSON output
+        void end_line();
+
+        /// appends a quoted and escaped JSON string
+        static void write_string(std::string& out, const char* text, size_t len);
+
+        /**
+        * Appends the number so that it parses back to exactly the same value,
+        * using the shortest representation for all but a tiny fraction of
+        * values (Grisu2). Whole numbers are written with ".0" so they
+        * read back as floating point numbers. NaN and infinity are written as
+        * `null`, as JSON can't represent them.
+        */
+        static void write_double(std::string& out, double number);
+
+    private:
+        void separate();
+        void begin_value();
+
+        json_writer(const json_writer&);
+        json_writer& operator=(const json_writer&);
+    };
+}
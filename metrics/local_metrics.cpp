@@ -0,0 +1,162 @@
+#include "stdafx.h"
+#include "local_metrics.h"
+#include "metrics_server.h"
+#include "sync.h"
+#include <malloc.h>
+#include <vector>
+
+#define thread_local __declspec( thread )
+
+namespace metrics
+{
+    // slots of one thread take 4 KB, the whole array is written by one thread only
+    const unsigned int MAX_LOCAL_METRICS = 1024;
+    const size_t CACHE_LINE = 64;
+
+    // slots of one thread, aligned to a cache line, so that no line is shared
+    // with slots of another thread
+    struct local_slots
+    {
+        volatile unsigned int* values;
+        HANDLE thread; // signaled when the owning thread exits, may be NULL
+
+        local_slots() : thread(OpenThread(SYNCHRONIZE, FALSE, GetCurrentThreadId())) {
+            size_t size = MAX_LOCAL_METRICS * sizeof(unsigned int);
+            values = (volatile unsigned int*)_aligned_malloc(size, CACHE_LINE);
+            if (values) memset((void*)values, 0, size);
+        }
+        ~local_slots() {
+            if (thread) CloseHandle(thread);
+            _aligned_free((void*)values);
+        }
+
+    private:
+        local_slots(const local_slots&);
+        local_slots& operator=(const local_slots&);
+    };
+
+    struct local_metric
+    {
+        std::string name;
+        bool is_gauge;
+        unsigned int retired;  // sum of slots of threads which have exited
+        unsigned int flushed;  // total at the previous flush, for counters
+    };
+
+    struct local_registry
+    {
+        CRITICAL_SECTION lock;
+        std::vector<local_metric> metrics;
+        std::vector<local_slots*> threads;
+
+        local_registry() { InitializeCriticalSection(&lock); }
+        ~local_registry() {
+            FOR_EACH (auto t, threads) delete t;
+            DeleteCriticalSection(&lock);
+        }
+    };
+
+    // created on first use, so that global counters can be registered during
+    // static initialization
+    static local_registry& registry()
+    {
+        static local_registry r;
+        return r;
+    }
+
+    thread_local static volatile unsigned int* t_slots = NULL;
+
+    static unsigned int register_local(METRIC_ID metric, bool is_gauge)
+    {
+        local_registry& r = registry();
+        scoped_lock _(&r.lock);
+        for (size_t i = 0; i < r.metrics.size(); ++i) {
+            if (r.metrics[i].name == metric && r.metrics[i].is_gauge == is_gauge) return (unsigned int)i;
+        }
+        if (r.metrics.size() >= MAX_LOCAL_METRICS) throw std::runtime_error("Too many local metrics");
+
+        local_metric m;
+        m.name = metric;
+        m.is_gauge = is_gauge;
+        m.retired = 0;
+        m.flushed = 0;
+        r.metrics.push_back(m);
+        return (unsigned int)r.metrics.size() - 1;
+    }
+
+    // slots of the calling thread, created on its first update
+    static volatile unsigned int* thread_slots()
+    {
+        volatile unsigned int* slots = t_slots;
+        if (slots) return slots;
+
+        local_slots* s = new local_slots();
+        if (!s->values) {
+            delete s;
+            throw std::bad_alloc();
+        }
+        local_registry& r = registry();
+        scoped_lock _(&r.lock);
+        r.threads.push_back(s);
+        t_slots = s->values;
+        return s->values;
+    }
+
+    local_counter::local_counter(METRIC_ID metric) : m_id(register_local(metric, false)) { ; }
+
+    void local_counter::inc(unsigned int value)
+    {
+        thread_slots()[m_id] += value; // only this thread writes the slot
+    }
+
+    local_gauge::local_gauge(METRIC_ID metric) : m_id(register_local(metric, true)) { ; }
+
+    void local_gauge::add(int delta)
+    {
+        thread_slots()[m_id] += (unsigned int)delta;
+    }
+
+    void flush_local(stats& stats)
+    {
+        local_registry& r = registry();
+        scoped_lock _(&r.lock);
+        if (r.metrics.empty()) return;
+
+        // slots are summed modulo 2^32, which is exact for increases below 2^32 per flush
+        std::vector<unsigned int> totals(r.metrics.size());
+        for (size_t i = 0; i < totals.size(); ++i) totals[i] = r.metrics[i].retired;
+
+        for (size_t t = 0; t < r.threads.size(); ) {
+            local_slots* s = r.threads[t];
+            // checked first, so that the slots don't change after they are read
+            bool exited = s->thread && WaitForSingleObject(s->thread, 0) == WAIT_OBJECT_0;
+            for (size_t i = 0; i < totals.size(); ++i) {
+                unsigned int value = s->values[i];
+                totals[i] += value;
+                if (exited) r.metrics[i].retired += value;
+            }
+            if (exited) {
+                delete s;
+                r.threads.erase(r.threads.begin() + t);
+            }
+            else {
+                ++t;
+            }
+        }
+
+        auto period = stats.period_ms / 1000.0;
+        std::string name;
+        for (size_t i = 0; i < totals.size(); ++i) {
+            local_metric& m = r.metrics[i];
+            name = g_client.get_namespace();
+            name.append(".").append(m.name);
+            if (m.is_gauge) {
+                stats.gauges[name] = (int)totals[i];
+            }
+            else {
+                stats.counters[name] = period > 0 ? (totals[i] - m.flushed) / period : 0;
+                m.flushed = totals[i];
+            }
+        }
+    }
+}
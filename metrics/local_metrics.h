@@ -0,0 +1,66 @@
+#pragma once
+
+#include "metrics.h"
+
+namespace metrics
+{
+    struct stats;
+
+    /**
+    * Counter for the in-process server, which costs a few nanoseconds to
+    * update, also when many threads update it at once. Each thread adds to
+    * its own slot, without atomic operations or shared cache lines, and the
+    * server sums the slots of all threads at each flush.
+    *
+    * Counters are registered by name, and live until the process exits, so
+    * they are best created once, e.g. as globals. Creating another counter
+    * with the same name returns the same counter. The flushed value is
+    * the increase since the previous flush, per second, like for counters
+    * sent by clients.
+    *
+    * ~~~{.cpp}
+    * metrics::local_counter g_requests("app.requests");
+    *
+    * void on_request() {
+    *     g_requests.inc();
+    *     ...
+    * }
+    * ~~~
+    */
+    class local_counter
+    {
+        unsigned int m_id;
+
+    public:
+        /**
+        * Registers the counter
+        * @param metric Name of the counter, the client namespace is prepended at flush
+        * @throws std::runtime_error Thrown if too many local metrics are registered
+        */
+        explicit local_counter(METRIC_ID metric);
+
+        /// adds the value to the slot of the calling thread
+        void inc(unsigned int value = 1);
+    };
+
+    /**
+    * Gauge for the in-process server, which threads adjust by deltas, e.g.
+    * the number of requests in progress. Like local_counter, each thread
+    * adds to its own slot, and the flushed value is the sum of all deltas.
+    */
+    class local_gauge
+    {
+        unsigned int m_id;
+
+    public:
+        /// see local_counter::local_counter
+        explicit local_gauge(METRIC_ID metric);
+
+        /// adds the delta to the slot of the calling thread
+        void add(int delta);
+    };
+
+    // adds all local metrics to the stats, summing the slots of all threads,
+    // and releases slots of threads which have exited. Called on the server thread
+    void flush_local(stats& stats);
+}
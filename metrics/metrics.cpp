@@ -1,5 +1,8 @@
 #include "stdafx.h"
 #include "metrics.h"
+#include "default_metrics.h"
+#include "resolver.h"
+#include "direct_sink.h"
 #include "string.h"
 #include "stdlib.h"
 #include <cstdarg>
@@ -10,6 +13,15 @@ namespace metrics
 {
     client_config g_client;
 
+    // resolvers replaced by setup_client, kept so that addresses read from them stay valid
+    static std::vector<std::shared_ptr<address_resolver> > g_retired_resolvers;
+
+    // see client_errors, updated by all sending threads
+    static volatile LONG g_send_errors = 0;
+    static volatile LONG g_would_block = 0;
+    static volatile LONG g_oversized = 0;
+    static volatile LONG g_unresolved = 0;
+
     void ensure_winsock_started()
     {
         SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
@@ -34,6 +46,13 @@ namespace metrics
 
     timer::time_point timer::now(){ return GetTickCount(); }
     timer::duration timer::since(int when){ return now() - when; }
+    long long timer::now_us()
+    {
+        LARGE_INTEGER now, freq;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&freq);
+        return now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+    }
     std::string timer::to_string(timer::time_point time)
     { 
         FILETIME tm;
@@ -54,39 +73,48 @@ namespace metrics
         return txt;
     }
 
+    long long timer::to_unix_ms(timer::time_point time)
+    {
+        FILETIME tm;
+        GetSystemTimeAsFileTime(&tm);
+        auto diff = now() - time;
+
+        _ULARGE_INTEGER ui;
+        ui.LowPart = tm.dwLowDateTime;
+        ui.HighPart = tm.dwHighDateTime;
+        const ULONGLONG epoch_offset = 116444736000000000ULL; // 1601-01-01 to 1970-01-01, in 100 ns
+        return (long long)((ui.QuadPart - epoch_offset) / 10000) - diff;
+    }
+
     client_config& setup_client(const std::string& server, unsigned int port)
     {
         if (server.size() < 1)  throw config_exception("specified server can't be an empty string");
 
         ensure_winsock_started();
 
+        // the new resolver replaces the old one only if the server is valid
+        std::shared_ptr<address_resolver> resolver(new address_resolver(server, port, g_client.m_resolve_interval));
         g_client.m_server = server;
         g_client.m_port = port;
+        g_client.m_resolver.swap(resolver);
+        InterlockedExchangePointer((PVOID volatile*)&g_client.m_active, g_client.m_resolver.get());
 
-        // let's cache the server address for later use
-        memset((char*)&g_client.m_svr_address, 0, sizeof(g_client.m_svr_address));
-        g_client.m_svr_address.sin_family = AF_INET;
-        g_client.m_svr_address.sin_port = htons(g_client.m_port);
-
-        struct hostent* hp = gethostbyname(g_client.m_server.c_str());
-        if (!hp) {
-            char msg[256];
-            auto fmt = "Could not obtain address of %s. Error: %d";
-            auto server = g_client.m_server.c_str();
-            _snprintf_s(msg, _countof(msg), _TRUNCATE, fmt, server, WSAGetLastError());
-            dbg_print(msg);
-            throw config_exception(msg);
+        // senders may still use the address of the old resolver, it only stops refreshing
+        if (resolver) {
+            resolver->stop();
+            g_retired_resolvers.push_back(resolver);
         }
-
-        memcpy((void *)&g_client.m_svr_address.sin_addr, hp->h_addr_list[0], hp->h_length);
         return g_client;
     }
 
     client_config::client_config() :
         m_debug(false),
+        m_direct(false),
         m_defaults_period(60),
+        m_resolve_interval(60),
         m_default_metrics(none),
         m_port(0),
+        m_active(NULL),
         m_namespace("stats")
     {;}
 
@@ -94,10 +122,22 @@ namespace metrics
         m_debug = debug;
         return *this;
     }
+    client_config& client_config::set_direct(bool direct) {
+        m_direct = direct;
+        return *this;
+    }
     client_config& client_config::track_default_metrics(builtin_metric which, unsigned int period) {
         if (period < 1)  throw config_exception("specified period must be greater than 0");
         m_defaults_period = period;
         m_default_metrics = which;
+        m_collector.reset(); // previous collector has to stop first
+        if (which & (system | process | client)) m_collector.reset(new default_metrics(which, period));
+        return *this;
+    }
+    client_config& client_config::set_resolve_interval(unsigned int seconds) {
+        if (seconds < 1)  throw config_exception("specified interval must be greater than 0");
+        m_resolve_interval = seconds;
+        if (m_resolver) m_resolver->set_interval(seconds);
         return *this;
     }
     client_config& client_config::set_namespace(const std::string& ns) {
@@ -107,6 +147,11 @@ namespace metrics
 
     bool client_config::is_debug() const { return m_debug; }
     const char* client_config::get_namespace() const { return m_namespace.c_str(); }
+    const resolved_address* client_config::server_address() const
+    {
+        address_resolver* resolver = m_active;
+        return resolver ? resolver->current() : NULL;
+    }
 
     const char* const fmt(metric_type m) 
     {
@@ -122,22 +167,53 @@ namespace metrics
     void send_to_server(const char* txt, size_t len)
     {
         thread_local static SOCKET fd = INVALID_SOCKET;
+        thread_local static int family = AF_UNSPEC;
 
+        const resolved_address* address = g_client.server_address();
+        if (!address) {
+            InterlockedIncrement(&g_unresolved);
+            dbg_print("server address not known yet, metric dropped");
+            return;
+        }
+
+        // address family can change when the host name is resolved again
+        if (fd != INVALID_SOCKET && family != address->addr.ss_family) {
+            closesocket(fd);
+            fd = INVALID_SOCKET;
+        }
         if (fd == INVALID_SOCKET) {
-            fd = socket(AF_INET, SOCK_DGRAM, 0);
+            family = address->addr.ss_family;
+            fd = socket(family, SOCK_DGRAM, 0);
             if (fd == INVALID_SOCKET) { // create a UDP socket
+                InterlockedIncrement(&g_send_errors);
                 dbg_print("cannot create client socket: error: %d", WSAGetLastError());
                 return;
             }
         }
 
         /* send a message to the server */   
-        const sockaddr* paddr = (sockaddr*) g_client.server_address();
-        if (sendto(fd, txt, len, 0, paddr, sizeof(*g_client.server_address())) == SOCKET_ERROR) {
-            dbg_print("sendto failed, error: %d", WSAGetLastError());
+        if (sendto(fd, txt, len, 0, (const sockaddr*)&address->addr, address->len) == SOCKET_ERROR) {
+            int err = WSAGetLastError();
+            InterlockedIncrement(err == WSAEWOULDBLOCK || err == WSAENOBUFS ? &g_would_block : &g_send_errors);
+            dbg_print("sendto failed, error: %d", err);
         }
     }
 
+    void count_oversized()
+    {
+        InterlockedIncrement(&g_oversized);
+    }
+
+    client_errors get_client_errors()
+    {
+        client_errors errors;
+        errors.send_errors = InterlockedCompareExchange(&g_send_errors, 0, 0);
+        errors.would_block = InterlockedCompareExchange(&g_would_block, 0, 0);
+        errors.oversized = InterlockedCompareExchange(&g_oversized, 0, 0);
+        errors.unresolved = InterlockedCompareExchange(&g_unresolved, 0, 0);
+        return errors;
+    }
+
     inline void dbg_print(const char* fmt, ...) {
         if (!g_client.is_debug()) return;
 
@@ -150,40 +226,51 @@ namespace metrics
     }
 
     template <metric_type m>
-    void signal(const char* metric, int val) {
-        char txt[256]; 
+    void signal(const char* metric, int val, const char* tags) {
         auto ns = g_client.get_namespace();
+        if (g_client.is_direct()) {
+            direct_result result = record_direct(m, ns, metric, val, tags);
+            if (result == direct_full) InterlockedIncrement(&g_would_block);
+            if (result != direct_off) return;
+        }
+
+        char txt[256]; 
         int ret = _snprintf_s(txt, _countof(txt), _TRUNCATE, fmt(m), ns, metric, val);
+        if (ret > 0 && tags && *tags) {
+            int len = _snprintf_s(txt + ret, _countof(txt) - ret, _TRUNCATE, "|#%s", tags);
+            ret = len < 0 ? len : ret + len;
+        }
 
         if (ret < 1) {
+            count_oversized();
             dbg_print("error: metric %s didn't fit", metric);
         }
         else {
-            send_to_server(txt, strlen(txt));
+            send_to_server(txt, ret);
             dbg_print("%s", txt);
         }
     }
 
     auto_timer::auto_timer(METRIC_ID metric) : m_metric(metric), m_started_at(timer::now()) {}
-    auto_timer::~auto_timer() { signal<histogram>(m_metric, timer::since(m_started_at)); }
+    auto_timer::~auto_timer() { signal<histogram>(m_metric, timer::since(m_started_at), NULL); }
 
-    void inc(METRIC_ID metric, int inc)
+    void inc(METRIC_ID metric, int inc, METRIC_TAGS tags)
     {
-        signal<counter>(metric, inc);
+        signal<counter>(metric, inc, tags);
     }
 
-    void measure(METRIC_ID metric, int value)
+    void measure(METRIC_ID metric, int value, METRIC_TAGS tags)
     {
-        signal<histogram>(metric, value);
+        signal<histogram>(metric, value, tags);
     }
 
-    void set(METRIC_ID metric, unsigned int value)
+    void set(METRIC_ID metric, unsigned int value, METRIC_TAGS tags)
     {
-        signal<gauge>(metric, value);
+        signal<gauge>(metric, value, tags);
     }
 
-    void set_delta(METRIC_ID metric, int value)
+    void set_delta(METRIC_ID metric, int value, METRIC_TAGS tags)
     {
-        signal<gauge_delta>(metric, value);
+        signal<gauge_delta>(metric, value, tags);
     }
 }
\ No newline at end of file
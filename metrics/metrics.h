@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <memory>
 #include "Winsock2.h"
 
 #pragma comment (lib, "ws2_32.lib")
@@ -27,6 +28,7 @@ namespace metrics
         process = 1,       ///< process related metrics 
         system  = 2,       ///< system-wide metrics 
         metrics = 4,       ///< internal metrics (last_seen, total count, ...)
+        client  = 8,       ///< metrics which the client couldn't send, see client_errors
         all     = 0xFFFF   ///< track all metrics
     };
 
@@ -45,9 +47,15 @@ namespace metrics
 
     typedef const char* METRIC_ID;
 
+    /// comma separated `key:value` tags, e.g. "code:200,method:get". Metrics
+    /// with different tags are tracked separately, but the order of tags
+    /// doesn't matter. NULL means no tags.
+    typedef const char* METRIC_TAGS;
+
     void ensure_winsock_started();
     inline void dbg_print(const char* fmt, ...);
     void send_to_server(const char* txt, size_t len);
+    void count_oversized(); // counts a metric dropped because it didn't fit
 
     // 1700 is VS2012  - VS2010 doesn't support official range based for loop
     #if _MSC_VER < 1700
@@ -63,8 +71,10 @@ namespace metrics
         typedef int time_point;  // todo: ULONGLONG, int is limited to ~50 days
         typedef int duration;
         static time_point now();
+        static long long now_us(); ///< high resolution time, in microseconds
         static duration since(int when);
         static std::string to_string(timer::time_point time);
+        static long long to_unix_ms(timer::time_point time); ///< ms since unix epoch
     };
     /// used to notify client code about errors during client or server 
     /// configuration
@@ -78,45 +88,68 @@ namespace metrics
     namespace builtin {
         const char internal_metrics_count[] = "metrics.internal.count"; ///< Number of metrics tracked
         const char internal_metrics_last_seen[] = "metrics.internal.last_seen"; ///< timestamp of last metric
+        const char internal_flush_time[] = "metrics.internal.flush_time"; ///< processing time of previous flush, in us
+        const char internal_syslog_errors[] = "metrics.internal.syslog.errors"; ///< syslog datagrams which couldn't be sent
+        const char internal_forward_dropped[] = "metrics.internal.forward.dropped"; ///< statsd lines dropped by the forwarding rate limit
+        const char internal_cardinality_rejected[] = "metrics.internal.cardinality.rejected"; ///< values of metrics over the cardinality limit, tagged by prefix for the top offenders
+        const char internal_cardinality_overflow_counter[] = "metrics.internal.cardinality.overflow.counter"; ///< counter which holds values of counters over the cardinality limit
+        const char internal_cardinality_overflow_gauge[] = "metrics.internal.cardinality.overflow.gauge"; ///< gauge which holds values of gauges over the cardinality limit
+        const char internal_cardinality_overflow_timer[] = "metrics.internal.cardinality.overflow.timer"; ///< timer which holds values of timers over the cardinality limit
+        const char internal_persist_dropped[] = "metrics.internal.persist.dropped"; ///< values which didn't fit into the persisted interval file
 
         // GlobalMemoryStatusEx, GetPerformanceInfo, GetSystemTimes 
-        const char sys_mem_phys_used[] = "sys.mem.phys.total"; ///< Total physical memory
-        const char sys_mem_phys_free[] = "sys.mem.phys.free";  ///< Physical memory available 
+        const char sys_mem_phys_used[] = "sys.mem.phys.total"; ///< Total physical memory, in KB
+        const char sys_mem_phys_free[] = "sys.mem.phys.free";  ///< Physical memory available, in KB
         const char sys_mem_phys_load[] = "sys.mem.phys.load";  ///< Percentage of used physical memory
-        const char sys_mem_virtual_used[] = "sys.mem.virt.total"; ///< Total virtual memory
-        const char sys_mem_virtual_free[] = "sys.mem.virt.free";  ///< Available virtual memory
-        const char sys_mem_pagefile_used[] = "sys.mem.page.total";  ///< Total page memory
-        const char sys_mem_pagefile_free[] = "sys.mem.page.free";  ///< Total page memory
+        const char sys_mem_virtual_used[] = "sys.mem.virt.total"; ///< Total virtual memory, in KB
+        const char sys_mem_virtual_free[] = "sys.mem.virt.free";  ///< Available virtual memory, in KB
+        const char sys_mem_pagefile_used[] = "sys.mem.page.total";  ///< Total page memory, in KB
+        const char sys_mem_pagefile_free[] = "sys.mem.page.free";  ///< Available page memory, in KB
         const char sys_cpu_load[] = "sys.cpu.used";  ///< System-wide CPU usage, in %
-        const char sys_disk_free_c[] = "sys.disk.free.c";  ///< Free space on C:\ disk
-        const char sys_disk_free_d[] = "sys.disk.free.d";  ///< Free space on D:\ disk
+        const char sys_disk_free_c[] = "sys.disk.free.c";  ///< Free space on C:\ disk, in MB
+        const char sys_disk_free_d[] = "sys.disk.free.d";  ///< Free space on D:\ disk, in MB
         const char sys_count_handles[] = "sys.count.handles";  ///< The current number of open handles
         const char sys_count_processes[] = "sys.count.processes";  ///< The current number of processes
         const char sys_count_threads[] = "sys.count.threads";  ///< The current number of threads
 
         // GetProcessMemoryInfo, GetProcessTimes 
-        const char proc_mem_workingset[] = "proc.mem.wset";  ///< The current working set size, in bytes
+        const char proc_mem_workingset[] = "proc.mem.wset";  ///< The current working set size, in KB
         const char proc_mem_pagefaults[] = "proc.mem.pagefaults";  ///< The number of page faults.
-        const char proc_mem_workingset_peek[] = "proc.mem.wset.peak";  ///< The peak working set size, in bytes.
-        const char proc_mem_pagefile[] = "proc.mem.pagefile";  ///< ...
-        const char proc_mem_pagefile_peek[] = "proc.mem.pagefile.peak";  ///< The peak value in bytes of the Commit Charge during the lifetime of this process 
-        const char proc_cpu_load[] = "proc.cpu.total";  ///< ...
-        const char proc_cpu_kernel[] = "proc.cpu.used.kernel";  ///< ...
-        const char proc_cpu_user[] = "proc.cpu.used.user";  ///< ...
+        const char proc_mem_workingset_peek[] = "proc.mem.wset.peak";  ///< The peak working set size, in KB
+        const char proc_mem_pagefile[] = "proc.mem.pagefile";  ///< The Commit Charge of this process, in KB
+        const char proc_mem_pagefile_peek[] = "proc.mem.pagefile.peak";  ///< The peak value of the Commit Charge during the lifetime of this process, in KB
+        const char proc_cpu_load[] = "proc.cpu.total";  ///< CPU usage of this process, in % of all CPUs
+        const char proc_cpu_kernel[] = "proc.cpu.used.kernel";  ///< Kernel mode CPU usage of this process, in %
+        const char proc_cpu_user[] = "proc.cpu.used.user";  ///< User mode CPU usage of this process, in %
+
+        // get_client_errors, sent as counters
+        const char client_send_errors[] = "client.dropped.send_errors";  ///< Metrics lost because sending failed
+        const char client_would_block[] = "client.dropped.would_block";  ///< Metrics lost because socket buffer was full
+        const char client_oversized[] = "client.dropped.oversized";  ///< Metrics which didn't fit into a datagram
+        const char client_unresolved[] = "client.dropped.unresolved";  ///< Metrics sent before server address was resolved
     }
 
     class client_config;
+    class default_metrics;
+    class address_resolver;
+    struct resolved_address;
 
     /**
     * Configures metrics client.
     * Client configuration object specifies the settings for the client. This
     * function will try to start winsock (WSAStartup) if it finds that winsock
     * is not already started.
+    *
+    * IPv4 and IPv6 addresses are used immediately. Host names are resolved
+    * on a background thread, and refreshed periodically (see 
+    * client_config::set_resolve_interval), so this function doesn't wait for
+    * DNS. Metrics sent before the name is resolved for the first time are 
+    * dropped.
     * 
     * @param server The address/name of the server where metrics will be sent
     * @param port The port on which the server is listening. Default is 9999
-    * @throws config_exception Thrown if specified hostname can't be found,
-    *         or if automatic winsock startup fails.
+    * @throws config_exception Thrown if specified server is not a valid
+    *         address or host name, or if automatic winsock startup fails.
     * 
     * Example:
     * ~~~{.cpp}
@@ -139,12 +172,16 @@ namespace metrics
         friend client_config& setup_client(const std::string& server, unsigned int port);
 
         bool m_debug;
+        bool m_direct;
         unsigned int m_port;
         unsigned int m_defaults_period;
+        unsigned int m_resolve_interval;
         builtin_metric m_default_metrics;
         std::string m_namespace;
         std::string m_server;
-        SOCK_ADDR_IN m_svr_address;
+        std::shared_ptr<address_resolver> m_resolver;  // shared by copies of the config
+        address_resolver* volatile m_active;           // m_resolver, read by sending threads
+        std::shared_ptr<default_metrics> m_collector;  // ditto
 
     public:
         client_config();
@@ -158,7 +195,9 @@ namespace metrics
         /**
         * Tells client to track default system and process metrics (CPU load,
         * free memory, disk usage, etc). Metrics will be collected on a separate
-        * thread, and they are all handled as gauges.
+        * thread, and they are all handled as gauges, except for `client` 
+        * metrics, which count dropped metrics (see get_client_errors). Calling this again
+        * replaces the previous settings, `none` stops the collection.
         *
         * For list of supported default metrics, check constants in 
         * metrics::builtin namespace
@@ -167,9 +206,34 @@ namespace metrics
         * @param period How often, in seconds, will default metrics be collected.
         *               The default value is 45 seconds, valid values are > 0.
         * @throws config_exception Thrown if period is set to 0
+        * @throws std::runtime_error Thrown if collector thread can't be started
         */
         client_config& track_default_metrics(builtin_metric which = all, unsigned int period = 45);
 
+        /**
+        * Sets how often is the server host name resolved again, so that the
+        * client follows DNS changes. Has no effect if server is specified
+        * by address.
+        * @param seconds Refresh interval in seconds, default is 60. Valid
+        *                values are > 0.
+        * @throws config_exception Thrown if interval is set to 0
+        */
+        client_config& set_resolve_interval(unsigned int seconds);
+
+        /**
+        * Tells the client to bypass UDP when the server runs in the same
+        * process. While an in-process server (server::run) is running,
+        * metrics are recorded into buffers of the calling threads, and the
+        * server stores them at the next flush, without formatting, sending
+        * or parsing them. When no server is running, metrics are sent as
+        * usual. Default metrics are always sent.
+        *
+        * Don't use it if the in-process server is not the server which the
+        * client is set up for, e.g. when the client sends to a remote server.
+        * @param direct Set to `true` to turn direct mode on
+        */
+        client_config& set_direct(bool direct);
+
         /**
         * Specifies the namespace to be used for metrics. The default is "stats"
         * @param ns New namespace to be used
@@ -182,13 +246,17 @@ namespace metrics
         */
         bool is_debug() const;
 
+        /// returns whether metrics bypass UDP when the server is in-process
+        bool is_direct() const { return m_direct; }
+
         /**
         * Returns the current metrics namespace.
         * @return String specifying the namespace.
         */
         const char* get_namespace() const;
 
-        const sockaddr_in* server_address() const { return &m_svr_address; }
+        /// current server address, NULL until host name is resolved
+        const resolved_address* server_address() const;
 
     };
 
@@ -230,24 +298,26 @@ namespace metrics
     *
     *  @param metric The name of the counter to be incremented
     *  @param inc Amount by which to increment the counter. Default value is 1.
+    *  @param tags Tags of the metric, sent in DogStatsD format (`|#k:v,k2:v2`)
     *
     * ~~~ {.cpp}
     * void on_login(const char* user) {
     *     metrics::inc("app.logins");
     *     if (!login(user)) {
-    *        metrics::inc("app.logins.failed");
+    *        metrics::inc("app.logins.failed", 1, "reason:password");
     *        ...
     *     }
     * }   
     * ~~~
     */
-    void inc(METRIC_ID metric, int inc = 1);
+    void inc(METRIC_ID metric, int inc = 1, METRIC_TAGS tags = NULL);
 
     /**
     *  Sets the specified timer/histogram metric
     *
     *  @param metric The name of the timer/histogram to be updated
     *  @param value Amount to which metric will be set.
+    *  @param tags Tags of the metric, see METRIC_TAGS
     *
     * ~~~ {.cpp}
     * void on_login(const char* user) {
@@ -262,12 +332,13 @@ namespace metrics
     *
     * @see auto_timer
     */
-    void measure(METRIC_ID metric, int value);
+    void measure(METRIC_ID metric, int value, METRIC_TAGS tags = NULL);
 
     /**
     *  Sets the specified gauge metric
     *  @param metric The name of the gauge to be updated
     *  @param value Amount to which the gauge will be set.
+    *  @param tags Tags of the metric, see METRIC_TAGS
     *
     * ~~~ {.cpp}
     * void on_login(const char* user) {
@@ -276,12 +347,13 @@ namespace metrics
     * }
     * ~~~
     */
-    void set(METRIC_ID metric, unsigned int value);
+    void set(METRIC_ID metric, unsigned int value, METRIC_TAGS tags = NULL);
 
     /**
     *  Sets the delta for specified gauge metric
     *  @param metric The name of the gauge to be updated
     *  @param value Amount to be added to the the gauge.
+    *  @param tags Tags of the metric, see METRIC_TAGS
     *
     * ~~~ {.cpp}
     * void on_login(const char* user) {
@@ -293,7 +365,29 @@ namespace metrics
     * }
     * ~~~
     */
-    void set_delta(METRIC_ID metric, int value);
+    void set_delta(METRIC_ID metric, int value, METRIC_TAGS tags = NULL);
+
+    /// numbers of metrics which the client dropped, since the process started
+    struct client_errors
+    {
+        long send_errors;  ///< socket couldn't be created, or sendto failed
+        long would_block;  ///< socket send buffer, or thread buffer in direct mode, was full
+        long oversized;    ///< metric line, with namespace and tags, was truncated
+        long unresolved;   ///< server host name wasn't resolved yet
+    };
+
+    /**
+    * Returns the numbers of metrics dropped by the client. The counters are
+    * updated atomically by all sending threads, so they can be read at any
+    * time. To report them to the server periodically, track `metrics::client`
+    * default metrics (see client_config::track_default_metrics).
+    *
+    * ~~~ {.cpp}
+    * auto errors = metrics::get_client_errors();
+    * if (errors.would_block > 0) printf("metrics dropped: %ld\n", errors.would_block);
+    * ~~~
+    */
+    client_errors get_client_errors();
 }
 
 
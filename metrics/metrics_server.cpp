@@ -1,6 +1,18 @@
 #include "stdafx.h"
 #include "metrics_server.h"
+#include "timer_kernel.h"
+#include "worker_pool.h"
+#include "reservoir.h"
+#include "prometheus.h"
+#include "prefix_rollups.h"
+#include "cardinality_limiter.h"
+#include "direct_sink.h"
+#include "persisted_interval.h"
+#include "local_metrics.h"
+#include "sync.h"
 #include <memory>
+#include <algorithm>
+#include <climits>
 
 namespace metrics
 {
@@ -9,7 +21,16 @@ namespace metrics
     server_config::server_config(unsigned int port) :
         m_port(port),
         m_callback([]{}), // NOP callback
-        m_flush_period(60)
+        m_flush_period(60),
+        m_flush_threads(0),
+        m_keep_gauges(false),
+        m_gauge_ttl(0),
+        m_sparse(false),
+        m_max_names(0),
+        m_max_names_per_prefix(0),
+        m_prefix_segments(2),
+        m_interval_capacity(0),
+        m_prometheus_port(0)
     {
         ensure_winsock_started();
     }
@@ -21,6 +42,77 @@ namespace metrics
         return *this;
     }
 
+    server_config& server_config::flush_threads(unsigned int threads) {
+        if (threads > 64) throw config_exception("Valid flush thread count is 0-64");
+
+        m_flush_threads = threads;
+        return *this;
+    }
+
+    server_config& server_config::keep_gauges(unsigned int expire_after) {
+        m_keep_gauges = true;
+        m_gauge_ttl = expire_after;
+        return *this;
+    }
+
+    server_config& server_config::sparse_flush(bool sparse) {
+        m_sparse = sparse;
+        return *this;
+    }
+
+    server_config& server_config::track_live_timers(unsigned int size, double alpha, unsigned int idle_flushes) {
+        if (size < 1) throw config_exception("live timer reservoir size must be greater than 0");
+        if (!(alpha > 0)) throw config_exception("live timer decay factor must be positive");
+        if (idle_flushes < 1) throw config_exception("live timer idle flushes must be greater than 0");
+
+        m_live_timers.reset(new live_timers(size, alpha, idle_flushes));
+        return *this;
+    }
+
+    server_config& server_config::rollup_prefix(const std::string& prefix) {
+        std::string p = prefix;
+        if (p.size() >= 2 && p.compare(p.size() - 2, 2, ".*") == 0) p.erase(p.size() - 2);
+        if (p.empty()) throw config_exception("rollup prefix can't be empty");
+
+        m_rollup_prefixes.push_back(p);
+        return *this;
+    }
+
+    server_config& server_config::limit_cardinality(unsigned int max_names, unsigned int max_per_prefix, unsigned int prefix_segments) {
+        if (max_names == 0 && max_per_prefix == 0) throw config_exception("at least one cardinality limit must be set");
+        if (prefix_segments == 0) throw config_exception("prefix must have at least one segment");
+
+        m_max_names = max_names;
+        m_max_names_per_prefix = max_per_prefix;
+        m_prefix_segments = prefix_segments;
+        return *this;
+    }
+
+    server_config& server_config::persist_interval(const std::string& filename, unsigned int max_metrics) {
+        if (filename.empty()) throw config_exception("interval file name can't be empty");
+        if (max_metrics == 0) throw config_exception("interval file must hold at least one metric");
+
+        m_interval_file = filename;
+        m_interval_capacity = max_metrics;
+        return *this;
+    }
+
+    server_config& server_config::serve_prometheus(unsigned int port) {
+        if (port < 1 || port > 65535) throw config_exception("Valid prometheus port is 1-65535");
+
+        m_prometheus_port = port;
+        return *this;
+    }
+
+    server_config& server_config::add_backend(ENCODER_FN encoder, ENCODED_BACKEND_FN backend_instance)
+    {
+        if (!encoder) throw config_exception("encoder must be specified");
+
+        encoded_backend backend = { encoder, backend_instance };
+        m_encoded_backends.push_back(backend);
+        return *this;
+    }
+
     server_config& server_config::pre_flush(FLUSH_FN callback)
     {
         m_callback = callback;
@@ -33,44 +125,282 @@ namespace metrics
         return *this;
     }
 
+    server_config& server_config::reload_from(const std::string& filename, CONFIG_LOADER_FN loader)
+    {
+        if (filename.empty()) throw config_exception("configuration file must be specified");
+        if (!loader) throw config_exception("configuration loader must be specified");
+
+        m_config_file = filename;
+        m_config_loader = loader;
+        return *this;
+    }
+
+    server_config server_config::settings() const
+    {
+        server_config copy(*this);
+        copy.m_callback = []{};
+        copy.m_server_cbs.clear();
+        copy.m_backends.clear();
+        copy.m_encoded_backends.clear();
+        copy.m_config_loader = CONFIG_LOADER_FN();
+        return copy;
+    }
+
+    long long& storage::gauge(const std::string& name)
+    {
+        gauge_it it = gauges.insert(std::make_pair(name, 0LL)).first;
+        if (!keep_gauges) return it->second;
+
+        // only the first update in the interval needs to be tracked
+        unsigned int& updated = gauge_updates[name];
+        if (updated != generation) {
+            updated = generation;
+            dirty_gauges.push_back(it);
+            if (!gauge_expiry.empty()) gauge_expiry.schedule(name);
+        }
+        return it->second;
+    }
+
+    // above this many distinct tag lists, the cache is cleared
+    const size_t MAX_TAG_SETS = 10000;
+
+    const std::string& storage::tag_set(const char* tags)
+    {
+        auto it = tag_sets.find(tags);
+        if (it != tag_sets.end()) return it->second;
+
+        std::vector<std::string> sorted;
+        for (const char* tag = tags; *tag; ) {
+            const char* end = strchr(tag, ',');
+            if (!end) end = tag + strlen(tag);
+            if (end > tag) sorted.push_back(std::string(tag, end));
+            tag = *end ? end + 1 : end;
+        }
+        std::sort(sorted.begin(), sorted.end());
+        sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+        std::string canonical;
+        FOR_EACH (auto& tag, sorted) {
+            if (!canonical.empty()) canonical += ',';
+            canonical += tag;
+        }
+
+        if (tag_sets.size() >= MAX_TAG_SETS) tag_sets.clear();
+        return tag_sets.insert(std::make_pair(std::string(tags), canonical)).first->second;
+    }
+
+    void storage::next_interval()
+    {
+        counters.clear();
+        timers.clear();
+        dirty_gauges.clear();
+        if (rollups) rollups->clear();
+        if (limiter) limiter->clear(!keep_gauges);
+        if (live) live->next_interval();
+        generation++;
+
+        recovered_timers.clear();
+
+        if (!keep_gauges) {
+            gauges.clear();
+        }
+        else {
+            // only gauges scheduled for this tick are checked, not all of them
+            std::vector<std::string> due;
+            gauge_expiry.advance(due);
+            FOR_EACH(auto& name, due) {
+                auto it = gauge_updates.find(name);
+                if (it == gauge_updates.end()) continue;
+                if (generation - it->second < gauge_expiry.span()) continue; // updated since
+
+                gauges.erase(name);
+                gauge_updates.erase(it);
+                if (limiter) limiter->release(name);
+                if (persisted) persisted->expire(name);
+            }
+        }
+
+        if (persisted) persisted->next_interval(keep_gauges);
+    }
+
     timer_data process_timer(const std::string& name, const std::vector<int>& values)
     {
         timer_data data = { name, values.size(), 0, 0, 0, 0, 0 };   
         if (data.count == 0) return data;
 
-        data.min = values[0];
-        data.max = data.min;
-        long long square_sum = 0;  // needed for stddev
-        FOR_EACH (auto& v, values)
-        {
-            if (v > data.max) data.max = v;
-            if (v < data.min) data.min = v;
-            data.sum += v;
-            square_sum += v * v;
-        }
+        sample_summary summary;
+        summarize(values, &summary);  // single pass, vectorized if possible
+        data.min = summary.min;
+        data.max = summary.max;
+        data.sum = summary.sum;
 
         data.avg = data.sum / (double)data.count;
-        double var = square_sum / (double)data.count - data.avg * data.avg;
+        double var = summary.square_sum / (double)data.count - data.avg * data.avg;
         data.stddev = sqrt(var);
         return data;
     }
 
-    stats flush_metrics(const storage& storage, unsigned int period_ms)
+    // below this number of timers, waking up the workers costs more than it saves
+    const size_t MIN_PARALLEL_TIMERS = 64;
+    // tasks per thread, so that one huge timer doesn't leave other cores idle
+    const size_t CHUNKS_PER_THREAD = 4;
+
+    void process_timers(const storage& storage, worker_pool* pool, stats& stats)
+    {
+        if (!pool || storage.timers.size() < MIN_PARALLEL_TIMERS) {
+            // keys are sorted, so inserting at the end is amortized O(1)
+            FOR_EACH (auto& t, storage.timers) {
+                stats.timers.insert(stats.timers.end(), std::make_pair(t.first, process_timer(t.first, t.second)));
+            }
+            return;
+        }
+
+        typedef std::map<std::string, std::vector<int> >::const_iterator timer_it;
+        std::vector<timer_it> timers;
+        timers.reserve(storage.timers.size());
+        for (auto it = storage.timers.begin(); it != storage.timers.end(); ++it) timers.push_back(it);
+
+        // each worker writes to its own slots, so no locking is needed and the
+        // results are assembled in the same order regardless of scheduling
+        std::vector<timer_data> results(timers.size());
+        size_t chunks = (pool->size() + 1) * CHUNKS_PER_THREAD;
+        if (chunks > timers.size()) chunks = timers.size();
+
+        pool->run(chunks, [&](size_t chunk) {
+            size_t begin = timers.size() * chunk / chunks;
+            size_t end = timers.size() * (chunk + 1) / chunks;
+            for (size_t i = begin; i < end; ++i) {
+                results[i] = process_timer(timers[i]->first, timers[i]->second);
+            }
+        });
+
+        for (size_t i = 0; i < timers.size(); ++i) {
+            stats.timers.insert(stats.timers.end(), std::make_pair(timers[i]->first, results[i]));
+        }
+    }
+
+    // adds the part of a timer restored from the persisted interval to its
+    // flushed data. Sum of squares is derived from the average and deviation
+    static void merge_recovered(timer_data& data, const timer_data& recovered)
+    {
+        if (data.count == 0) {
+            data = recovered;
+            return;
+        }
+
+        double square_sum = (data.stddev * data.stddev + data.avg * data.avg) * data.count
+            + (recovered.stddev * recovered.stddev + recovered.avg * recovered.avg) * recovered.count;
+        data.count += recovered.count;
+        data.sum += recovered.sum;
+        if (recovered.min < data.min) data.min = recovered.min;
+        if (recovered.max > data.max) data.max = recovered.max;
+        data.avg = data.sum / (double)data.count;
+        double var = square_sum / data.count - data.avg * data.avg;
+        data.stddev = var > 0 ? sqrt(var) : 0;
+    }
+
+    stats flush_metrics(const storage& storage, unsigned int period_ms, worker_pool* pool)
     {
         stats stats;
         stats.timestamp = timer::now();
+        stats.period_ms = period_ms;
 
         auto period =  period_ms / 1000.0;
 
-        FOR_EACH (auto& c, storage.counters) stats.counters[c.first] = c.second / period;
-        FOR_EACH (auto& g, storage.gauges) stats.gauges[g.first] = g.second;
-        FOR_EACH (auto& t, storage.timers) stats.timers[t.first] = process_timer(t.first, t.second);
+        FOR_EACH (auto& c, storage.counters) {
+            stats.counters.insert(stats.counters.end(), std::make_pair(c.first, c.second / period));
+        }
+        if (storage.keep_gauges && storage.sparse) {
+            FOR_EACH (auto& g, storage.dirty_gauges) stats.gauges[g->first] = g->second;
+        }
+        else {
+            FOR_EACH (auto& g, storage.gauges) {
+                stats.gauges.insert(stats.gauges.end(), std::make_pair(g.first, g.second));
+            }
+        }
+        process_timers(storage, pool, stats);
+        FOR_EACH (auto& t, storage.recovered_timers) merge_recovered(stats.timers[t.first], t.second);
+        if (storage.rollups) storage.rollups->flush(period_ms, stats);
+        if (storage.limiter) storage.limiter->flush(period_ms, stats);
 
         return stats; // todo: move
     }
 
+    stats flush_metrics(const storage& storage, unsigned int period_ms)
+    {
+        return flush_metrics(storage, period_ms, NULL);
+    }
+
+    static const std::string OVERFLOW_COUNTER(builtin::internal_cardinality_overflow_counter);
+    static const std::string OVERFLOW_GAUGE(builtin::internal_cardinality_overflow_gauge);
+    static const std::string OVERFLOW_TIMER(builtin::internal_cardinality_overflow_timer);
+
+    // series which holds values of metrics of the type over the cardinality limit
+    static const std::string& overflow_series(metric_type type)
+    {
+        if (type == counter) return OVERFLOW_COUNTER;
+        return type == histogram ? OVERFLOW_TIMER : OVERFLOW_GAUGE;
+    }
+
+    // stores a parsed metric, also used for metrics recorded in direct mode.
+    // Canonical tags are appended to the metric_name
+    void store_metric(storage* storage, std::string& metric_name, metric_type metric, long long value, const char* tags)
+    {
+        // timer values are kept as int, values out of range are clamped
+        if (metric == histogram) {
+            if (value > INT_MAX) value = INT_MAX;
+            else if (value < INT_MIN) value = INT_MIN;
+        }
+
+        if (tags) {
+            auto& tag_set = storage->tag_set(tags);
+            if (!tag_set.empty()) metric_name.append(TAGS_SEPARATOR).append(tag_set);
+        }
+
+        // metrics over the cardinality limit share one series per type. Kept
+        // gauges count against the limit until they expire
+        bool kept = storage->keep_gauges && (metric == gauge || metric == gauge_delta);
+        bool admitted = !storage->limiter || storage->limiter->admit(metric_name, kept);
+        const std::string& key = admitted ? metric_name : overflow_series(metric);
+
+        dbg_print("storing metric %d: %s [%lld]", metric, key.c_str(), value);
+
+        long long stored = value; // resulting value of a gauge
+        switch (metric)
+        {
+            case metrics::counter:
+                storage->counters[key] += value;
+                break;
+            case metrics::gauge:
+                stored = storage->gauge(key) = value;
+                break;
+            case metrics::gauge_delta:
+                stored = storage->gauge(key) += value;
+                break;
+            case metrics::histogram:
+                storage->timers[key].push_back((int)value);
+                if (storage->live) storage->live->update(key, (int)value);
+                break;
+        }
+
+        if (storage->persisted && !storage->persisted->update(key, metric, stored)) {
+            storage->counters[builtin::internal_persist_dropped]++;
+        }
+        if (storage->rollups) storage->rollups->add(metric_name, metric, value);
+
+        storage->counters[builtin::internal_metrics_count]++;
+        storage->gauge(builtin::internal_metrics_last_seen) = timer::now();
+    }
+
     void process_metric(storage* storage, char* buff, size_t len)
     {
+        // DogStatsD tags follow the type, e.g. "requests:1|c|#code:200"
+        char* tags = strstr(buff, TAGS_SEPARATOR);
+        if (tags) {
+            *tags = '\0';
+            tags += strlen(TAGS_SEPARATOR);
+        }
+
         auto pipe_pos = strrchr(buff, '|');
         auto colon_pos = strrchr(buff, ':');
         if (!colon_pos || !pipe_pos) {
@@ -95,105 +425,400 @@ namespace metrics
         *colon_pos = '\0';
         colon_pos++;
         std::string metric_name = buff;
-        int value = atol(colon_pos);
+        // 64-bit, as forwarded counters and gauges can exceed the range of int
+        store_metric(storage, metric_name, metric, _strtoi64(colon_pos, NULL, 10), tags);
+    }
 
-        dbg_print("storing metric %d: %s [%d]", metric, metric_name.c_str(), value);
+    // encodes the stats once per distinct encoder, and passes the encoded
+    // stats to all the backends which use that encoder
+    void run_encoded_backends(const stats& stats, const std::vector<encoded_backend>& backends)
+    {
+        // there are only a few encoders, so linear search is fine
+        std::vector<std::pair<ENCODER_FN, std::shared_ptr<const std::string> > > encoded;
+        FOR_EACH (auto& b, backends) {
+            size_t i = 0;
+            while (i < encoded.size() && encoded[i].first != b.encoder) ++i;
+            if (i == encoded.size()) {
+                std::string* data = new std::string();
+                b.encoder(stats, *data);
+                encoded.push_back(std::make_pair(b.encoder, std::shared_ptr<const std::string>(data)));
+            }
+            b.backend(stats, encoded[i].second);
+        }
+    }
 
-        switch (metric)
-        {
-            case metrics::counter:
-                storage->counters[metric_name] += value;
-                break;
-            case metrics::gauge:
-                storage->gauges[metric_name] = value;
-                break;
-            case metrics::gauge_delta:
-                storage->gauges[metric_name] += value;
-                break;
-            case metrics::histogram:
-                storage->timers[metric_name].push_back(value);
-                break;
+    // a datagram can contain several metrics, one per line, as sent by
+    // statsd_backend. buff[len] must be writable
+    void process_datagram(storage* storage, char* buff, size_t len)
+    {
+        char* end = buff + len;
+        while (buff < end) {
+            char* eol = (char*)memchr(buff, '\n', end - buff);
+            if (!eol) eol = end;
+            *eol = '\0';
+            if (eol > buff) process_metric(storage, buff, eol - buff);
+            buff = eol + 1;
         }
+    }
 
-        storage->counters[builtin::internal_metrics_count]++;
-        storage->gauges[builtin::internal_metrics_last_seen] = timer::now();
+    void count_internal(const char* metric, unsigned int count)
+    {
+        g_storage.counters[metric] += count;
     }
 
-    DWORD WINAPI ThreadProc(LPVOID params)
-    {     
-        const int BUFSIZE = 4096;
-        std::unique_ptr<server_config> pcfg(static_cast<server_config*>(params));
+    // configuration passed by server::reload, applied at the next flush
+    server_config* volatile g_pending_config = NULL;
 
-        int recvlen, fd;                // # bytes received, our socket
-        char buf[BUFSIZE];              // receive buffer 
+    // settings of the configuration applied by the server thread, read by
+    // server instances on other threads. Backends are not copied, so that
+    // their files and sockets are owned only by the server thread
+    struct applied_config
+    {
+        CRITICAL_SECTION lock;
+        std::shared_ptr<const server_config> cfg;
+
+        applied_config() { InitializeCriticalSection(&lock); }
+        ~applied_config() { DeleteCriticalSection(&lock); }
+    };
+
+    static applied_config g_applied;
 
+    // publishes the settings of the configuration, or clears them if cfg is NULL
+    static void publish_config(const server_config* cfg)
+    {
+        std::shared_ptr<const server_config> next(cfg ? new server_config(cfg->settings()) : NULL);
+        scoped_lock _(&g_applied.lock);
+        g_applied.cfg.swap(next); // the old copy is released after the lock
+    }
+
+    static std::shared_ptr<const server_config> applied()
+    {
+        scoped_lock _(&g_applied.lock);
+        return g_applied.cfg;
+    }
+
+    static int bind_server_socket(unsigned int port)
+    {
+        int fd;
         if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) { // create a UDP socket
             dbg_print("cannot create server socket: error: %d", WSAGetLastError());
-            FOR_EACH(auto& cb, pcfg->server_cbs()) cb(StartupFailed);
-            return 1;
+            return -1;
         }
 
-        auto start = timer::now();         
-        SOCK_ADDR_IN myaddr(AF_INET, INADDR_ANY, pcfg->port());
-
+        SOCK_ADDR_IN myaddr(AF_INET, INADDR_ANY, port);
         if (bind(fd, (struct sockaddr *)&myaddr, sizeof(myaddr)) < 0) {
             dbg_print("bind failed, error: %d", WSAGetLastError());
-            closesocket(fd);       
+            closesocket(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // returns the highest socket, for select()
+    static int watch_sockets(fd_set* set, int fd, int old_fd)
+    {
+        FD_ZERO(set);
+        FD_SET(fd, set);
+        if (old_fd >= 0) FD_SET(old_fd, set);
+        return fd > old_fd ? fd : old_fd;
+    }
+
+    // returns true if the file was modified since the last call
+    static bool file_changed(const std::string& filename, WIN32_FILE_ATTRIBUTE_DATA* last)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA now;
+        if (!GetFileAttributesEx(filename.c_str(), GetFileExInfoStandard, &now)) return false;
+
+        bool changed = CompareFileTime(&now.ftLastWriteTime, &last->ftLastWriteTime) != 0
+            || now.nFileSizeLow != last->nFileSizeLow || now.nFileSizeHigh != last->nFileSizeHigh;
+        *last = now;
+        return changed;
+    }
+
+    // applies gauge settings of the reloaded configuration to the storage
+    static void reconfigure_storage(storage& storage, const server_config& cfg)
+    {
+        bool reschedule = storage.keep_gauges != cfg.keeps_gauges() || storage.gauge_expiry.span() != cfg.gauge_ttl();
+        storage.keep_gauges = cfg.keeps_gauges();
+        storage.sparse = cfg.is_sparse();
+        storage.live = cfg.live().get();
+        if (!reschedule) return;
+
+        storage.gauge_expiry.reset(cfg.gauge_ttl());
+        storage.gauge_updates.clear();
+        storage.dirty_gauges.clear();
+        if (!storage.keep_gauges) return;
+
+        // kept gauges count as updated in the previous interval, and expire with the new TTL
+        FOR_EACH (auto& g, storage.gauges) {
+            storage.gauge_updates[g.first] = storage.generation - 1;
+            if (!storage.gauge_expiry.empty()) storage.gauge_expiry.schedule(g.first);
+        }
+    }
+
+    static cardinality_limiter* create_limiter(const server_config& cfg)
+    {
+        if (cfg.max_names() == 0 && cfg.max_names_per_prefix() == 0) return NULL;
+        return new cardinality_limiter(cfg.max_names(), cfg.max_names_per_prefix(), cfg.prefix_segments());
+    }
+
+    // applies the new configuration at the flush boundary. Everything which
+    // can fail is created first, so that a failed reload leaves the old
+    // configuration running. The replaced socket is kept in old_fd, so that
+    // datagrams already sent to it are still received
+    static bool reload_config(std::unique_ptr<server_config>& cfg, std::unique_ptr<server_config>& next, int* fd, int* old_fd,
+        std::unique_ptr<prometheus_exporter>& exporter, std::unique_ptr<worker_pool>& pool, std::unique_ptr<prefix_rollups>& rollups, std::unique_ptr<cardinality_limiter>& limiter,
+        std::unique_ptr<persisted_interval>& persisted)
+    {
+        int new_fd = *fd;
+        if (next->port() != cfg->port() && (new_fd = bind_server_socket(next->port())) < 0) return false;
+
+        std::unique_ptr<prometheus_exporter> new_exporter;
+        if (next->prometheus_port() != cfg->prometheus_port() && next->prometheus_port() > 0) {
+            try {
+                new_exporter.reset(new prometheus_exporter(next->prometheus_port()));
+            }
+            catch (const std::runtime_error&) {
+                if (new_fd != *fd) closesocket(new_fd);
+                return false;
+            }
+        }
+
+        bool persist_changed = next->interval_file() != cfg->interval_file() || next->interval_capacity() != cfg->interval_capacity();
+        std::unique_ptr<persisted_interval> new_persisted;
+        if (persist_changed && !next->interval_file().empty()) {
+            try {
+                new_persisted.reset(new persisted_interval(next->interval_file(), next->interval_capacity()));
+            }
+            catch (const std::runtime_error&) {
+                if (new_fd != *fd) closesocket(new_fd);
+                return false;
+            }
+        }
+
+        if (new_fd != *fd) {
+            *old_fd = *fd;
+            *fd = new_fd;
+            dbg_print("inproc server listening at port %d", next->port());
+        }
+        if (next->prometheus_port() != cfg->prometheus_port()) exporter.swap(new_exporter);
+        if (next->flush_threads() != cfg->flush_threads()) {
+            pool.reset();
+            if (next->flush_threads() > 0) pool.reset(new worker_pool(next->flush_threads()));
+        }
+        if (next->rollup_prefixes() != cfg->rollup_prefixes()) {
+            // the interval was just flushed, so there is nothing to carry over
+            rollups.reset(next->rollup_prefixes().empty() ? NULL : new prefix_rollups(next->rollup_prefixes()));
+            g_storage.rollups = rollups.get();
+        }
+        if (next->max_names() != cfg->max_names() || next->max_names_per_prefix() != cfg->max_names_per_prefix()
+            || next->prefix_segments() != cfg->prefix_segments()) {
+            limiter.reset(create_limiter(*next));
+            g_storage.limiter = limiter.get();
+            // gauges kept so far count against the new limits
+            if (limiter && next->keeps_gauges()) {
+                FOR_EACH (auto& g, g_storage.gauges) limiter->admit(g.first, true);
+                limiter->clear(); // gauges over the limits are not reported as rejected
+            }
+        }
+        reconfigure_storage(g_storage, *next);
+        if (persist_changed) {
+            // the file may hold an old interval, it starts with the kept gauges
+            if (new_persisted) new_persisted->reset(g_storage);
+            persisted.swap(new_persisted);
+            g_storage.persisted = persisted.get();
+        }
+        cfg.swap(next);
+        return true;
+    }
+
+    DWORD WINAPI ThreadProc(LPVOID params)
+    {     
+        const int BUFSIZE = 4096;
+        std::unique_ptr<server_config> pcfg(static_cast<server_config*>(params));
+        delete (server_config*)InterlockedExchangePointer((PVOID volatile*)&g_pending_config, NULL);
+
+        int recvlen;                    // # bytes received
+        int fd, old_fd = -1;            // our socket, and the one replaced by reload
+        char buf[BUFSIZE];              // receive buffer 
+
+        if ((fd = bind_server_socket(pcfg->port())) < 0) {
+            publish_config(NULL);
             FOR_EACH(auto& cb, pcfg->server_cbs()) cb(StartupFailed);
             return 1;
         }
 
+        auto start = timer::now();         
         dbg_print("inproc server listening at port %d", pcfg->port());
         
-        int maxfd = fd;
         fd_set static_rdset, rdset;
+        int maxfd = watch_sockets(&static_rdset, fd, old_fd);
         SOCK_ADDR_IN remaddr;  
         int addrlen = sizeof(remaddr);  // length of addresses 
         timeval timeout = { 0, 250000 };
 
-        FD_ZERO(&static_rdset);
-        FD_SET(fd, &static_rdset);
+        std::unique_ptr<prometheus_exporter> exporter;
+        if (pcfg->prometheus_port() > 0) {
+            try {
+                exporter.reset(new prometheus_exporter(pcfg->prometheus_port()));
+            }
+            catch (const std::runtime_error&) {
+                closesocket(fd);
+                publish_config(NULL);
+                FOR_EACH(auto& cb, pcfg->server_cbs()) cb(StartupFailed);
+                return 1;
+            }
+        }
+
+        g_storage.clear();
+        g_storage.keep_gauges = pcfg->keeps_gauges();
+        g_storage.sparse = pcfg->is_sparse();
+        g_storage.gauge_expiry.reset(pcfg->gauge_ttl());
+        g_storage.live = pcfg->live().get();
+
+        std::unique_ptr<persisted_interval> persisted;
+        bool resumed = false; // the first interval started before the restart
+        if (!pcfg->interval_file().empty()) {
+            try {
+                persisted.reset(new persisted_interval(pcfg->interval_file(), pcfg->interval_capacity()));
+            }
+            catch (const std::runtime_error&) {
+                closesocket(fd);
+                publish_config(NULL);
+                FOR_EACH(auto& cb, pcfg->server_cbs()) cb(StartupFailed);
+                return 1;
+            }
+            size_t restored = persisted->restore(g_storage);
+            if (restored > 0) {
+                dbg_print("resumed interval with %u metrics", (unsigned int)restored);
+                // restored counters are divided by the time since the interval started
+                long long elapsed = timer::to_unix_ms(timer::now()) - persisted->started();
+                if (elapsed > 0 && elapsed < INT_MAX / 2) {
+                    start -= (timer::time_point)elapsed;
+                    resumed = true;
+                }
+            }
+        }
+        g_storage.persisted = persisted.get();
+
+        std::unique_ptr<worker_pool> pool;
+        if (pcfg->flush_threads() > 0) pool.reset(new worker_pool(pcfg->flush_threads()));
+
+        std::unique_ptr<prefix_rollups> rollups;
+        if (!pcfg->rollup_prefixes().empty()) rollups.reset(new prefix_rollups(pcfg->rollup_prefixes()));
+        g_storage.rollups = rollups.get();
+        std::unique_ptr<cardinality_limiter> limiter(create_limiter(*pcfg));
+        g_storage.limiter = limiter.get();
+        enable_direct(true);
+
+        WIN32_FILE_ATTRIBUTE_DATA watched = {};
+        if (!pcfg->config_file().empty()) file_changed(pcfg->config_file(), &watched);
 
         FOR_EACH(auto& cb, pcfg->server_cbs()) cb(Started);
         while (true) {
             rdset = static_rdset;
             select(maxfd + 1, &rdset, NULL, NULL, &timeout);
 
-            if (FD_ISSET(fd, &rdset)) {
-                recvlen = recvfrom(fd, buf, BUFSIZE, 0, (sockaddr*)&remaddr, &addrlen);
+            int sockets[] = { fd, old_fd };
+            FOR_EACH (int s, sockets) {
+                if (s < 0 || !FD_ISSET(s, &rdset)) continue;
+
+                recvlen = recvfrom(s, buf, BUFSIZE, 0, (sockaddr*)&remaddr, &addrlen);
                 if (recvlen > 0 && recvlen < BUFSIZE) {
                     buf[recvlen] = 0;
                     if (strcmp(buf, "stop") == 0) {
                         dbg_print(" > received STOP cmd, stopping server");
                         closesocket(fd);
+                        if (old_fd >= 0) closesocket(old_fd);
+                        g_storage.live = NULL; // owned by config, about to be released
+                        g_storage.rollups = NULL;
+                        g_storage.limiter = NULL;
+                        g_storage.persisted = NULL;
+                        publish_config(NULL); // releases the live timers
+                        enable_direct(false);
                         FOR_EACH(auto& cb, pcfg->server_cbs()) cb(Stopped);
                         return 0;
                     }
                     dbg_print(" > received:%s (%d bytes)", buf, recvlen);
-                    process_metric(&g_storage, buf, recvlen);
+                    process_datagram(&g_storage, buf, recvlen);
                 }                 
             }
 
             if (timer::since(start) >= pcfg->flush_period_ms())
             {
+                // a resumed interval may be longer than the period, if the restart took long
+                unsigned int period_ms = resumed ? (unsigned int)timer::since(start) : pcfg->flush_period_ms();
+                resumed = false;
                 start = timer::now();
                 auto& flush_fn = pcfg->flush_fn();
                 flush_fn();
-                stats stats = flush_metrics(g_storage, pcfg->flush_period_ms());
-                g_storage.clear();
+                drain_direct(&g_storage);
+                auto flush_start = timer::now_us();
+                stats stats = flush_metrics(g_storage, period_ms, pool.get());
+                flush_local(stats);
+                auto flush_time = timer::now_us() - flush_start;
+                g_storage.next_interval();
                 FOR_EACH (auto& backend, pcfg->backends()) backend(stats);
-                dbg_print("flush took %d ms", timer::since(start));
+                run_encoded_backends(stats, pcfg->encoded_backends());
+                if (exporter) exporter->publish(stats, period_ms, pcfg->live().get());
+
+                // reported with the next flush, so that scaling can be tracked
+                g_storage.gauge(builtin::internal_flush_time) = flush_time;
+                dbg_print("flush took %d ms (processing: %lld us)", timer::since(start), flush_time);
+
+                // clients had a whole interval to switch to the new port
+                if (old_fd >= 0) {
+                    closesocket(old_fd);
+                    old_fd = -1;
+                    maxfd = watch_sockets(&static_rdset, fd, old_fd);
+                }
+
+                std::unique_ptr<server_config> next((server_config*)InterlockedExchangePointer((PVOID volatile*)&g_pending_config, NULL));
+                bool load_failed = false;
+                if (!next && !pcfg->config_file().empty() && file_changed(pcfg->config_file(), &watched)) {
+                    try {
+                        next.reset(new server_config(pcfg->config_loader()(pcfg->config_file())));
+                        if (next->config_file().empty()) next->reload_from(pcfg->config_file(), pcfg->config_loader());
+                    }
+                    catch (...) {
+                        dbg_print("failed loading configuration from %s", pcfg->config_file().c_str());
+                        load_failed = true;
+                    }
+                }
+
+                if (next || load_failed) {
+                    std::string watched_file = pcfg->config_file();
+                    if (!load_failed && reload_config(pcfg, next, &fd, &old_fd, exporter, pool, rollups, limiter, persisted)) {
+                        maxfd = watch_sockets(&static_rdset, fd, old_fd);
+                        if (pcfg->config_file() != watched_file) file_changed(pcfg->config_file(), &watched);
+                        publish_config(pcfg.get());
+                        FOR_EACH(auto& cb, pcfg->server_cbs()) cb(Reloaded);
+                    }
+                    else {
+                        FOR_EACH(auto& cb, pcfg->server_cbs()) cb(ReloadFailed);
+                    }
+                }
             }
         }
     }
 
     server server::run(const server_config& cfg)
     {
+        // published first, so that a thread which fails to start clears it
+        publish_config(&cfg);
         DWORD thread_id;
         HANDLE h = CreateThread(NULL, 0, ThreadProc, new server_config(cfg), 0, &thread_id);
-        if (!h) throw std::runtime_error("Failed creating server thread");
+        if (!h) {
+            publish_config(NULL);
+            throw std::runtime_error("Failed creating server thread");
+        }
         dbg_print("started inproc server on thread %d", thread_id);
-        return server(cfg);
+        return server();
+    }
+
+    void server::reload(const server_config& cfg)
+    {
+        delete (server_config*)InterlockedExchangePointer((PVOID volatile*)&g_pending_config, new server_config(cfg));
     }
 
     void server::stop()
@@ -202,4 +827,18 @@ namespace metrics
         const char* cmd = "stop";
         send_to_server(cmd, strlen(cmd));
     }
+
+    bool server::timer_quantile(const std::string& metric, double q, double* value) const
+    {
+        auto cfg = applied();
+        std::shared_ptr<live_timers> live; // keeps the reservoirs alive while they are queried
+        if (cfg) live = cfg->live();
+        return live ? live->quantile(metric, q, value) : false;
+    }
+
+    server_config server::config() const
+    {
+        auto cfg = applied();
+        return cfg ? *cfg : server_config();
+    }
 }
\ No newline at end of file
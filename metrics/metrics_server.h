@@ -1,20 +1,30 @@
 #pragma once
 
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include "metrics.h"
 #include "backends.h"
+#include "timing_wheel.h"
 #include <functional>
+#include <memory>
 
 namespace metrics
 {
+    class live_timers;
+    class prefix_rollups;
+    class cardinality_limiter;
+    class persisted_interval;
+
     /// Represents events that server notifies the clients about using a 
     /// callback proveded by server_config::on_server_event
     enum server_events
     {
         StartupFailed, ///< an error occurred during server startup
         Started,       ///< server has started successfully
-        Stopped        ///< server was stopped gracefully using server::stop()
+        Stopped,       ///< server was stopped gracefully using server::stop()
+        Reloaded,      ///< new configuration was applied, sent to its listeners
+        ReloadFailed   ///< new configuration couldn't be applied, the old one is kept
     };
 
     /// prototype for function to be called immediately before flush.
@@ -23,20 +33,54 @@ namespace metrics
     /// a function which takes `const stats&` and returns nothing
     typedef std::function<void(const stats&)> BACKEND_FN;
 
+    /// a function which encodes stats by appending them to a buffer, e.g.
+    /// json_file_backend::serialize. Backends which use the same encoder
+    /// share the result, so the stats are encoded only once per flush
+    typedef void (*ENCODER_FN)(const stats&, std::string&);
+
+    /// a backend which receives the stats already encoded. The buffer is shared
+    /// with other backends, so it must not be modified, but it can be kept
+    typedef std::function<void(const stats&, const std::shared_ptr<const std::string>&)> ENCODED_BACKEND_FN;
+
+    /// backend which receives encoded stats, together with its encoder
+    struct encoded_backend
+    {
+        ENCODER_FN encoder;
+        ENCODED_BACKEND_FN backend;
+    };
+
     /// prototype for function called by server to broadcast notifications
     typedef std::function<void(server_events)> SERVER_NOTIFICATION_FN;
 
 
     class server_config;
 
+    /// a function which creates server configuration from the given file
+    typedef std::function<server_config(const std::string&)> CONFIG_LOADER_FN;
+
     /// Handles settings for local server instance.
     class server_config
     {
         unsigned int m_flush_period;
+        unsigned int m_flush_threads;
+        bool m_keep_gauges;
+        unsigned int m_gauge_ttl;
+        bool m_sparse;
+        std::shared_ptr<live_timers> m_live_timers;
+        std::vector<std::string> m_rollup_prefixes;
+        unsigned int m_max_names;
+        unsigned int m_max_names_per_prefix;
+        unsigned int m_prefix_segments;
+        std::string m_interval_file;
+        unsigned int m_interval_capacity;
+        unsigned int m_prometheus_port;
         unsigned int m_port;
         FLUSH_FN m_callback;
         std::vector<SERVER_NOTIFICATION_FN> m_server_cbs;
         std::vector<BACKEND_FN> m_backends;
+        std::vector<encoded_backend> m_encoded_backends;
+        std::string m_config_file;
+        CONFIG_LOADER_FN m_config_loader;
 
     public:
         /**
@@ -77,6 +121,112 @@ namespace metrics
         */
         server_config& flush_every(unsigned int period);
 
+        /**
+        * Specifies the number of worker threads used to process metrics
+        * during flush. With many timers, processing them is the most
+        * expensive part of the flush, so it can be spread over several cores.
+        * Results are always the same as with serial flush. By default, flush
+        * is serial.
+        * @param threads Number of worker threads. Valid values are [0,64],
+        *        0 means that metrics are processed on the server thread.
+        * @throws config_exception Thrown if thread count is out of range
+        */
+        server_config& flush_threads(unsigned int threads);
+
+        /**
+        * Tells the server to keep gauges between flushes, like statsd does.
+        * Otherwise a gauge which is not updated during flush interval is not
+        * reported at all, and deltas are applied to 0. 
+        * @param expire_after If a gauge isn't updated during this many flushes,
+        *        it is removed. 0 means that gauges never expire.
+        */
+        server_config& keep_gauges(unsigned int expire_after = 0);
+
+        /**
+        * Tells the server to send only the metrics which were updated since the
+        * previous flush to the backends. Counters and timers are always
+        * reset on flush, so this affects only gauges kept with keep_gauges(),
+        * but it makes backend I/O proportional to activity instead of the
+        * number of tracked gauges.
+        * @param sparse `true` to flush only updated gauges
+        */
+        server_config& sparse_flush(bool sparse = true);
+
+        /**
+        * Tells the server to keep a decaying reservoir for each timer, so
+        * that timer quantiles can be queried at any time using
+        * server::timer_quantile(), not only when stats are flushed. The
+        * reservoir is biased towards recent values and is kept across
+        * flushes; flushed stats are not affected.
+        * @param size Number of samples kept per timer. Each timer value
+        *        costs O(log size) to add
+        * @param alpha Decay factor. The default favors the last ~5 minutes
+        * @param idle_flushes Number of flushes without values after which
+        *        the timer's reservoir is dropped
+        * @throws config_exception Thrown if size or idle_flushes is 0, or
+        *         alpha is not positive
+        */
+        server_config& track_live_timers(unsigned int size = 1028, double alpha = 0.015, unsigned int idle_flushes = 30);
+
+        /**
+        * Adds a rollup of all metrics under the prefix, reported as
+        * `<prefix>._all` with each flush. Counters are summed and timer values
+        * are merged, e.g. `stats.comm.rq` rolls up `stats.comm.rq.iso` and 
+        * `stats.comm.rq.eth.tx`. Gauges are not rolled up. Values are added
+        * to the rollups as they are received, so the flush only reports the
+        * totals, instead of each backend summing thousands of series.
+        * @param prefix Dotted prefix, including the namespace. A trailing
+        *        `.*` is ignored, so `stats.comm.rq.*` is the same prefix
+        * @throws config_exception Thrown if prefix is empty
+        * @see prefix_rollups
+        */
+        server_config& rollup_prefix(const std::string& prefix);
+
+        /**
+        * Limits the number of distinct metrics (name and tags) which the
+        * server stores in one flush interval, so that a buggy client can't
+        * exhaust its memory, e.g. by putting request IDs into metric names.
+        * Once a limit is reached, values of new metrics are stored in the
+        * overflow series of their type (e.g. builtin::internal_cardinality_overflow_counter),
+        * and the number of such values is reported as builtin::internal_cardinality_rejected,
+        * also tagged with `prefix` for the top offending prefixes. Gauges kept
+        * between flushes count against the limits until they expire.
+        * @param max_names Maximum number of distinct metrics, or 0 for no limit
+        * @param max_per_prefix Maximum number of distinct metrics with the same
+        *        prefix, or 0 for no limit
+        * @param prefix_segments Number of leading segments of the metric name
+        *        which form its prefix, e.g. `stats.api` for `stats.api.rq.get`
+        * @throws config_exception Thrown if both limits are 0, or prefix_segments is 0
+        */
+        server_config& limit_cardinality(unsigned int max_names, unsigned int max_per_prefix = 0, unsigned int prefix_segments = 2);
+
+        /**
+        * Keeps the metrics of the current flush interval in a memory-mapped
+        * file, so that a server restarted after a crash resumes the interval
+        * instead of losing it, e.g. for billing counters. Each received value
+        * is applied to the file in place, which costs one hash lookup.
+        * Timers are kept as summaries, so the restored part of a timer
+        * contributes to its count, sum, min, max, average and deviation.
+        * @param filename File which holds the interval, created if needed
+        * @param max_metrics Maximum number of metrics in the file. Values of
+        *        further metrics are not persisted, and are counted as
+        *        builtin::internal_persist_dropped. Each metric takes 176 bytes
+        * @throws config_exception Thrown if filename is empty or max_metrics is 0
+        */
+        server_config& persist_interval(const std::string& filename, unsigned int max_metrics = 65536);
+
+        /**
+        * Tells the server to serve the latest flushed stats over HTTP, at
+        * `/metrics`, so that Prometheus can scrape them. Scrapes are handled
+        * on a separate thread and never delay the flush. If live timers are
+        * tracked, timer summaries also include 0.5, 0.9 and 0.99 quantiles.
+        * If the port can't be bound, server doesn't start (StartupFailed).
+        * @param port Port of the HTTP listener. Valid values are [1,65535]
+        * @throws config_exception Thrown if port is out of range
+        * @see prometheus_exporter
+        */
+        server_config& serve_prometheus(unsigned int port = 9102);
+
         /**
         * Tells the server to run on the same thread on which server::run() was 
         * called from. By default, server is running on another thread.
@@ -134,6 +284,28 @@ namespace metrics
             return *this;
         }
 
+        /**
+        * Adds a backend which receives the stats already encoded. Each
+        * distinct encoder runs once per flush, and all the backends which use
+        * it receive the same immutable buffer, so e.g. two JSON files and a
+        * forwarder don't format the same stats three times. Built-in
+        * backends which have a static `serialize()` accept encoded stats.
+        * These backends are called after the ones added with add_backend(BACKEND_FN).
+        *
+        * @param encoder Function which encodes the stats. Encoders are
+        *        compared by address
+        * @param backend_instance Backend which receives the encoded stats
+        * @throws config_exception Thrown if encoder is NULL
+        *
+        * Example:
+        * ~~~{.cpp}
+        * auto cfg = metrics::server_config()
+        *     .add_backend(&json_file_backend::serialize, json_file_backend("d:\\stats.json"))
+        *     .add_backend(&json_file_backend::serialize, json_file_backend("\\\\backup\\stats.json"));
+        * ~~~
+        */
+        server_config& add_backend(ENCODER_FN encoder, ENCODED_BACKEND_FN backend_instance);
+
         /**
         * Specifies the function to be called before the values are flushed.
         * You can use this to add some metrics, etc.
@@ -170,18 +342,59 @@ namespace metrics
         */
         server_config& add_server_listener(SERVER_NOTIFICATION_FN callback);
 
+        /**
+        * Tells the server to watch the configuration file, and to reload the
+        * configuration when the file changes. The file is checked at each
+        * flush, and the configuration created by the loader is applied as
+        * with server::reload(). If the loaded configuration doesn't watch a
+        * file itself, it keeps watching this one. If the loader throws,
+        * the server keeps the current configuration (ReloadFailed).
+        *
+        * @param filename Configuration file. Its format is up to the loader
+        * @param loader Creates the configuration from the file
+        * @throws config_exception Thrown if filename is empty or loader is not set
+        *
+        * Example:
+        * ~~~{.cpp}
+        * metrics::server_config load(const std::string& filename) {
+        *     unsigned int period = GetPrivateProfileIntA("server", "flush", 60, filename.c_str());
+        *     return metrics::server_config().flush_every(period).add_backend(console_backend());
+        * }
+        *
+        * server::run(load("d:\\metrics.ini").reload_from("d:\\metrics.ini", &load));
+        * ~~~
+        */
+        server_config& reload_from(const std::string& filename, CONFIG_LOADER_FN loader);
+
         unsigned int flush_period_ms() const { return m_flush_period * 1000; }
+        unsigned int flush_threads() const { return m_flush_threads; }
+        bool keeps_gauges() const { return m_keep_gauges; }
+        unsigned int gauge_ttl() const { return m_gauge_ttl; }
+        bool is_sparse() const { return m_sparse; }
+        std::shared_ptr<live_timers> live() const { return m_live_timers; }
+        const std::vector<std::string>& rollup_prefixes() const { return m_rollup_prefixes; }
+        unsigned int max_names() const { return m_max_names; }
+        unsigned int max_names_per_prefix() const { return m_max_names_per_prefix; }
+        unsigned int prefix_segments() const { return m_prefix_segments; }
+        const std::string& interval_file() const { return m_interval_file; }
+        unsigned int interval_capacity() const { return m_interval_capacity; }
+        unsigned int prometheus_port() const { return m_prometheus_port; }
         unsigned int port() const { return m_port; }
         const FLUSH_FN& flush_fn() const { return m_callback; }
         const std::vector<SERVER_NOTIFICATION_FN>& server_cbs() const { return m_server_cbs; }
         const std::vector<BACKEND_FN>& backends() const { return m_backends; }
+        const std::vector<encoded_backend>& encoded_backends() const { return m_encoded_backends; }
+        const std::string& config_file() const { return m_config_file; }
+        const CONFIG_LOADER_FN& config_loader() const { return m_config_loader; }
+
+        /// copy of the settings, without backends, listeners and callbacks, which may hold resources
+        server_config settings() const;
     };
 
     /// Represents a instance of the server.
     class server
     {
-        server_config m_cfg;
-        server(const server_config& cfg) : m_cfg(cfg) { ; }
+        server() { ; }
 
     public:
         /**
@@ -196,21 +409,40 @@ namespace metrics
         */
         void stop();
 
-        const server_config& config() const { return m_cfg; }
-    };
+        /**
+        * Replaces the configuration of the running server. The current
+        * flush interval is completed and flushed with the old configuration,
+        * and the new one applies from the next interval, so no metrics are
+        * lost. Datagrams keep being received during the reload, also when
+        * the port changes. Everything can be changed: flush period, backends,
+        * listeners, ports, gauge settings and flush threads.
+        *
+        * If a new port can't be bound, the old configuration is kept, and
+        * its listeners are notified with ReloadFailed. Otherwise, the new
+        * listeners get Reloaded. If reload is called again before the
+        * configuration is applied, only the latest one is applied.
+        *
+        * @param cfg New configuration
+        */
+        void reload(const server_config& cfg);
 
-    // storage for raw metric data. values are stored here until they are flushed
-    struct storage
-    {
-        std::map<std::string, unsigned int> counters;
-        std::map<std::string, long long> gauges;
-        std::map<std::string, std::vector<int> > timers;
+        /**
+        * Calculates the quantile of recent values of the timer. Can be called
+        * from any thread. Requires server_config::track_live_timers().
+        * @param metric Name of the timer, including the namespace
+        * @param q Quantile to calculate, in range [0, 1], e.g. 0.99 for p99
+        * @param value Receives the value of the quantile
+        * @return `false` if live timers are not tracked or timer is unknown
+        */
+        bool timer_quantile(const std::string& metric, double q, double* value) const;
 
-        void clear() {
-            counters.clear();
-            gauges.clear();
-            timers.clear();
-        }
+        /**
+        * Returns the settings of the configuration in use, without backends,
+        * listeners and callbacks (see server_config::settings). A reloaded
+        * configuration is returned once the server has applied it, when its
+        * listeners get Reloaded. Can be called from any thread.
+        */
+        server_config config() const;
     };
 
     /// statistic for a single timer
@@ -235,12 +467,82 @@ namespace metrics
         }
     };
 
+    // storage for raw metric data. values are stored here until they are flushed
+    struct storage
+    {
+        typedef std::map<std::string, long long>::iterator gauge_it;
+
+        std::map<std::string, long long> counters;
+        std::map<std::string, long long> gauges;
+        std::map<std::string, std::vector<int> > timers;
+
+        // following members are used only when gauges are kept between flushes
+        bool keep_gauges;        // gauges are not cleared on flush
+        bool sparse;             // flush only gauges updated in current interval
+        unsigned int generation; // number of current flush interval
+        std::map<std::string, unsigned int> gauge_updates; // interval of last update
+        std::vector<gauge_it> dirty_gauges; // gauges updated in current interval
+        timing_wheel gauge_expiry;          // schedules removal of idle gauges
+
+        live_timers* live;       // reservoirs updated with each timer value, if set
+        prefix_rollups* rollups; // prefix rollups updated with each value, if set
+        cardinality_limiter* limiter; // admits new metrics, if set
+        persisted_interval* persisted; // file which mirrors the interval, if set
+
+        // timers restored from the persisted interval, merged into the flushed timers
+        std::map<std::string, timer_data> recovered_timers;
+
+        // canonical form of each tag list seen, so that it is sorted only once
+        std::unordered_map<std::string, std::string> tag_sets;
+
+        storage() : keep_gauges(false), sparse(false), generation(1), live(NULL), rollups(NULL), limiter(NULL), persisted(NULL) { ; }
+
+        void clear() {
+            counters.clear();
+            gauges.clear();
+            timers.clear();
+            gauge_updates.clear();
+            dirty_gauges.clear();
+            tag_sets.clear();
+            recovered_timers.clear();
+        }
+
+        // returns the canonical form of comma separated tags: sorted, without
+        // duplicates and empty tags
+        const std::string& tag_set(const char* tags);
+
+        // returns the gauge value for update, creating the gauge if needed
+        long long& gauge(const std::string& name);
+
+        // starts the next flush interval: clears counters, timers and, unless
+        // they are kept, gauges. Kept gauges which were idle for too long expire
+        void next_interval();
+    };
+
+    // adds to an internal counter of the local server, reported with the next
+    // flush. Must be called on the server thread, e.g. from a backend
+    void count_internal(const char* metric, unsigned int count);
+
+    /// separates the metric name from its tags in storage and stats keys,
+    /// e.g. "requests|#code:200,method:get". Tags are in canonical form.
+    const char TAGS_SEPARATOR[] = "|#";
+
+    /// length of the metric name in a storage or stats key, without the tags
+    inline size_t name_length(const std::string& key)
+    {
+        size_t pos = key.find(TAGS_SEPARATOR);
+        return pos == std::string::npos ? key.size() : pos;
+    }
+
     /// contains processed metric statistics
     struct stats
     {
         timer::time_point timestamp;
-        std::map<std::string, double> counters; ///< counter data
+        unsigned int period_ms;                  ///< flush period covered by the stats
+        std::map<std::string, double> counters; ///< counter data, per second
         std::map<std::string, long long> gauges; ///< gauge data
         std::map<std::string, timer_data> timers; ///< timer data
+
+        stats() : timestamp(0), period_ms(0) { ; }
     };
 }
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include "stdafx.h"
+#include "persisted_interval.h"
+#include "metrics_server.h"
+#include <cmath>
+
+namespace metrics
+{
+    // gauge deltas are stored as gauges
+    static int slot_type(metric_type type)
+    {
+        return type == gauge_delta ? gauge : type;
+    }
+
+    persisted_interval::persisted_interval(const std::string& filename, unsigned int capacity) :
+        m_file(INVALID_HANDLE_VALUE),
+        m_mapping(NULL),
+        m_header(NULL),
+        m_slots(NULL),
+        m_capacity(capacity),
+        m_inactive(0),
+        m_reuse(0)
+    {
+        m_file = CreateFile(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+            NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE) throw std::runtime_error("Failed opening interval file");
+
+        // the mapping grows the file if needed
+        unsigned long long size = sizeof(interval_file_header) + (unsigned long long)capacity * sizeof(interval_slot);
+        m_mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+        if (m_mapping) m_header = (interval_file_header*)MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+        if (!m_header) {
+            close();
+            throw std::runtime_error("Failed mapping interval file");
+        }
+        m_slots = (interval_slot*)(m_header + 1);
+
+        bool valid = m_header->magic == INTERVAL_MAGIC && m_header->version == INTERVAL_VERSION
+            && m_header->slot_size == sizeof(interval_slot);
+        if (!valid) {
+            m_header->used = 0;
+            m_header->started = timer::to_unix_ms(timer::now());
+            m_header->magic = INTERVAL_MAGIC;
+            m_header->version = INTERVAL_VERSION;
+            m_header->slot_size = sizeof(interval_slot);
+        }
+        // slots beyond the new capacity are not mapped
+        if ((unsigned int)m_header->used > capacity) m_header->used = capacity;
+        m_header->capacity = capacity;
+
+        for (unsigned int i = 0; i < (unsigned int)m_header->used; ++i) {
+            interval_slot& s = m_slots[i];
+            s.name[sizeof(s.name) - 1] = '\0';
+            if (s.type >= 0 && s.type < _countof(m_index)) m_index[s.type][s.name] = i;
+            if (!s.active) m_inactive++;
+        }
+    }
+
+    persisted_interval::~persisted_interval()
+    {
+        close();
+    }
+
+    void persisted_interval::close()
+    {
+        if (m_header) {
+            FlushViewOfFile(m_header, 0);
+            UnmapViewOfFile(m_header);
+        }
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+        m_header = NULL;
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+    }
+
+    size_t persisted_interval::restore(storage& storage) const
+    {
+        size_t restored = 0;
+        for (unsigned int i = 0; i < (unsigned int)m_header->used; ++i) {
+            const interval_slot& s = m_slots[i];
+            if (!s.active) continue;
+            switch (s.type) {
+                case counter:
+                    storage.counters[s.name] += s.value;
+                    break;
+                case gauge:
+                    storage.gauge(s.name) = s.value;
+                    break;
+                case histogram: {
+                    if (s.count == 0) continue;
+                    timer_data data = { s.name, (int)s.count, s.max, s.min, s.sum, 0, 0 };
+                    data.avg = s.sum / (double)s.count;
+                    double var = s.square_sum / (double)s.count - data.avg * data.avg;
+                    data.stddev = var > 0 ? sqrt(var) : 0;
+                    storage.recovered_timers[s.name] = data;
+                    break;
+                }
+                default:
+                    continue;
+            }
+            restored++;
+        }
+        return restored;
+    }
+
+    interval_slot* persisted_interval::slot(const std::string& key, int type)
+    {
+        auto& index = m_index[type];
+        auto it = index.find(key);
+        if (it != index.end()) return &m_slots[it->second];
+
+        if (key.size() >= sizeof(m_slots[0].name)) return NULL;
+
+        unsigned int used = (unsigned int)m_header->used;
+        interval_slot* s = used < m_capacity ? &m_slots[used] : reuse_slot();
+        if (!s) return NULL;
+
+        // the slot is inactive until update(), so it isn't restored half written
+        memset(s, 0, sizeof(*s));
+        memcpy(s->name, key.c_str(), key.size() + 1);
+        s->type = type;
+        if (used < m_capacity) {
+            InterlockedIncrement(&m_header->used); // publishes the complete slot
+            m_inactive++;
+        }
+        index[key] = (unsigned int)(s - m_slots);
+        return s;
+    }
+
+    // returns an inactive slot, removed from the index, or NULL if all slots are active
+    interval_slot* persisted_interval::reuse_slot()
+    {
+        if (m_inactive == 0) return NULL;
+
+        unsigned int used = (unsigned int)m_header->used;
+        for (unsigned int checked = 0; checked < used; ++checked) {
+            if (m_reuse >= used) m_reuse = 0;
+            interval_slot& s = m_slots[m_reuse++];
+            if (s.active) continue;
+
+            if (s.type >= 0 && s.type < _countof(m_index)) m_index[s.type].erase(s.name);
+            return &s;
+        }
+        return NULL;
+    }
+
+    bool persisted_interval::update(const std::string& key, metric_type type, long long value)
+    {
+        interval_slot* s = slot(key, slot_type(type));
+        if (!s) return false;
+
+        switch (type) {
+            case counter:
+                s->value += value;
+                break;
+            case gauge:
+            case gauge_delta:
+                if (s->active && s->value == value) return true; // the page isn't written
+                s->value = value;
+                break;
+            case histogram:
+                if (s->count == 0 || value < s->min) s->min = (int)value;
+                if (s->count == 0 || value > s->max) s->max = (int)value;
+                s->sum += value;
+                s->square_sum += value * value;
+                s->count++;
+                break;
+        }
+        if (!s->active) {
+            s->active = 1;
+            m_inactive--;
+        }
+        return true;
+    }
+
+    void persisted_interval::expire(const std::string& gauge_key)
+    {
+        auto& index = m_index[gauge];
+        auto it = index.find(gauge_key);
+        if (it == index.end() || !m_slots[it->second].active) return;
+
+        m_slots[it->second].active = 0;
+        m_inactive++;
+    }
+
+    void persisted_interval::next_interval(bool keep_gauges)
+    {
+        unsigned int used = (unsigned int)m_header->used;
+        for (unsigned int i = 0; i < used; ++i) {
+            interval_slot& s = m_slots[i];
+            if (!s.active || (keep_gauges && s.type == gauge)) continue;
+
+            // the name stays, so that the metric finds its slot in the next interval
+            s.active = 0;
+            s.value = s.count = s.sum = s.square_sum = 0;
+            s.min = s.max = 0;
+            m_inactive++;
+        }
+        m_header->started = timer::to_unix_ms(timer::now());
+    }
+
+    void persisted_interval::reset(const storage& storage)
+    {
+        InterlockedExchange(&m_header->used, 0);
+        for (size_t i = 0; i < _countof(m_index); ++i) m_index[i].clear();
+        m_inactive = 0;
+        m_reuse = 0;
+        m_header->started = timer::to_unix_ms(timer::now());
+
+        FOR_EACH (auto& g, storage.gauges) update(g.first, gauge, g.second);
+    }
+}
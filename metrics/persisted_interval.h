@@ -0,0 +1,108 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include "metrics.h"
+
+namespace metrics
+{
+    struct storage;
+
+    /// header at the start of a persisted interval file
+    struct interval_file_header
+    {
+        unsigned int magic;      ///< INTERVAL_MAGIC
+        unsigned short version;  ///< format version, currently 2
+        unsigned short slot_size;///< size of interval_slot
+        unsigned int capacity;   ///< number of slots which fit into the file
+        volatile LONG used;      ///< number of slots written, they follow the header
+        long long started;       ///< start of the interval, in ms since unix epoch
+    };
+
+    /// one metric of the current interval, as stored in the file
+    struct interval_slot
+    {
+        char name[128];          ///< storage key, with tags
+        int type;                ///< counter, gauge or histogram
+        int min;                 ///< timer minimum
+        int max;                 ///< timer maximum
+        int active;              ///< 1 if the slot holds a value of the current interval
+        long long value;         ///< counter sum, or gauge value
+        long long count;         ///< number of timer values
+        long long sum;           ///< sum of timer values
+        long long square_sum;    ///< sum of squares of timer values
+    };
+
+    const unsigned int INTERVAL_MAGIC = 0x544E494D; // "MINT"
+    const unsigned short INTERVAL_VERSION = 2;
+
+    /**
+    * Keeps the counters, gauges and timers of the current flush interval in
+    * a memory-mapped file, so that a restarted server can resume the
+    * interval. Each value is applied to the mapped slot of its metric in
+    * place, while it is stored: there is no serialization, and no I/O on the
+    * server thread. The OS writes the pages to the file even if the process
+    * crashes (but not if the machine does).
+    *
+    * Timers are kept as summaries (count, sum, sum of squares, min and max),
+    * so their size doesn't depend on the number of values. Counters and
+    * timers are reset with each flush, but keep their slots, so a metric
+    * which is received again doesn't write its name again. Kept gauges stay
+    * in the file, and are written only when they change. Slots of metrics
+    * which are not in the current interval are reused when the file is full.
+    */
+    class persisted_interval
+    {
+        HANDLE m_file;
+        HANDLE m_mapping;
+        interval_file_header* m_header;
+        interval_slot* m_slots;
+        unsigned int m_capacity;
+        unsigned int m_inactive; // slots which don't hold a value of the current interval
+        unsigned int m_reuse;    // next slot checked for reuse, when the file is full
+        std::unordered_map<std::string, unsigned int> m_index[3]; // slot of each metric, per type
+
+    public:
+        /**
+        * Opens or creates the file, and maps it into memory. Metrics already
+        * in a valid file are kept, until restore() or reset() is called.
+        * @param filename Name of the file
+        * @param capacity Maximum number of metrics in the file
+        * @throws std::runtime_error Thrown if the file can't be opened or mapped
+        */
+        persisted_interval(const std::string& filename, unsigned int capacity);
+        ~persisted_interval();
+
+        /// adds the metrics found in the file to the storage. Returns their number
+        size_t restore(storage& storage) const;
+
+        /// start of the interval in the file, in ms since unix epoch
+        long long started() const { return m_header->started; }
+
+        /**
+        * Applies the value to the metric's slot.
+        * @param key Storage key of the metric
+        * @param type Type of the metric
+        * @param value The value, for gauges the resulting gauge value
+        * @return false if the metric doesn't fit into the file
+        */
+        bool update(const std::string& key, metric_type type, long long value);
+
+        /// removes the gauge from the file, e.g. when it expires
+        void expire(const std::string& gauge_key);
+
+        /// starts the next interval: resets counters and timers, and also gauges unless they are kept
+        void next_interval(bool keep_gauges);
+
+        /// discards the file content, and starts the interval with the gauges kept in the storage
+        void reset(const storage& storage);
+
+    private:
+        interval_slot* slot(const std::string& key, int type);
+        interval_slot* reuse_slot();
+        void close();
+
+        persisted_interval(const persisted_interval&);
+        persisted_interval& operator=(const persisted_interval&);
+    };
+}
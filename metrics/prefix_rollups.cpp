@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "prefix_rollups.h"
+#include "metrics_server.h"
+#include <cmath>
+
+namespace metrics
+{
+    const unsigned int NO_NODE = 0; // root is never a child
+
+    prefix_rollups::prefix_rollups(const std::vector<std::string>& prefixes)
+    {
+        node root;
+        root.rollup = -1;
+        m_nodes.push_back(root);
+
+        FOR_EACH (auto& prefix, prefixes) {
+            unsigned int current = 0;
+            size_t pos = 0;
+            while (pos < prefix.size()) {
+                size_t end = prefix.find('.', pos);
+                if (end == std::string::npos) end = prefix.size();
+
+                unsigned int next = child(current, prefix.data() + pos, end - pos);
+                if (next == NO_NODE) {
+                    node n;
+                    n.segment = prefix.substr(pos, end - pos);
+                    n.rollup = -1;
+                    next = (unsigned int)m_nodes.size();
+                    m_nodes.push_back(n);
+                    m_nodes[current].children.push_back(next);
+                }
+                current = next;
+                pos = end + 1;
+            }
+            if (current == 0 || m_nodes[current].rollup >= 0) continue; // empty or duplicate
+
+            rollup r;
+            r.name = rollup_name(prefix);
+            r.counter = 0;
+            r.counted = false;
+            r.count = 0;
+            r.timer.min = r.timer.max = 0;
+            r.timer.sum = r.timer.square_sum = 0;
+            m_nodes[current].rollup = (int)m_rollups.size();
+            m_rollups.push_back(r);
+        }
+    }
+
+    unsigned int prefix_rollups::child(unsigned int parent, const char* segment, size_t len) const
+    {
+        FOR_EACH (auto i, m_nodes[parent].children) {
+            auto& s = m_nodes[i].segment;
+            if (s.size() == len && memcmp(s.data(), segment, len) == 0) return i;
+        }
+        return NO_NODE;
+    }
+
+    void prefix_rollups::add(const std::string& metric, metric_type type, long long value)
+    {
+        if (type != counter && type != histogram) return;
+
+        size_t len = name_length(metric);
+        unsigned int current = 0;
+        size_t pos = 0;
+        while (true) {
+            int r = m_nodes[current].rollup;
+            if (r >= 0) {
+                if (type == counter) {
+                    m_rollups[r].counter += value;
+                    m_rollups[r].counted = true;
+                }
+                else {
+                    int v = (int)value; // clamped by store_metric
+                    rollup& t = m_rollups[r];
+                    if (t.count == 0 || v < t.timer.min) t.timer.min = v;
+                    if (t.count == 0 || v > t.timer.max) t.timer.max = v;
+                    t.timer.sum += v;
+                    t.timer.square_sum += (long long)v * v;
+                    t.count++;
+                }
+            }
+            if (pos >= len) break;
+
+            size_t end = metric.find('.', pos);
+            if (end == std::string::npos || end > len) end = len;
+            current = child(current, metric.data() + pos, end - pos);
+            if (current == NO_NODE) break;
+            pos = end + 1;
+        }
+    }
+
+    void prefix_rollups::flush(unsigned int period_ms, stats& stats) const
+    {
+        auto period = period_ms / 1000.0;
+        FOR_EACH (auto& r, m_rollups) {
+            if (r.counted) stats.counters[r.name] = r.counter / period;
+            if (r.count == 0) continue;
+
+            timer_data data = { r.name, r.count, r.timer.max, r.timer.min, r.timer.sum, 0, 0 };
+            data.avg = r.timer.sum / (double)r.count;
+            double var = r.timer.square_sum / (double)r.count - data.avg * data.avg;
+            data.stddev = var > 0 ? sqrt(var) : 0;
+            stats.timers[r.name] = data;
+        }
+    }
+
+    void prefix_rollups::clear()
+    {
+        FOR_EACH (auto& r, m_rollups) {
+            r.counter = 0;
+            r.counted = false;
+            r.count = 0;
+            r.timer.sum = 0;
+            r.timer.square_sum = 0;
+        }
+    }
+}
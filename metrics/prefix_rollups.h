@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "metrics.h"
+#include "timer_kernel.h"
+
+namespace metrics
+{
+    struct stats;
+
+    /**
+    * Aggregates subtrees of dotted metric names, e.g. all counters under
+    * `stats.comm.rq` into `stats.comm.rq._all`. Counters are summed, and the
+    * values of timers are merged into one timer, kept as a summary (count,
+    * sum, sum of squares, min and max), so its size doesn't depend on the
+    * number of values. Tags are ignored, so the rollup also covers all tag
+    * sets of the matched metrics.
+    *
+    * Configured prefixes are kept in a trie of name segments. Each value is
+    * added to the rollups while it is stored, walking the trie along the
+    * segments of its name, so the flush only has to report the totals.
+    */
+    class prefix_rollups
+    {
+        struct node
+        {
+            std::string segment;
+            std::vector<unsigned int> children; // indices of child nodes
+            int rollup;                         // index of rollup ending here, or -1
+        };
+
+        struct rollup
+        {
+            std::string name;        // prefix + "._all"
+            long long counter;       // sum of counters in current interval
+            bool counted;            // a counter was added in current interval
+            int count;               // number of timer values in current interval
+            sample_summary timer;    // summary of the timer values
+        };
+
+        std::vector<node> m_nodes;   // m_nodes[0] is the root
+        std::vector<rollup> m_rollups;
+
+    public:
+        /**
+        * Builds the trie
+        * @param prefixes Dotted prefixes, including the namespace
+        */
+        explicit prefix_rollups(const std::vector<std::string>& prefixes);
+
+        /// adds the value to all rollups of the prefixes of the metric
+        void add(const std::string& metric, metric_type type, long long value);
+
+        /// adds the rollups of the current interval to the stats
+        void flush(unsigned int period_ms, stats& stats) const;
+
+        /// starts the next interval
+        void clear();
+
+        /// name of the rollup metric for the prefix
+        static std::string rollup_name(const std::string& prefix) { return prefix + "._all"; }
+
+    private:
+        unsigned int child(unsigned int parent, const char* segment, size_t len) const;
+    };
+}
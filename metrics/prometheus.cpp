@@ -0,0 +1,402 @@
+#include "stdafx.h"
+#include "prometheus.h"
+#include "metrics_server.h"
+#include "reservoir.h"
+#include "json_writer.h"
+#include "sync.h"
+#include <set>
+
+namespace metrics
+{
+    // FD_SETSIZE is 64 on Windows, listener takes one slot
+    const size_t MAX_CONNECTIONS = 32;
+    // requests are tiny, anything bigger is not a scraper
+    const size_t MAX_REQUEST = 8192;
+    // connection which doesn't finish its request in this time is closed
+    const timer::duration REQUEST_TIMEOUT = 10000;
+
+    // quantiles reported for timers when live timers are tracked
+    const double LIVE_QUANTILES[] = { 0, 0.5, 0.9, 0.99, 1 };
+    const char* const LIVE_QUANTILE_LABELS[] = {
+        "quantile=\"0\"", "quantile=\"0.5\"", "quantile=\"0.9\"", "quantile=\"0.99\"", "quantile=\"1\""
+    };
+    // totals of counters and timers which are not flushed for this many flushes are dropped
+    const unsigned int IDLE_TOTAL_FLUSHES = 360;
+
+    struct prometheus_exporter::connection
+    {
+        SOCKET socket;
+        timer::time_point started;
+        std::string request;
+        std::string header;
+        std::shared_ptr<const std::string> body;  // keeps the body alive while it is sent
+        size_t sent;                              // bytes of header and body sent
+        bool responding;
+    };
+
+    prometheus_exporter::prometheus_exporter(unsigned int port) :
+        m_listener(INVALID_SOCKET),
+        m_thread(NULL),
+        m_stop(0),
+        m_body(new std::string()),
+        m_flushes(0)
+    {
+        ensure_winsock_started();
+        InitializeCriticalSection(&m_lock);
+
+        m_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        SOCK_ADDR_IN addr(AF_INET, INADDR_ANY, port);
+        if (m_listener == INVALID_SOCKET
+            || bind(m_listener, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR
+            || listen(m_listener, SOMAXCONN) == SOCKET_ERROR) {
+            dbg_print("cannot start prometheus listener on port %d, error: %d", port, WSAGetLastError());
+            if (m_listener != INVALID_SOCKET) closesocket(m_listener);
+            DeleteCriticalSection(&m_lock);
+            throw std::runtime_error("Failed starting prometheus listener");
+        }
+
+        unsigned long non_blocking = 1;
+        ioctlsocket(m_listener, FIONBIO, &non_blocking);
+
+        m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+        if (!m_thread) {
+            closesocket(m_listener);
+            DeleteCriticalSection(&m_lock);
+            throw std::runtime_error("Failed creating prometheus thread");
+        }
+    }
+
+    prometheus_exporter::~prometheus_exporter()
+    {
+        InterlockedExchange(&m_stop, 1);
+        WaitForSingleObject(m_thread, INFINITE);
+        CloseHandle(m_thread);
+        closesocket(m_listener);
+        DeleteCriticalSection(&m_lock);
+    }
+
+    unsigned int prometheus_exporter::port() const
+    {
+        sockaddr_in addr;
+        int len = sizeof(addr);
+        if (getsockname(m_listener, (sockaddr*)&addr, &len) == SOCKET_ERROR) return 0;
+        return ntohs(addr.sin_port);
+    }
+
+    void prometheus_exporter::publish(const stats& stats, unsigned int period_ms, const live_timers* live)
+    {
+        // scrapers may still be sending the previous body, so a new one is rendered
+        std::string* body = new std::string();
+        body->reserve(this->body()->size() + 1024);
+        render(stats, period_ms, live, *body);
+
+        std::shared_ptr<const std::string> next(body);
+        scoped_lock _(&m_lock);
+        m_body.swap(next);
+    }
+
+    std::shared_ptr<const std::string> prometheus_exporter::body() const
+    {
+        scoped_lock _(&m_lock);
+        return m_body;
+    }
+
+    static void write_value(std::string& out, double value)
+    {
+        if (value != value) out += "NaN";
+        else if (value - value != 0) out += value > 0 ? "+Inf" : "-Inf";
+        else json_writer::write_double(out, value);
+    }
+
+    static bool valid_name_char(char c, size_t pos)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (c >= '0' && c <= '9' && pos > 0);
+    }
+
+    const std::string& prometheus_exporter::sanitize(const std::string& key, const char* suffix)
+    {
+        m_name.assign(key, 0, name_length(key)).append(suffix);
+        for (size_t i = 0; i < m_name.size(); ++i) {
+            if (!valid_name_char(m_name[i], i) && m_name[i] != ':') m_name[i] = '_';
+        }
+        return m_name;
+    }
+
+    const std::string& prometheus_exporter::labels(const std::string& key, const char* extra)
+    {
+        m_labels.clear();
+        size_t pos = name_length(key);
+        if (pos < key.size()) pos += strlen(TAGS_SEPARATOR);
+
+        while (pos < key.size()) {
+            size_t end = key.find(',', pos);
+            if (end == std::string::npos) end = key.size();
+            size_t colon = key.find(':', pos);
+            if (colon > end) colon = end;
+
+            m_labels += m_labels.empty() ? '{' : ',';
+            for (size_t i = pos; i < colon; ++i) m_labels += valid_name_char(key[i], i - pos) ? key[i] : '_';
+            m_labels += "=\"";
+            if (colon == end) m_labels += "true";  // tag without value
+            for (size_t i = colon + 1; i < end; ++i) {
+                char c = key[i];
+                if (c == '\\' || c == '"') m_labels += '\\';
+                m_labels += c;
+            }
+            m_labels += '"';
+            pos = end + 1;
+        }
+
+        if (extra) m_labels.append(m_labels.empty() ? "{" : ",").append(extra);
+        if (!m_labels.empty()) m_labels += '}';
+        return m_labels;
+    }
+
+    // samples grouped by metric family. All samples of a family have to be
+    // rendered together, but different keys can map to the same family, e.g.
+    // "a|#tag", "a.b" and "a_b", and they are not adjacent in the sorted maps
+    class family_set
+    {
+        struct family
+        {
+            std::string name;
+            const char* type;
+            std::string samples;
+        };
+
+        std::vector<family> m_families;           // in order of their first sample
+        std::map<std::string, size_t> m_index;    // family of each name, also _sum and _count of summaries
+        std::set<std::string> m_series;           // name and labels of each added series
+
+    public:
+        // returns the buffer for samples of the series, or NULL if the series
+        // was already added, or the name is used by a family of another type
+        std::string* add(const std::string& name, const std::string& labels, const char* type)
+        {
+            bool summary = strcmp(type, "summary") == 0;
+            auto it = m_index.find(name);
+            if (it == m_index.end()) {
+                if (summary && (m_index.count(name + "_sum") || m_index.count(name + "_count"))) return NULL;
+
+                family f = { name, type, std::string() };
+                m_families.push_back(f);
+                it = m_index.insert(std::make_pair(name, m_families.size() - 1)).first;
+                if (summary) {
+                    m_index[name + "_sum"] = it->second;
+                    m_index[name + "_count"] = it->second;
+                }
+            }
+
+            family& f = m_families[it->second];
+            if (f.name != name || strcmp(f.type, type) != 0) return NULL;
+            if (!m_series.insert(name + labels).second) return NULL;
+            return &f.samples;
+        }
+
+        void write(std::string& out) const
+        {
+            FOR_EACH (auto& f, m_families) {
+                out.append("# TYPE ").append(f.name).append(" ").append(f.type).append("\n").append(f.samples);
+            }
+        }
+    };
+
+    void prometheus_exporter::render(const stats& stats, unsigned int period_ms, const live_timers* live, std::string& out)
+    {
+        m_flushes++;
+        FOR_EACH (auto& c, stats.counters) {
+            counter_total& total = m_totals[c.first];
+            total.value += c.second * period_ms / 1000.0;
+            total.flush = m_flushes;
+        }
+        FOR_EACH (auto& t, stats.timers) {
+            timer_total& total = m_timer_totals[t.first];
+            total.sum += t.second.sum;
+            total.count += t.second.count;
+            total.flush = m_flushes;
+        }
+
+        family_set families;
+        for (auto t = m_totals.begin(); t != m_totals.end(); ) {
+            // counters which are not active anymore are still reported with their totals, for a while
+            if (m_flushes - t->second.flush >= IDLE_TOTAL_FLUSHES) {
+                t = m_totals.erase(t);
+                continue;
+            }
+            auto& name = sanitize(t->first, "_total");
+            auto& labels = this->labels(t->first, NULL);
+            std::string* samples = families.add(name, labels, "counter");
+            if (samples) {
+                samples->append(name).append(labels).append(" ");
+                write_value(*samples, t->second.value);
+                *samples += '\n';
+            }
+            ++t;
+        }
+
+        FOR_EACH (auto& g, stats.gauges) {
+            auto& name = sanitize(g.first, "");
+            auto& labels = this->labels(g.first, NULL);
+            std::string* samples = families.add(name, labels, "gauge");
+            if (!samples) continue;
+
+            char value[32];
+            _snprintf_s(value, _countof(value), _TRUNCATE, " %lld\n", g.second);
+            samples->append(name).append(labels).append(value);
+        }
+
+        const size_t live_count = _countof(LIVE_QUANTILES);
+        double quantiles[live_count];
+        std::string series_labels;
+        for (auto t = m_timer_totals.begin(); t != m_timer_totals.end(); ) {
+            // like counters, idle timers are still reported with their totals, for a while
+            if (m_flushes - t->second.flush >= IDLE_TOTAL_FLUSHES) {
+                t = m_timer_totals.erase(t);
+                continue;
+            }
+            auto& name = sanitize(t->first, "");
+            series_labels = labels(t->first, NULL);
+            std::string* samples = families.add(name, series_labels, "summary");
+            if (!samples) {
+                ++t;
+                continue;
+            }
+
+            // quantiles all come from the reservoir, or from the interval, if the timer was flushed
+            char value[32];
+            auto flushed = stats.timers.find(t->first);
+            if (live && live->quantiles(t->first, LIVE_QUANTILES, live_count, quantiles)) {
+                for (size_t i = 0; i < live_count; ++i) {
+                    samples->append(name).append(labels(t->first, LIVE_QUANTILE_LABELS[i])).append(" ");
+                    write_value(*samples, quantiles[i]);
+                    *samples += '\n';
+                }
+            }
+            else if (flushed != stats.timers.end()) {
+                _snprintf_s(value, _countof(value), _TRUNCATE, " %d\n", flushed->second.min);
+                samples->append(name).append(labels(t->first, "quantile=\"0\"")).append(value);
+                _snprintf_s(value, _countof(value), _TRUNCATE, " %d\n", flushed->second.max);
+                samples->append(name).append(labels(t->first, "quantile=\"1\"")).append(value);
+            }
+            // sum and count are cumulative, as Prometheus requires
+            _snprintf_s(value, _countof(value), _TRUNCATE, " %lld\n", t->second.sum);
+            samples->append(name).append("_sum").append(series_labels).append(value);
+            _snprintf_s(value, _countof(value), _TRUNCATE, " %lld\n", t->second.count);
+            samples->append(name).append("_count").append(series_labels).append(value);
+            ++t;
+        }
+
+        families.write(out);
+    }
+
+    DWORD WINAPI prometheus_exporter::thread_proc(LPVOID params)
+    {
+        static_cast<prometheus_exporter*>(params)->serve();
+        return 0;
+    }
+
+    void prometheus_exporter::serve()
+    {
+        std::vector<connection> connections;
+
+        while (!m_stop) {
+            fd_set rdset, wrset;
+            FD_ZERO(&rdset);
+            FD_ZERO(&wrset);
+            FD_SET(m_listener, &rdset);
+            int maxfd = (int)m_listener;
+            FOR_EACH (auto& c, connections) {
+                FD_SET(c.socket, c.responding ? &wrset : &rdset);
+                if ((int)c.socket > maxfd) maxfd = (int)c.socket;
+            }
+
+            timeval timeout = { 0, 100000 }; // stop flag is checked this often
+            int ready = select(maxfd + 1, &rdset, &wrset, NULL, &timeout);
+
+            for (size_t i = 0; i < connections.size(); ) {
+                connection& c = connections[i];
+                bool keep = timer::since(c.started) < REQUEST_TIMEOUT;
+                if (keep && ready > 0 && (FD_ISSET(c.socket, &rdset) || FD_ISSET(c.socket, &wrset))) {
+                    keep = handle(c, FD_ISSET(c.socket, &rdset) != 0);
+                }
+                if (keep) {
+                    ++i;
+                    continue;
+                }
+                closesocket(c.socket);
+                connections.erase(connections.begin() + i);
+            }
+
+            if (ready > 0 && FD_ISSET(m_listener, &rdset)) {
+                SOCKET s = accept(m_listener, NULL, NULL);
+                if (s == INVALID_SOCKET) continue;
+                if (connections.size() >= MAX_CONNECTIONS) {
+                    closesocket(s);
+                    continue;
+                }
+
+                unsigned long non_blocking = 1;
+                ioctlsocket(s, FIONBIO, &non_blocking);
+                connection c;
+                c.socket = s;
+                c.started = timer::now();
+                c.sent = 0;
+                c.responding = false;
+                connections.push_back(c);
+            }
+        }
+
+        FOR_EACH (auto& c, connections) closesocket(c.socket);
+    }
+
+    // returns false when the connection should be closed
+    bool prometheus_exporter::handle(connection& c, bool readable)
+    {
+        if (!c.responding) {
+            if (!readable) return true;
+
+            char buf[1024];
+            int received = recv(c.socket, buf, sizeof(buf), 0);
+            if (received == 0) return false;
+            if (received < 0) return WSAGetLastError() == WSAEWOULDBLOCK;
+
+            c.request.append(buf, received);
+            if (c.request.size() > MAX_REQUEST) return false;
+            if (c.request.find("\r\n\r\n") == std::string::npos) return true;
+
+            if (c.request.compare(0, 13, "GET /metrics ") == 0 || c.request.compare(0, 13, "GET /metrics?") == 0) {
+                c.body = body();
+                char header[256];
+                _snprintf_s(header, _countof(header), _TRUNCATE,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %u\r\n"
+                    "Connection: close\r\n\r\n", (unsigned int)c.body->size());
+                c.header = header;
+            }
+            else {
+                c.header = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+            c.responding = true;
+        }
+
+        size_t body_size = c.body ? c.body->size() : 0;
+        while (c.sent < c.header.size() + body_size) {
+            const char* data;
+            size_t len;
+            if (c.sent < c.header.size()) {
+                data = c.header.data() + c.sent;
+                len = c.header.size() - c.sent;
+            }
+            else {
+                data = c.body->data() + (c.sent - c.header.size());
+                len = body_size - (c.sent - c.header.size());
+            }
+
+            int sent = send(c.socket, data, (int)len, 0);
+            if (sent == SOCKET_ERROR) return WSAGetLastError() == WSAEWOULDBLOCK;
+            c.sent += sent;
+        }
+        return false; // response is complete
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include "metrics.h"
+
+namespace metrics
+{
+    struct stats;
+    class live_timers;
+
+    /**
+    * Serves the latest flushed stats over HTTP, in Prometheus text exposition
+    * format. Used by the server when server_config::serve_prometheus() is set.
+    *
+    * The response body is rendered once per flush, and all scrapes until the
+    * next flush are served from the same immutable buffer. Requests are
+    * handled on a separate thread, so slow scrapers never delay the server.
+    *
+    * Counters are exported as `<name>_total` counters, accumulated over
+    * flushes, and dropped if they are not flushed for an hour's worth of
+    * flushes (360). Gauges are exported as gauges, and timers as summaries,
+    * whose `_sum` and `_count` are accumulated and dropped in the same way.
+    * If the server tracks live timers, all quantiles of a summary (0, 0.5,
+    * 0.9, 0.99 and 1) come from the timer's reservoir, otherwise the min and
+    * max of the flush interval are exported as quantiles 0 and 1.
+    *
+    * Characters which are not valid in Prometheus names are replaced with
+    * `_`. Metrics whose names become the same (e.g. `a.b` and `a_b`) are
+    * exported as one family, and if their series clash, or the family has
+    * another type, only the first one is exported. Metric tags are exported
+    * as labels, tags without value get value `true`.
+    */
+    class prometheus_exporter
+    {
+        struct connection;
+
+        struct counter_total
+        {
+            double value;
+            unsigned int flush;  // last flush which updated the total
+        };
+
+        struct timer_total
+        {
+            long long sum;
+            long long count;
+            unsigned int flush;  // last flush which updated the total
+        };
+
+        SOCKET m_listener;
+        HANDLE m_thread;
+        volatile LONG m_stop;
+        mutable CRITICAL_SECTION m_lock;
+        std::shared_ptr<const std::string> m_body;  // guarded by m_lock
+        std::map<std::string, counter_total> m_totals; // accumulated counters
+        std::map<std::string, timer_total> m_timer_totals; // accumulated timer sums and counts
+        unsigned int m_flushes;                      // number of published flushes
+        std::string m_name;                          // reused for sanitized names
+        std::string m_labels;                        // reused for rendered labels
+
+    public:
+        /**
+        * Starts listening for scrapes.
+        * @param port Port of the HTTP listener, 0 picks any free port
+        * @throws std::runtime_error Thrown if the listener can't be started
+        */
+        explicit prometheus_exporter(unsigned int port);
+        ~prometheus_exporter();
+
+        /// returns the port on which the exporter is listening
+        unsigned int port() const;
+
+        /**
+        * Renders the stats and makes them available to scrapers
+        * @param stats Statistic data resulting from last flush
+        * @param period_ms Flush period, used to accumulate counter totals
+        * @param live Live timers used for timer quantiles, can be NULL
+        */
+        void publish(const stats& stats, unsigned int period_ms, const live_timers* live);
+
+        /// returns the body served to scrapers
+        std::shared_ptr<const std::string> body() const;
+
+    private:
+        void render(const stats& stats, unsigned int period_ms, const live_timers* live, std::string& out);
+        const std::string& sanitize(const std::string& key, const char* suffix);
+        const std::string& labels(const std::string& key, const char* extra);
+        void serve();
+        bool handle(connection& conn, bool readable);
+        static DWORD WINAPI thread_proc(LPVOID params);
+
+        prometheus_exporter(const prometheus_exporter&);
+        prometheus_exporter& operator=(const prometheus_exporter&);
+    };
+}
@@ -0,0 +1,176 @@
+#include "stdafx.h"
+#include "reservoir.h"
+#include "sync.h"
+#include <algorithm>
+#include <math.h>
+
+namespace metrics
+{
+    // landmark is moved forward before the weights get too large for a double
+    const double RESCALE_PERIOD_S = 3600;
+
+    static bool lower_value(const std::pair<int, double>& lhs, const std::pair<int, double>& rhs)
+    {
+        return lhs.first < rhs.first;
+    }
+
+    decaying_reservoir::decaying_reservoir(size_t size, double alpha, double now_s) :
+        m_size(size),
+        m_alpha(alpha),
+        m_landmark(now_s)
+    {
+        LARGE_INTEGER seed;
+        QueryPerformanceCounter(&seed);
+        m_random = (unsigned long long)seed.QuadPart ^ (unsigned long long)(size_t)this;
+        if (m_random == 0) m_random = 0x9E3779B97F4A7C15ULL;
+        m_heap.reserve(size);
+    }
+
+    bool decaying_reservoir::lower_priority(const sample& lhs, const sample& rhs)
+    {
+        return lhs.priority > rhs.priority; // std heap functions build a max-heap
+    }
+
+    double decaying_reservoir::next_random()
+    {
+        // xorshift64*, rand() is too coarse and not random enough for this
+        m_random ^= m_random >> 12;
+        m_random ^= m_random << 25;
+        m_random ^= m_random >> 27;
+        unsigned long long r = m_random * 2685821657736338717ULL;
+        return ((r >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+    }
+
+    void decaying_reservoir::update(int value, double now_s)
+    {
+        if (now_s - m_landmark >= RESCALE_PERIOD_S) rescale(now_s);
+
+        sample s;
+        s.weight = exp(m_alpha * (now_s - m_landmark));
+        s.priority = s.weight / next_random();
+        s.value = value;
+
+        if (m_heap.size() < m_size) {
+            m_heap.push_back(s);
+            std::push_heap(m_heap.begin(), m_heap.end(), lower_priority);
+        }
+        else if (s.priority > m_heap.front().priority) {
+            // replace the sample with the lowest priority
+            std::pop_heap(m_heap.begin(), m_heap.end(), lower_priority);
+            m_heap.back() = s;
+            std::push_heap(m_heap.begin(), m_heap.end(), lower_priority);
+        }
+    }
+
+    void decaying_reservoir::rescale(double now_s)
+    {
+        // scaling all priorities by the same factor keeps the heap valid
+        double factor = exp(-m_alpha * (now_s - m_landmark));
+        FOR_EACH (auto& s, m_heap) {
+            s.weight *= factor;
+            s.priority *= factor;
+        }
+        m_landmark = now_s;
+    }
+
+    double decaying_reservoir::quantile(double q) const
+    {
+        double value;
+        quantiles(&q, 1, &value);
+        return value;
+    }
+
+    void decaying_reservoir::quantiles(const double* qs, size_t count, double* values) const
+    {
+        if (m_heap.empty()) {
+            for (size_t i = 0; i < count; ++i) values[i] = 0;
+            return;
+        }
+
+        std::vector<std::pair<int, double> > samples;
+        samples.reserve(m_heap.size());
+        double total = 0;
+        FOR_EACH (auto& s, m_heap) {
+            samples.push_back(std::make_pair(s.value, s.weight));
+            total += s.weight;
+        }
+        std::sort(samples.begin(), samples.end(), lower_value);
+
+        // single pass over the samples, as quantiles are sorted too
+        size_t pos = 0;
+        double acc = samples[0].second;
+        for (size_t i = 0; i < count; ++i) {
+            double target = qs[i] * total;
+            while (acc < target && pos + 1 < samples.size()) acc += samples[++pos].second;
+            values[i] = samples[pos].first;
+        }
+    }
+
+    live_timers::live_timers(size_t size, double alpha, unsigned int idle_intervals) :
+        m_size(size),
+        m_alpha(alpha),
+        m_idle_intervals(idle_intervals),
+        m_interval(0)
+    {
+        InitializeCriticalSection(&m_lock);
+    }
+
+    live_timers::~live_timers()
+    {
+        DeleteCriticalSection(&m_lock);
+    }
+
+    void live_timers::update(const std::string& metric, int value)
+    {
+        double now_s = timer::now_us() / 1000000.0;
+
+        scoped_lock _(&m_lock);
+        auto it = m_reservoirs.find(metric);
+        if (it == m_reservoirs.end()) {
+            live_reservoir r = { decaying_reservoir(m_size, m_alpha, now_s), m_interval };
+            it = m_reservoirs.insert(std::make_pair(metric, r)).first;
+        }
+        it->second.reservoir.update(value, now_s);
+        it->second.interval = m_interval;
+    }
+
+    bool live_timers::quantile(const std::string& metric, double q, double* value) const
+    {
+        scoped_lock _(&m_lock);
+        auto it = m_reservoirs.find(metric);
+        if (it == m_reservoirs.end()) return false;
+
+        *value = it->second.reservoir.quantile(q);
+        return true;
+    }
+
+    bool live_timers::quantiles(const std::string& metric, const double* qs, size_t count, double* values) const
+    {
+        scoped_lock _(&m_lock);
+        auto it = m_reservoirs.find(metric);
+        if (it == m_reservoirs.end()) return false;
+
+        it->second.reservoir.quantiles(qs, count, values);
+        return true;
+    }
+
+    void live_timers::next_interval()
+    {
+        scoped_lock _(&m_lock);
+        m_interval++;
+        for (auto it = m_reservoirs.begin(); it != m_reservoirs.end(); ) {
+            if (m_interval - it->second.interval >= m_idle_intervals) {
+                it = m_reservoirs.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    size_t live_timers::size() const
+    {
+        scoped_lock _(&m_lock);
+        return m_reservoirs.size();
+    }
+}
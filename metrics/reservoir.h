@@ -0,0 +1,128 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include "metrics.h"
+
+namespace metrics
+{
+    /**
+    * Forward-decaying priority reservoir (Cormode et al., also used by
+    * Dropwizard metrics). Keeps a fixed-size sample of timer values, biased
+    * towards recent ones, from which quantiles can be calculated at any time.
+    *
+    * Each value gets weight `exp(alpha * (t - landmark))` and priority
+    * `weight / u`, where `u` is uniform random in (0, 1]. The reservoir keeps
+    * the values with the highest priorities in a min-heap, so an update is
+    * O(log size) and doesn't allocate once the reservoir is full.
+    */
+    class decaying_reservoir
+    {
+        struct sample
+        {
+            double priority;
+            double weight;
+            int value;
+        };
+
+        std::vector<sample> m_heap; // min-heap on priority
+        size_t m_size;
+        double m_alpha;
+        double m_landmark;          // in seconds
+        unsigned long long m_random;
+
+    public:
+        /**
+        * Creates an empty reservoir.
+        * @param size Maximum number of samples kept
+        * @param alpha Decay factor. Higher value means more bias towards
+        *        recent values. 0.015 favors roughly the last 5 minutes
+        * @param now_s Current time, in seconds
+        */
+        decaying_reservoir(size_t size, double alpha, double now_s);
+
+        /// adds a value measured at the specified time (in seconds)
+        void update(int value, double now_s);
+
+        /**
+        * Calculates weighted quantile of the kept samples.
+        * @param q Quantile to calculate, in range [0, 1], e.g. 0.99 for p99
+        * @return Value of the quantile, or 0 if there are no samples
+        */
+        double quantile(double q) const;
+
+        /**
+        * Calculates several quantiles at once, sorting the samples only once.
+        * @param qs Quantiles to calculate, in ascending order
+        * @param count Number of quantiles
+        * @param values Receives the values of quantiles, 0 if there are no samples
+        */
+        void quantiles(const double* qs, size_t count, double* values) const;
+
+        /// number of samples in the reservoir
+        size_t size() const { return m_heap.size(); }
+
+    private:
+        void rescale(double now_s);
+        double next_random();
+        static bool lower_priority(const sample& lhs, const sample& rhs);
+    };
+
+    /**
+    * A set of decaying reservoirs, one per timer, which can be updated by the
+    * server thread and queried by any other thread. Reservoirs of timers
+    * which are not updated for a while are evicted.
+    */
+    class live_timers
+    {
+        struct live_reservoir
+        {
+            decaying_reservoir reservoir;
+            unsigned int interval;  // flush interval of the last update
+        };
+
+        std::map<std::string, live_reservoir> m_reservoirs;
+        mutable CRITICAL_SECTION m_lock;
+        size_t m_size;
+        double m_alpha;
+        unsigned int m_idle_intervals;
+        unsigned int m_interval;
+
+    public:
+        /**
+        * Creates an empty set.
+        * @param size Maximum number of samples kept per timer
+        * @param alpha Decay factor of the reservoirs
+        * @param idle_intervals Number of flush intervals without updates
+        *        after which a timer's reservoir is evicted
+        */
+        live_timers(size_t size, double alpha, unsigned int idle_intervals = 30);
+        ~live_timers();
+
+        /// adds a value to the timer's reservoir, creating it if needed
+        void update(const std::string& metric, int value);
+
+        /**
+        * Calculates the quantile for the timer.
+        * @param metric Name of the timer
+        * @param q Quantile to calculate, in range [0, 1]
+        * @param value Receives the value of the quantile
+        * @return `false` if the timer is unknown
+        */
+        bool quantile(const std::string& metric, double q, double* value) const;
+
+        /// same as quantile(), but calculates several quantiles (in ascending order) at once
+        bool quantiles(const std::string& metric, const double* qs, size_t count, double* values) const;
+
+        /// starts the next flush interval, evicting reservoirs idle for too long
+        void next_interval();
+
+        /// number of timers with a reservoir
+        size_t size() const;
+
+    private:
+        live_timers(const live_timers&);
+        live_timers& operator=(const live_timers&);
+    };
+}
@@ -0,0 +1,137 @@
+#include "stdafx.h"
+#include "resolver.h"
+
+namespace metrics
+{
+    // until the host is resolved for the first time, lookups are retried this often
+    const DWORD FIRST_RETRY_MS = 1000;
+
+    static bool is_host_name(const std::string& host)
+    {
+        if (host.size() > 255) return false;
+        for (size_t i = 0; i < host.size(); ++i) {
+            char c = host[i];
+            bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                || c == '-' || c == '.' || c == '_';
+            if (!valid) return false;
+        }
+        return true;
+    }
+
+    address_resolver::address_resolver(const std::string& host, unsigned int port, unsigned int interval) :
+        m_host(host),
+        m_current(NULL),
+        m_interval_ms(interval * 1000),
+        m_thread(NULL),
+        m_stop(NULL)
+    {
+        char txt[16];
+        _snprintf_s(txt, _countof(txt), _TRUNCATE, "%u", port);
+        m_port = txt;
+
+        // numeric addresses don't change, so there is nothing to refresh
+        if (resolve(AI_NUMERICHOST)) return;
+
+        if (!is_host_name(host)) {
+            char msg[512];
+            _snprintf_s(msg, _countof(msg), _TRUNCATE, "%s is not a valid host name", host.c_str());
+            dbg_print(msg);
+            throw config_exception(msg);
+        }
+
+        m_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (m_stop) m_thread = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+        if (!m_thread) {
+            if (m_stop) CloseHandle(m_stop);
+            throw std::runtime_error("Failed creating resolver thread");
+        }
+    }
+
+    address_resolver::~address_resolver()
+    {
+        stop();
+        FOR_EACH (auto a, m_known) delete a;
+    }
+
+    void address_resolver::stop()
+    {
+        if (!m_thread) return;
+
+        SetEvent(m_stop);
+        WaitForSingleObject(m_thread, INFINITE);
+        CloseHandle(m_thread);
+        CloseHandle(m_stop);
+        m_thread = NULL;
+        m_stop = NULL;
+    }
+
+    void address_resolver::set_interval(unsigned int seconds)
+    {
+        InterlockedExchange(&m_interval_ms, seconds * 1000);
+    }
+
+    DWORD WINAPI address_resolver::thread_proc(LPVOID params)
+    {
+        static_cast<address_resolver*>(params)->run();
+        return 0;
+    }
+
+    void address_resolver::run()
+    {
+        DWORD wait_ms;
+        do {
+            resolve(0);
+            wait_ms = (DWORD)m_interval_ms;
+            if (!m_current && wait_ms > FIRST_RETRY_MS) wait_ms = FIRST_RETRY_MS;
+        } while (WaitForSingleObject(m_stop, wait_ms) == WAIT_TIMEOUT);
+    }
+
+    bool address_resolver::resolve(int flags)
+    {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_protocol = IPPROTO_UDP;
+        hints.ai_flags = flags;
+
+        addrinfo* result = NULL;
+        int err = getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &result);
+        if (err != 0 || !result) {
+            if (flags == 0) dbg_print("Could not obtain address of %s. Error: %d", m_host.c_str(), err);
+            return false;
+        }
+
+        // metrics server listens on IPv4, so IPv4 addresses are preferred
+        const addrinfo* found = result;
+        for (const addrinfo* ai = result; ai; ai = ai->ai_next) {
+            if (ai->ai_family == AF_INET) {
+                found = ai;
+                break;
+            }
+        }
+
+        // senders may still use any published address, so known ones are reused
+        resolved_address* next = NULL;
+        FOR_EACH (auto a, m_known) {
+            if (a->len == (int)found->ai_addrlen && memcmp(&a->addr, found->ai_addr, found->ai_addrlen) == 0) {
+                next = a;
+                break;
+            }
+        }
+        if (!next) {
+            next = new resolved_address();
+            memcpy(&next->addr, found->ai_addr, found->ai_addrlen);
+            next->len = (int)found->ai_addrlen;
+            m_known.push_back(next);
+        }
+        freeaddrinfo(result);
+
+        const resolved_address* current = m_current;
+        if (current == next) return true;
+
+        InterlockedExchangePointer((PVOID volatile*)&m_current, next);
+        if (current) dbg_print("address of %s changed", m_host.c_str());
+        return true;
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "metrics.h"
+#include <ws2tcpip.h> // needs winsock2.h first
+
+namespace metrics
+{
+    /// server address, as returned by getaddrinfo
+    struct resolved_address
+    {
+        SOCKADDR_STORAGE addr;
+        int len;
+    };
+
+    /**
+    * Keeps the server address up to date. Numeric addresses are converted
+    * immediately. Host names are resolved on a background thread, which
+    * repeats the lookup every refresh interval, so that clients follow DNS
+    * changes without being restarted.
+    *
+    * Senders read the address without locking: a changed address is swapped
+    * in atomically, and replaced addresses are kept alive as long as the
+    * resolver, so a sender can use an address it has read at any time. Each
+    * distinct address is allocated only once, so addresses which alternate
+    * (e.g. DNS round robin) don't add up.
+    */
+    class address_resolver
+    {
+        std::string m_host;
+        std::string m_port;
+        resolved_address* volatile m_current;  // NULL until the host is resolved
+        std::vector<resolved_address*> m_known; // all addresses ever published
+        volatile LONG m_interval_ms;
+        HANDLE m_thread;
+        HANDLE m_stop;
+
+    public:
+        /**
+        * Creates a resolver, and starts the refresh thread for host names
+        * @param host Host name, or IPv4/IPv6 address
+        * @param port Server port
+        * @param interval How often is the host name resolved, in seconds
+        * @throws config_exception Thrown if host is not a valid host name
+        * @throws std::runtime_error Thrown if refresh thread can't be started
+        */
+        address_resolver(const std::string& host, unsigned int port, unsigned int interval);
+        ~address_resolver();
+
+        /// the latest address, or NULL if host wasn't resolved yet. Never blocks.
+        const resolved_address* current() const { return m_current; }
+
+        /// changes the refresh interval, effective after the next refresh
+        void set_interval(unsigned int seconds);
+
+        /// stops refreshing the address, the current one is kept
+        void stop();
+
+    private:
+        static DWORD WINAPI thread_proc(LPVOID params);
+        void run();
+        bool resolve(int flags);
+
+        address_resolver(const address_resolver&);
+        address_resolver& operator=(const address_resolver&);
+    };
+}
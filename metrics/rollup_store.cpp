@@ -0,0 +1,251 @@
+#include "stdafx.h"
+#include "rollup_store.h"
+#include "metrics_server.h"
+#include "sync.h"
+#include <algorithm>
+#include <map>
+
+namespace metrics
+{
+    // fixed-size ring of buckets for one metric at one resolution
+    struct rollup_ring
+    {
+        std::vector<rollup_point> points; // grows up to `slots`, then wraps
+        size_t oldest;                    // index of the oldest point, once full
+        rollup_point open;                // bucket being filled
+        bool has_open;
+
+        rollup_ring() : oldest(0), has_open(false) { ; }
+
+        void add(long long bucket, long long period, const rollup_point& value, unsigned int slots)
+        {
+            advance(bucket, period, slots);
+            if (open.count == 0) {
+                open.min = value.min;
+                open.max = value.max;
+            }
+            open.count += value.count;
+            open.sum += value.sum;
+            if (value.min < open.min) open.min = value.min;
+            if (value.max > open.max) open.max = value.max;
+        }
+
+        // closes the open bucket if `bucket` is newer, and adds an empty bucket
+        // for each period without data, so the ring always covers its retention
+        void advance(long long bucket, long long period, unsigned int slots)
+        {
+            if (has_open && open.timestamp >= bucket) return;
+
+            long long next = bucket;
+            if (has_open) {
+                push(open, slots);
+                // older empty buckets would be overwritten anyway
+                next = open.timestamp + period;
+                if (next < bucket - slots * period) next = bucket - slots * period;
+            }
+            for (; next < bucket; next += period) push(empty(next), slots);
+
+            open = empty(bucket);
+            has_open = true;
+        }
+
+        static rollup_point empty(long long bucket)
+        {
+            rollup_point p = { bucket, 0, 0, 0, 0 };
+            return p;
+        }
+
+        void push(const rollup_point& point, unsigned int slots)
+        {
+            if (points.size() < slots) {
+                points.push_back(point);
+            }
+            else {
+                points[oldest] = point;
+                oldest = (oldest + 1) % slots;
+            }
+        }
+
+        void copy_range(long long from, long long to, std::vector<rollup_point>& out) const
+        {
+            for (size_t i = 0; i < points.size(); ++i) {
+                const rollup_point& p = points[(oldest + i) % points.size()];
+                if (p.timestamp >= from && p.timestamp <= to) out.push_back(p);
+            }
+            if (has_open && open.timestamp >= from && open.timestamp <= to) out.push_back(open);
+        }
+    };
+
+    struct rollup_series
+    {
+        std::vector<rollup_ring> rings; // one for each resolution
+        long long last_update;          // time of the last flush with data, in ms
+    };
+
+    static bool finer(const rollup_store::resolution& lhs, const rollup_store::resolution& rhs)
+    {
+        return lhs.period < rhs.period;
+    }
+
+    struct rollup_store::data
+    {
+        CRITICAL_SECTION lock;
+        std::vector<resolution> resolutions;
+        std::map<std::string, rollup_series> series;
+        long long last_flush;
+
+        data() : last_flush(0) { InitializeCriticalSection(&lock); }
+        ~data() { DeleteCriticalSection(&lock); }
+
+        void add(const std::string& name, long long unix_ms, const rollup_point& value)
+        {
+            auto& s = series[name];
+            if (s.rings.empty()) s.rings.resize(resolutions.size());
+            s.last_update = unix_ms;
+
+            for (size_t i = 0; i < resolutions.size(); ++i) {
+                long long period = resolutions[i].period * 1000LL;
+                s.rings[i].add(unix_ms - unix_ms % period, period, value, resolutions[i].slots);
+            }
+        }
+
+        // moves rings of metrics which weren't flushed to the current bucket,
+        // and drops metrics without data in the longest retention
+        void advance(long long unix_ms)
+        {
+            long long retention = 0;
+            FOR_EACH (auto& r, resolutions) {
+                if (retention < r.period * 1000LL * r.slots) retention = r.period * 1000LL * r.slots;
+            }
+
+            for (auto it = series.begin(); it != series.end(); ) {
+                if (unix_ms - it->second.last_update > retention) {
+                    it = series.erase(it);
+                    continue;
+                }
+                for (size_t i = 0; i < resolutions.size(); ++i) {
+                    long long period = resolutions[i].period * 1000LL;
+                    it->second.rings[i].advance(unix_ms - unix_ms % period, period, resolutions[i].slots);
+                }
+                ++it;
+            }
+        }
+
+        void add_resolution(unsigned int period, unsigned int retention)
+        {
+            resolution res = { period, retention / period };
+            resolutions.push_back(res);
+            std::sort(resolutions.begin(), resolutions.end(), finer);
+        }
+
+        // returns index of the resolution, or -1 if it's not configured
+        int find(unsigned int period) const
+        {
+            for (size_t i = 0; i < resolutions.size(); ++i) {
+                if (resolutions[i].period == period) return (int)i;
+            }
+            return -1;
+        }
+
+    private:
+        data(const data&);
+        data& operator=(const data&);
+    };
+
+    rollup_store::rollup_store() : m_data(new data()) { ; }
+
+    rollup_store& rollup_store::add_resolution(unsigned int period, unsigned int retention)
+    {
+        if (period < 1) throw config_exception("rollup period must be greater than 0");
+        if (retention < period || retention % period != 0) {
+            throw config_exception("rollup retention must be a multiple of period");
+        }
+
+        scoped_lock _(&m_data->lock);
+        if (!m_data->series.empty()) throw config_exception("rollup store already contains data");
+        if (m_data->find(period) >= 0) throw config_exception("rollup period already configured");
+
+        m_data->add_resolution(period, retention);
+        return *this;
+    }
+
+    std::vector<rollup_store::resolution> rollup_store::resolutions() const
+    {
+        scoped_lock _(&m_data->lock);
+        return m_data->resolutions;
+    }
+
+    void rollup_store::operator()(const stats& stats)
+    {
+        add(stats, timer::to_unix_ms(stats.timestamp));
+    }
+
+    void rollup_store::add(const stats& stats, long long unix_ms)
+    {
+        scoped_lock _(&m_data->lock);
+        if (m_data->resolutions.empty()) {
+            m_data->add_resolution(10, 3600);          // 10s for 1h
+            m_data->add_resolution(60, 86400);         // 1m for 24h
+            m_data->add_resolution(3600, 30 * 86400);  // 1h for 30 days
+        }
+        m_data->last_flush = unix_ms;
+
+        FOR_EACH (auto& c, stats.counters) {
+            rollup_point p = { 0, 1, c.second, c.second, c.second };
+            m_data->add(c.first, unix_ms, p);
+        }
+        FOR_EACH (auto& g, stats.gauges) {
+            double value = (double)g.second;
+            rollup_point p = { 0, 1, value, value, value };
+            m_data->add(g.first, unix_ms, p);
+        }
+        FOR_EACH (auto& t, stats.timers) {
+            if (t.second.count == 0) continue;
+            rollup_point p = { 0, t.second.count, (double)t.second.sum, (double)t.second.min, (double)t.second.max };
+            m_data->add(t.first, unix_ms, p);
+        }
+        m_data->advance(unix_ms);
+    }
+
+    std::vector<rollup_point> rollup_store::query(const std::string& metric, long long from, long long to) const
+    {
+        scoped_lock _(&m_data->lock);
+        if (m_data->resolutions.empty()) return std::vector<rollup_point>();
+
+        // pick the finest resolution which still has data back to `from`
+        auto& resolutions = m_data->resolutions;
+        size_t index = resolutions.size() - 1;
+        for (size_t i = 0; i < resolutions.size(); ++i) {
+            long long retention = resolutions[i].period * 1000LL * resolutions[i].slots;
+            if (m_data->last_flush - from <= retention) {
+                index = i;
+                break;
+            }
+        }
+        return query(metric, from, to, resolutions[index].period);
+    }
+
+    std::vector<rollup_point> rollup_store::query(const std::string& metric, long long from, long long to, unsigned int period) const
+    {
+        scoped_lock _(&m_data->lock);
+        int index = m_data->find(period);
+        if (index < 0) throw config_exception("rollup period is not configured");
+
+        std::vector<rollup_point> result;
+        auto it = m_data->series.find(metric);
+        if (it == m_data->series.end()) return result;
+
+        // bucket which contains `from` starts before it
+        it->second.rings[index].copy_range(from - from % (period * 1000LL), to, result);
+        return result;
+    }
+
+    std::vector<std::string> rollup_store::names() const
+    {
+        scoped_lock _(&m_data->lock);
+        std::vector<std::string> result;
+        result.reserve(m_data->series.size());
+        FOR_EACH (auto& s, m_data->series) result.push_back(s.first);
+        return result;
+    }
+}
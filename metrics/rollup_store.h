@@ -0,0 +1,119 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace metrics
+{
+    struct stats;
+
+    /// aggregated value of a metric over one time bucket
+    struct rollup_point
+    {
+        long long timestamp; ///< start of the bucket, in ms since unix epoch
+        long long count;     ///< number of values aggregated (flushes, or samples for timers)
+        double sum;          ///< sum of aggregated values
+        double min;          ///< minimum aggregated value
+        double max;          ///< maximum aggregated value
+
+        /// returns the average value in the bucket
+        double avg() const { return count > 0 ? sum / count : 0; }
+    };
+
+    /**
+    * Keeps the history of flushed stats in memory, so it can be queried
+    * without an external time series database, e.g. by a local dashboard
+    * or a health check.
+    *
+    * Each metric has a fixed-size ring buffer for each configured resolution.
+    * Every flush is added into the current bucket of each resolution, so no
+    * separate downsampling pass is ever needed. Counters are stored as rates,
+    * gauges as values, and timers as durations: for timers, `count`
+    * is the number of samples and `min`/`max` are the extremes.
+    *
+    * Rings of all metrics advance with every flush, so periods in which a
+    * metric had no data are kept as empty buckets (with `count` 0). Metrics
+    * without data for longer than the longest retention are dropped.
+    *
+    * Copies of the store share the data, so the store can be added to server
+    * as backend, and queried from any thread through the original instance:
+    *
+    * ~~~{.cpp}
+    * metrics::rollup_store history;  // 10s for 1h, 1m for 24h, 1h for 30d
+    * auto cfg = metrics::server_config().add_backend(history);
+    * metrics::server::run(cfg);
+    * ...
+    * auto now = metrics::timer::to_unix_ms(metrics::timer::now());
+    * auto last_hour = history.query("stats.app.requests", now - 3600000, now);
+    * ~~~
+    */
+    class rollup_store
+    {
+    public:
+        /// describes one resolution kept by the store
+        struct resolution
+        {
+            unsigned int period;   ///< length of a bucket, in seconds
+            unsigned int slots;    ///< number of buckets kept
+        };
+
+        /**
+        * Creates an empty store. If no resolutions are added using
+        * add_resolution(), 10s for 1h, 1m for 24h and 1h for 30 days are used.
+        */
+        rollup_store();
+
+        /**
+        * Adds a resolution to the store. Must be called before any data is added.
+        * @param period Length of a bucket, in seconds
+        * @param retention How long the data is kept, in seconds. Must be a
+        *        multiple of the `period`
+        * @throws config_exception Thrown if arguments are not valid or data
+        *         was already added
+        */
+        rollup_store& add_resolution(unsigned int period, unsigned int retention);
+
+        /// returns the configured resolutions, from finest to coarsest
+        std::vector<resolution> resolutions() const;
+
+        /**
+        * Stores the provided statistics
+        * @param stats Statistic data resulting from last flush
+        */
+        void operator()(const stats& stats);
+
+        /**
+        * Stores the provided statistics, as if they were flushed at the specified time
+        * @param stats Statistic data to be stored
+        * @param unix_ms Time of the flush, in ms since unix epoch
+        */
+        void add(const stats& stats, long long unix_ms);
+
+        /**
+        * Returns buckets of the metric which start in the range [from, to],
+        * including the bucket which is still being filled. Uses the finest
+        * resolution which still covers `from`. Buckets without data have
+        * `count` 0.
+        * @param metric Name of the metric
+        * @param from Start of the range, in ms since unix epoch
+        * @param to End of the range, in ms since unix epoch
+        * @return Buckets ordered by time, empty if metric is unknown
+        */
+        std::vector<rollup_point> query(const std::string& metric, long long from, long long to) const;
+
+        /**
+        * Same as query() above, but uses the specified resolution
+        * @param period Length of bucket in seconds, must be one of configured resolutions
+        * @throws config_exception Thrown if the resolution is not configured
+        */
+        std::vector<rollup_point> query(const std::string& metric, long long from, long long to, unsigned int period) const;
+
+        /// returns the names of all stored metrics
+        std::vector<std::string> names() const;
+
+    private:
+        struct data;
+        std::shared_ptr<data> m_data;
+    };
+}
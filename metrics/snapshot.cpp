@@ -0,0 +1,203 @@
+#include "stdafx.h"
+#include "snapshot.h"
+#include "metrics_server.h"
+
+namespace metrics
+{
+    static_assert(sizeof(snapshot_header) == 64, "snapshot header layout changed");
+    static_assert(sizeof(snapshot_counter) == 16, "snapshot counter layout changed");
+    static_assert(sizeof(snapshot_gauge) == 16, "snapshot gauge layout changed");
+    static_assert(sizeof(snapshot_timer) == 40, "snapshot timer layout changed");
+
+    // size of the part of the file mapped at once
+    const unsigned long long SNAPSHOT_WINDOW = 16 * 1024 * 1024;
+
+    static unsigned int align8(size_t size)
+    {
+        return (unsigned int)((size + 7) & ~(size_t)7);
+    }
+
+    template <typename T>
+    static void append(std::string& out, const T& value)
+    {
+        out.append((const char*)&value, sizeof(value));
+    }
+
+    void snapshot_backend::operator()(const stats& stats)
+    {
+        serialize(stats, m_sink->buffer());
+        m_sink->write();
+    }
+
+    void snapshot_backend::operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded)
+    {
+        m_sink->write(*encoded);
+    }
+
+    void snapshot_backend::serialize(const stats& stats, std::string& out)
+    {
+        snapshot_header header = { 0 };
+        header.magic = SNAPSHOT_MAGIC;
+        header.version = SNAPSHOT_VERSION;
+        header.header_size = sizeof(snapshot_header);
+        header.timestamp = timer::to_unix_ms(stats.timestamp);
+        header.counter_count = (unsigned int)stats.counters.size();
+        header.gauge_count = (unsigned int)stats.gauges.size();
+        header.timer_count = (unsigned int)stats.timers.size();
+        header.counter_size = sizeof(snapshot_counter);
+        header.gauge_size = sizeof(snapshot_gauge);
+        header.timer_size = sizeof(snapshot_timer);
+        header.counters_offset = sizeof(snapshot_header);
+        header.gauges_offset = header.counters_offset + header.counter_count * sizeof(snapshot_counter);
+        header.timers_offset = header.gauges_offset + header.gauge_count * sizeof(snapshot_gauge);
+        header.names_offset = header.timers_offset + header.timer_count * sizeof(snapshot_timer);
+
+        size_t names_size = 0;
+        FOR_EACH (auto& c, stats.counters) names_size += c.first.size() + 1;
+        FOR_EACH (auto& g, stats.gauges) names_size += g.first.size() + 1;
+        FOR_EACH (auto& t, stats.timers) names_size += t.first.size() + 1;
+        header.names_size = align8(names_size);
+        header.size = header.names_offset + header.names_size;
+
+        size_t start = out.size();
+        out.reserve(start + header.size);
+        append(out, header);
+
+        // names are laid out in the same order as the metrics
+        unsigned int name = 0;
+        FOR_EACH (auto& c, stats.counters) {
+            snapshot_counter counter = { name, 0, c.second };
+            append(out, counter);
+            name += (unsigned int)c.first.size() + 1;
+        }
+        FOR_EACH (auto& g, stats.gauges) {
+            snapshot_gauge gauge = { name, 0, g.second };
+            append(out, gauge);
+            name += (unsigned int)g.first.size() + 1;
+        }
+        FOR_EACH (auto& t, stats.timers) {
+            auto& td = t.second;
+            snapshot_timer timer = { name, td.count, td.min, td.max, td.sum, td.avg, td.stddev };
+            append(out, timer);
+            name += (unsigned int)t.first.size() + 1;
+        }
+
+        FOR_EACH (auto& c, stats.counters) out.append(c.first.c_str(), c.first.size() + 1);
+        FOR_EACH (auto& g, stats.gauges) out.append(g.first.c_str(), g.first.size() + 1);
+        FOR_EACH (auto& t, stats.timers) out.append(t.first.c_str(), t.first.size() + 1);
+        out.append(start + header.size - out.size(), '\0'); // padding
+    }
+
+    snapshot_reader::snapshot_reader(const std::string& filename) :
+        m_file(INVALID_HANDLE_VALUE),
+        m_mapping(NULL),
+        m_view(NULL),
+        m_view_offset(0),
+        m_view_size(0),
+        m_size(0),
+        m_position(0)
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        m_granularity = info.dwAllocationGranularity;
+
+        m_file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE) throw std::runtime_error("Failed opening snapshot file");
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size)) {
+            close();
+            throw std::runtime_error("Failed reading snapshot file size");
+        }
+        m_size = size.QuadPart;
+        if (m_size == 0) return; // empty files can't be mapped
+
+        m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_mapping || !map(0, 0)) {
+            close();
+            throw std::runtime_error("Failed mapping snapshot file");
+        }
+    }
+
+    snapshot_reader::~snapshot_reader()
+    {
+        close();
+    }
+
+    void snapshot_reader::close()
+    {
+        if (m_view) UnmapViewOfFile(m_view);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+        m_view = NULL;
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+    }
+
+    const char* snapshot_reader::map(unsigned long long offset, unsigned long long size)
+    {
+        if (m_view && offset >= m_view_offset && offset + size <= m_view_offset + m_view_size) {
+            return m_view + (offset - m_view_offset);
+        }
+
+        if (m_view) UnmapViewOfFile(m_view);
+        m_view = NULL;
+
+        // the window may be larger than usual, if a single record is larger
+        unsigned long long start = offset - offset % m_granularity;
+        unsigned long long end = start + SNAPSHOT_WINDOW;
+        if (end < offset + size) end = offset + size;
+        if (end > m_size) end = m_size;
+        if (end - start > (SIZE_T)-1) return NULL;
+
+        m_view = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)start, (SIZE_T)(end - start));
+        if (!m_view) return NULL;
+        m_view_offset = start;
+        m_view_size = end - start;
+        return m_view + (offset - start);
+    }
+
+    // checks that the name offsets of the array elements point into the name table
+    static bool valid_names(const char* record, unsigned int offset, unsigned int count, unsigned int size, unsigned int names_size)
+    {
+        for (unsigned int i = 0; i < count; ++i) {
+            // the name is the first field of all elements
+            if (*(const unsigned int*)(record + offset + (size_t)i * size) >= names_size) return false;
+        }
+        return true;
+    }
+
+    bool snapshot_reader::next(snapshot_view& snapshot)
+    {
+        unsigned long long left = m_size - m_position;
+        if (left < sizeof(snapshot_header)) return false;
+
+        const char* record = map(m_position, sizeof(snapshot_header));
+        if (!record) return false;
+        snapshot_header header = *(const snapshot_header*)record;
+        if (header.magic != SNAPSHOT_MAGIC || header.header_size < sizeof(snapshot_header)) return false;
+        if (header.size > left || header.size % 8 != 0) return false;
+
+        // arrays must fit inside the record, whatever the element sizes
+        if (header.counter_size < sizeof(snapshot_counter) || header.gauge_size < sizeof(snapshot_gauge)
+            || header.timer_size < sizeof(snapshot_timer)) return false;
+        if ((unsigned long long)header.counters_offset + (unsigned long long)header.counter_count * header.counter_size > header.size
+            || (unsigned long long)header.gauges_offset + (unsigned long long)header.gauge_count * header.gauge_size > header.size
+            || (unsigned long long)header.timers_offset + (unsigned long long)header.timer_count * header.timer_size > header.size
+            || (unsigned long long)header.names_offset + header.names_size > header.size) return false;
+
+        record = map(m_position, header.size);
+        if (!record) return false;
+
+        // names must be within the table, which ends with a terminating zero
+        if (header.names_size > 0 && record[header.names_offset + header.names_size - 1] != '\0') return false;
+        if (!valid_names(record, header.counters_offset, header.counter_count, header.counter_size, header.names_size)
+            || !valid_names(record, header.gauges_offset, header.gauge_count, header.gauge_size, header.names_size)
+            || !valid_names(record, header.timers_offset, header.timer_count, header.timer_size, header.names_size)) return false;
+
+        snapshot = snapshot_view(record);
+        m_position += header.size;
+        return true;
+    }
+}
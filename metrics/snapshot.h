@@ -0,0 +1,206 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include "file_sink.h"
+
+namespace metrics
+{
+    struct stats;
+
+    /**
+    * Header of one snapshot record in a binary snapshot file. The file is a
+    * sequence of records, each starting with this header, followed by arrays
+    * of counters, gauges and timers, and a table of null-terminated metric
+    * names. All records and arrays start at 8 byte aligned offsets, and all
+    * values are little-endian.
+    *
+    * Element sizes are stored in the header, so readers can skip fields which
+    * are added by newer versions.
+    */
+    struct snapshot_header
+    {
+        unsigned int magic;           ///< SNAPSHOT_MAGIC
+        unsigned short version;       ///< format version, currently 1
+        unsigned short header_size;   ///< size of this header
+        unsigned int size;            ///< size of the whole record, including header
+        unsigned int names_size;      ///< size of the name table
+        long long timestamp;          ///< time of the flush, in ms since unix epoch
+        unsigned int counter_count;   ///< number of counters
+        unsigned int gauge_count;     ///< number of gauges
+        unsigned int timer_count;     ///< number of timers
+        unsigned short counter_size;  ///< size of a counter element
+        unsigned short gauge_size;    ///< size of a gauge element
+        unsigned short timer_size;    ///< size of a timer element
+        unsigned short reserved;
+        unsigned int counters_offset; ///< offset of counters from the start of record
+        unsigned int gauges_offset;   ///< offset of gauges from the start of record
+        unsigned int timers_offset;   ///< offset of timers from the start of record
+        unsigned int names_offset;    ///< offset of the name table from the start of record
+        unsigned int reserved2;
+    };
+
+    const unsigned int SNAPSHOT_MAGIC = 0x504E534D; // "MSNP"
+    const unsigned short SNAPSHOT_VERSION = 1;
+
+    /// counter in a snapshot, `name` is an offset into the name table
+    struct snapshot_counter
+    {
+        unsigned int name;
+        unsigned int reserved;
+        double value;           ///< rate per second
+    };
+
+    /// gauge in a snapshot, `name` is an offset into the name table
+    struct snapshot_gauge
+    {
+        unsigned int name;
+        unsigned int reserved;
+        long long value;
+    };
+
+    /// timer in a snapshot, `name` is an offset into the name table
+    struct snapshot_timer
+    {
+        unsigned int name;
+        int count;
+        int min;
+        int max;
+        long long sum;
+        double avg;
+        double stddev;
+    };
+
+    /**
+    * Backend which appends each flush to a file as a binary snapshot record,
+    * which can be read back with snapshot_reader without any parsing. Like
+    * file_backend, it keeps the file open, writes each flush at once and
+    * handles external rotation. Copies of the backend share the file.
+    */
+    class snapshot_backend
+    {
+        std::shared_ptr<file_sink> m_sink;
+    public:
+        /**
+        * Creates an instance of snapshot_backend
+        * @param filename name of the file where snapshots will be written
+        */
+        snapshot_backend(const char* filename) : m_sink(new file_sink(filename)){ ; }
+
+        /// see file_backend::sync()
+        snapshot_backend& sync(file_sync policy, unsigned int period = 0) {
+            m_sink->sync(policy, period);
+            return *this;
+        }
+
+        /**
+        * Appends the provided statistics data to the file
+        * @param stats Statistic data resulting from last flush
+        */
+        void operator()(const stats& stats);
+
+        /// writes the record already encoded by serialize(), see file_backend
+        void operator()(const stats& stats, const std::shared_ptr<const std::string>& encoded);
+
+        /**
+        * Appends the snapshot record for the stats to the buffer
+        * @param stats Statistic data to be serialized
+        * @param out Buffer to which the record is appended
+        */
+        static void serialize(const stats& stats, std::string& out);
+    };
+
+    /**
+    * A snapshot record inside a mapped file. It is only valid until the next
+    * call of snapshot_reader::next(), which may map another part of the file.
+    */
+    class snapshot_view
+    {
+        const char* m_record;
+
+        const snapshot_header& header() const { return *(const snapshot_header*)m_record; }
+
+    public:
+        snapshot_view() : m_record(NULL) { ; }
+        explicit snapshot_view(const char* record) : m_record(record) { ; }
+
+        /// time of the flush, in ms since unix epoch
+        long long timestamp() const { return header().timestamp; }
+
+        size_t counter_count() const { return header().counter_count; }
+        size_t gauge_count() const { return header().gauge_count; }
+        size_t timer_count() const { return header().timer_count; }
+
+        const snapshot_counter& counter(size_t index) const {
+            return *(const snapshot_counter*)(m_record + header().counters_offset + index * header().counter_size);
+        }
+        const snapshot_gauge& gauge(size_t index) const {
+            return *(const snapshot_gauge*)(m_record + header().gauges_offset + index * header().gauge_size);
+        }
+        const snapshot_timer& timer(size_t index) const {
+            return *(const snapshot_timer*)(m_record + header().timers_offset + index * header().timer_size);
+        }
+
+        /// returns the metric name at the offset in the name table
+        const char* name(unsigned int offset) const { return m_record + header().names_offset + offset; }
+    };
+
+    /**
+    * Reads a binary snapshot file by mapping it into memory. Snapshots and
+    * their metrics are accessed in place, nothing is copied or parsed.
+    *
+    * ~~~{.cpp}
+    * metrics::snapshot_reader reader("d:\\stats.snap");
+    * metrics::snapshot_view snapshot;
+    * while (reader.next(snapshot)) {
+    *     for (size_t i = 0; i < snapshot.timer_count(); ++i) {
+    *         auto& t = snapshot.timer(i);
+    *         printf("%lld %s %.2f\n", snapshot.timestamp(), snapshot.name(t.name), t.avg);
+    *     }
+    * }
+    * ~~~
+    *
+    * Only the records which were in the file when it was opened are visible.
+    * The file is mapped in windows of a few MB, so files larger than the
+    * address space of a 32-bit process can be read too.
+    */
+    class snapshot_reader
+    {
+        HANDLE m_file;
+        HANDLE m_mapping;
+        const char* m_view;
+        unsigned long long m_view_offset; // offset of the mapped window in the file
+        unsigned long long m_view_size;
+        unsigned long long m_size;
+        unsigned long long m_position;
+        unsigned int m_granularity;       // alignment of window offsets
+
+    public:
+        /**
+        * Opens and maps the file.
+        * @param filename Name of the snapshot file
+        * @throws std::runtime_error Thrown if the file can't be opened or mapped
+        */
+        explicit snapshot_reader(const std::string& filename);
+        ~snapshot_reader();
+
+        /**
+        * Moves to the next snapshot in the file. Views returned by previous
+        * calls are no longer valid.
+        * @param snapshot Receives the next snapshot
+        * @return `false` at the end of file, or if the next record is
+        *         incomplete or corrupt (e.g. the writer crashed while writing)
+        */
+        bool next(snapshot_view& snapshot);
+
+        /// moves back to the first snapshot
+        void rewind() { m_position = 0; }
+
+    private:
+        const char* map(unsigned long long offset, unsigned long long size);
+        void close();
+
+        snapshot_reader(const snapshot_reader&);
+        snapshot_reader& operator=(const snapshot_reader&);
+    };
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "Winsock2.h"
+
+namespace metrics
+{
+    /// locks the critical section for the lifetime of the object
+    class scoped_lock
+    {
+        CRITICAL_SECTION* m_lock;
+
+    public:
+        explicit scoped_lock(CRITICAL_SECTION* lock) : m_lock(lock) { EnterCriticalSection(m_lock); }
+        ~scoped_lock() { LeaveCriticalSection(m_lock); }
+
+    private:
+        scoped_lock(const scoped_lock&);
+        scoped_lock& operator=(const scoped_lock&);
+    };
+}
@@ -0,0 +1,195 @@
+#include "stdafx.h"
+#include "tcp_client.h"
+#include "resolver.h"
+
+namespace metrics
+{
+    // connecting is given up after this time, and retried after backoff
+    const timer::duration CONNECT_TIMEOUT = 10000;
+    // largest amount of data passed to a single send call
+    const size_t MAX_CHUNK = 1024 * 1024;
+    // how often is the host name resolved again, in seconds
+    const unsigned int RESOLVE_INTERVAL = 60;
+
+    tcp_client::tcp_client(const std::string& host, unsigned int port) :
+        m_host(host),
+        m_port(port),
+        m_address(NULL),
+        m_socket(INVALID_SOCKET),
+        m_connecting(false),
+        m_connect_started(0),
+        m_retry_at(timer::now()),
+        m_backoff(0),
+        m_min_backoff(1000),
+        m_max_backoff(60000),
+        m_sent(0),
+        m_spool_limit(4 * 1024 * 1024),
+        m_dropped(0)
+    {
+        ensure_winsock_started();
+        m_resolver.reset(new address_resolver(host, port, RESOLVE_INTERVAL));
+    }
+
+    tcp_client::~tcp_client()
+    {
+        disconnect();
+    }
+
+    void tcp_client::backoff(unsigned int min_ms, unsigned int max_ms)
+    {
+        if (min_ms < 1 || max_ms < min_ms) throw config_exception("invalid reconnect backoff");
+        m_min_backoff = min_ms;
+        m_max_backoff = max_ms;
+    }
+
+    void tcp_client::send()
+    {
+        size_t last_end = m_batch_ends.empty() ? 0 : m_batch_ends.back();
+        if (m_spool.size() > last_end) m_batch_ends.push_back(m_spool.size());
+
+        if (check_connected()) drain();
+        enforce_limit();
+    }
+
+    bool tcp_client::connect()
+    {
+        if (timer::since(m_retry_at) < 0) return false;
+
+        m_address = m_resolver->current();
+        if (!m_address) return false; // not resolved yet, data stays in the spool
+
+        m_socket = socket(m_address->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if (m_socket == INVALID_SOCKET) {
+            dbg_print("cannot create socket, error: %d", WSAGetLastError());
+            disconnect();
+            return false;
+        }
+
+        unsigned long non_blocking = 1;
+        ioctlsocket(m_socket, FIONBIO, &non_blocking);
+
+        m_connecting = true;
+        m_connect_started = timer::now();
+        if (::connect(m_socket, (const sockaddr*)&m_address->addr, m_address->len) == 0) {
+            m_connecting = false;
+        }
+        else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+            dbg_print("connecting to %s:%d failed, error: %d", m_host.c_str(), m_port, WSAGetLastError());
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    bool tcp_client::check_connected()
+    {
+        if (m_socket == INVALID_SOCKET && !connect()) return false;
+
+        timeval no_wait = { 0, 0 };
+        fd_set wrset, exset, rdset;
+        FD_ZERO(&wrset);
+        FD_ZERO(&exset);
+        FD_ZERO(&rdset);
+
+        if (m_connecting) {
+            FD_SET(m_socket, &wrset);
+            FD_SET(m_socket, &exset);
+            select((int)m_socket + 1, NULL, &wrset, &exset, &no_wait);
+
+            int error = 0;
+            int len = sizeof(error);
+            bool failed = FD_ISSET(m_socket, &exset) != 0;
+            if (!failed && FD_ISSET(m_socket, &wrset)) {
+                failed = getsockopt(m_socket, SOL_SOCKET, SO_ERROR, (char*)&error, &len) != 0 || error != 0;
+                if (!failed) {
+                    dbg_print("connected to %s:%d", m_host.c_str(), m_port);
+                    m_connecting = false;
+                    m_backoff = 0;
+                    return true;
+                }
+            }
+            if (failed || timer::since(m_connect_started) > CONNECT_TIMEOUT) {
+                dbg_print("connecting to %s:%d failed, error: %d", m_host.c_str(), m_port, error);
+                disconnect();
+            }
+            return false;
+        }
+
+        if (m_resolver->current() != m_address) {
+            dbg_print("address of %s changed, reconnecting", m_host.c_str());
+            disconnect();
+            return false;
+        }
+
+        // the peer doesn't send anything, so readable socket means it was closed
+        FD_SET(m_socket, &rdset);
+        select((int)m_socket + 1, &rdset, NULL, NULL, &no_wait);
+        if (FD_ISSET(m_socket, &rdset)) {
+            char buf[256];
+            int received = recv(m_socket, buf, sizeof(buf), 0);
+            if (received == 0 || (received < 0 && WSAGetLastError() != WSAEWOULDBLOCK)) {
+                dbg_print("connection to %s:%d was closed", m_host.c_str(), m_port);
+                disconnect();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void tcp_client::disconnect()
+    {
+        if (m_socket != INVALID_SOCKET) closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+        m_connecting = false;
+        m_sent = 0; // a partially sent batch is sent again from the start
+
+        m_backoff = m_backoff == 0 ? m_min_backoff : m_backoff * 2;
+        if (m_backoff > m_max_backoff) m_backoff = m_max_backoff;
+        m_retry_at = timer::now() + m_backoff;
+    }
+
+    void tcp_client::drain()
+    {
+        while (m_sent < m_spool.size()) {
+            size_t chunk = m_spool.size() - m_sent;
+            if (chunk > MAX_CHUNK) chunk = MAX_CHUNK;
+
+            int sent = ::send(m_socket, m_spool.data() + m_sent, (int)chunk, 0);
+            if (sent == SOCKET_ERROR) {
+                if (WSAGetLastError() == WSAEWOULDBLOCK) break; // the rest goes next time
+                dbg_print("sending to %s:%d failed, error: %d", m_host.c_str(), m_port, WSAGetLastError());
+                disconnect();
+                return;
+            }
+            m_sent += sent;
+        }
+
+        // remove the batches which were sent completely
+        size_t done = 0;
+        while (!m_batch_ends.empty() && m_batch_ends.front() <= m_sent) {
+            done = m_batch_ends.front();
+            m_batch_ends.pop_front();
+        }
+        if (done == 0) return;
+
+        if (done == m_spool.size()) m_spool.clear(); // common case, keeps capacity
+        else m_spool.erase(0, done);
+        m_sent -= done;
+        FOR_EACH (auto& end, m_batch_ends) end -= done;
+    }
+
+    void tcp_client::enforce_limit()
+    {
+        while (m_spool.size() > m_spool_limit) {
+            size_t first = m_sent > 0 ? 1 : 0;              // batch being sent can't be dropped
+            if (first + 1 >= m_batch_ends.size()) break;    // the newest batch is always kept
+
+            size_t begin = first == 0 ? 0 : m_batch_ends[0];
+            size_t len = m_batch_ends[first] - begin;
+            m_spool.erase(begin, len);
+            m_batch_ends.erase(m_batch_ends.begin() + first);
+            for (size_t i = first; i < m_batch_ends.size(); ++i) m_batch_ends[i] -= len;
+            m_dropped++;
+        }
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include "metrics.h"
+
+namespace metrics
+{
+    class address_resolver;
+    struct resolved_address;
+
+    /**
+    * Persistent TCP connection for backends which push data to a remote
+    * service. It never blocks the caller: connecting and sending are
+    * non-blocking, and data which can't be sent right away is kept in a
+    * bounded spool and sent on later calls.
+    *
+    * Data is queued in batches (typically one per flush). When the spool is
+    * full, the oldest batches which weren't started yet are dropped. If the
+    * connection breaks in the middle of a batch, the whole batch is sent
+    * again after reconnecting, so the receiver never gets a partial line.
+    *
+    * Host names are resolved on a background thread and refreshed like the
+    * address of the metrics server (see address_resolver). Data is spooled
+    * until the name is resolved, and the client reconnects when the address
+    * changes.
+    */
+    class tcp_client
+    {
+        std::string m_host;
+        unsigned int m_port;
+        std::unique_ptr<address_resolver> m_resolver;
+        const resolved_address* m_address; // address of the current connection
+        SOCKET m_socket;
+        bool m_connecting;
+        timer::time_point m_connect_started;
+        timer::time_point m_retry_at;
+        unsigned int m_backoff;      // current reconnect delay, in ms
+        unsigned int m_min_backoff;
+        unsigned int m_max_backoff;
+
+        std::string m_spool;         // queued data, the oldest batch first
+        size_t m_sent;               // bytes of the first batch already sent
+        std::deque<size_t> m_batch_ends; // end offsets of queued batches
+        size_t m_spool_limit;
+        unsigned int m_dropped;
+
+    public:
+        /**
+        * Creates a client. The connection is established on first send.
+        * @param host Name or address of the remote host
+        * @param port Remote port
+        * @throws config_exception Thrown if host is not a valid host name or address
+        * @throws std::runtime_error Thrown if the resolver thread can't be started
+        */
+        tcp_client(const std::string& host, unsigned int port);
+        ~tcp_client();
+
+        /**
+        * Specifies how long to wait before reconnecting. The delay starts at
+        * `min_ms` and doubles after each failed attempt, up to `max_ms`.
+        * Defaults are 1s and 60s.
+        */
+        void backoff(unsigned int min_ms, unsigned int max_ms);
+
+        /// specifies the maximum number of bytes kept while disconnected. Default is 4 MB
+        void spool_limit(size_t bytes) { m_spool_limit = bytes; }
+
+        /// buffer into which the next batch should be appended, before calling send()
+        std::string& buffer() { return m_spool; }
+
+        /**
+        * Queues the data appended to buffer() since the last call as one batch,
+        * and sends as much of the queued data as possible without blocking.
+        */
+        void send();
+
+        bool connected() const { return m_socket != INVALID_SOCKET && !m_connecting; }
+        size_t spooled() const { return m_spool.size() - m_sent; } ///< bytes not sent yet
+        unsigned int dropped() const { return m_dropped; }          ///< batches dropped so far
+
+    private:
+        bool connect();
+        bool check_connected();
+        void disconnect();
+        void drain();
+        void enforce_limit();
+
+        tcp_client(const tcp_client&);
+        tcp_client& operator=(const tcp_client&);
+    };
+}
@@ -0,0 +1,176 @@
+#include "stdafx.h"
+#include "timer_kernel.h"
+#include <intrin.h>
+#include <smmintrin.h>
+
+// VS2010 doesn't know about AVX2 intrinsics, they were added in VS2012
+#if _MSC_VER >= 1700
+#include <immintrin.h>
+#define METRICS_HAS_AVX2
+#endif
+
+namespace metrics
+{
+    void summarize_scalar(const int* values, size_t count, sample_summary* out)
+    {
+        int min = values[0];
+        int max = values[0];
+        long long sum = 0;
+        long long square_sum = 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            int v = values[i];
+            if (v > max) max = v;
+            if (v < min) min = v;
+            sum += v;
+            square_sum += (long long)v * v;
+        }
+
+        out->min = min;
+        out->max = max;
+        out->sum = sum;
+        out->square_sum = square_sum;
+    }
+
+    void summarize_sse41(const int* values, size_t count, sample_summary* out)
+    {
+        __m128i vmin = _mm_set1_epi32(values[0]);
+        __m128i vmax = vmin;
+        __m128i vsum = _mm_setzero_si128();     // 2 x 64 bit accumulators
+        __m128i vsquares = _mm_setzero_si128(); // 2 x 64 bit accumulators
+
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(values + i));
+            vmin = _mm_min_epi32(vmin, v);
+            vmax = _mm_max_epi32(vmax, v);
+
+            // widen to 64 bits before adding, so the sum can't overflow
+            vsum = _mm_add_epi64(vsum, _mm_cvtepi32_epi64(v));
+            vsum = _mm_add_epi64(vsum, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+
+            // _mm_mul_epi32 multiplies lanes 0 and 2, shift to get 1 and 3
+            __m128i odd = _mm_srli_epi64(v, 32);
+            vsquares = _mm_add_epi64(vsquares, _mm_mul_epi32(v, v));
+            vsquares = _mm_add_epi64(vsquares, _mm_mul_epi32(odd, odd));
+        }
+
+        int mins[4], maxs[4];
+        long long sums[2], squares[2];
+        _mm_storeu_si128((__m128i*)mins, vmin);
+        _mm_storeu_si128((__m128i*)maxs, vmax);
+        _mm_storeu_si128((__m128i*)sums, vsum);
+        _mm_storeu_si128((__m128i*)squares, vsquares);
+
+        sample_summary tail = { values[0], values[0], 0, 0 };
+        if (i < count) summarize_scalar(values + i, count - i, &tail);
+
+        out->min = tail.min;
+        out->max = tail.max;
+        for (int j = 0; j < 4; ++j)
+        {
+            if (mins[j] < out->min) out->min = mins[j];
+            if (maxs[j] > out->max) out->max = maxs[j];
+        }
+        out->sum = sums[0] + sums[1] + tail.sum;
+        out->square_sum = squares[0] + squares[1] + tail.square_sum;
+    }
+
+#ifdef METRICS_HAS_AVX2
+    void summarize_avx2(const int* values, size_t count, sample_summary* out)
+    {
+        __m256i vmin = _mm256_set1_epi32(values[0]);
+        __m256i vmax = vmin;
+        __m256i vsum = _mm256_setzero_si256();     // 4 x 64 bit accumulators
+        __m256i vsquares = _mm256_setzero_si256(); // 4 x 64 bit accumulators
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(values + i));
+            vmin = _mm256_min_epi32(vmin, v);
+            vmax = _mm256_max_epi32(vmax, v);
+
+            vsum = _mm256_add_epi64(vsum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+            vsum = _mm256_add_epi64(vsum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+
+            __m256i odd = _mm256_srli_epi64(v, 32);
+            vsquares = _mm256_add_epi64(vsquares, _mm256_mul_epi32(v, v));
+            vsquares = _mm256_add_epi64(vsquares, _mm256_mul_epi32(odd, odd));
+        }
+
+        int mins[8], maxs[8];
+        long long sums[4], squares[4];
+        _mm256_storeu_si256((__m256i*)mins, vmin);
+        _mm256_storeu_si256((__m256i*)maxs, vmax);
+        _mm256_storeu_si256((__m256i*)sums, vsum);
+        _mm256_storeu_si256((__m256i*)squares, vsquares);
+        _mm256_zeroupper(); // avoid AVX-SSE transition penalty in the caller
+
+        sample_summary tail = { values[0], values[0], 0, 0 };
+        if (i < count) summarize_scalar(values + i, count - i, &tail);
+
+        out->min = tail.min;
+        out->max = tail.max;
+        for (int j = 0; j < 8; ++j)
+        {
+            if (mins[j] < out->min) out->min = mins[j];
+            if (maxs[j] > out->max) out->max = maxs[j];
+        }
+        out->sum = sums[0] + sums[1] + sums[2] + sums[3] + tail.sum;
+        out->square_sum = squares[0] + squares[1] + squares[2] + squares[3] + tail.square_sum;
+    }
+#else
+    void summarize_avx2(const int* values, size_t count, sample_summary* out)
+    {
+        summarize_sse41(values, count, out);
+    }
+#endif
+
+    bool sse41_supported()
+    {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 19)) != 0;  // ECX.SSE4_1
+    }
+
+    bool avx2_supported()
+    {
+#ifdef METRICS_HAS_AVX2
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return false;
+
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx) return false;
+
+        // OS must preserve both XMM and YMM registers on context switch
+        if ((_xgetbv(0) & 6) != 6) return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;  // EBX.AVX2
+#else
+        return false;
+#endif
+    }
+
+    SUMMARY_FN select_kernel()
+    {
+        if (avx2_supported()) return &summarize_avx2;
+        if (sse41_supported()) return &summarize_sse41;
+        return &summarize_scalar;
+    }
+
+    void summarize(const std::vector<int>& values, sample_summary* out)
+    {
+        // selection is idempotent, so a race on first call is harmless
+        static volatile SUMMARY_FN kernel = NULL;
+        if (!kernel) kernel = select_kernel();
+
+        kernel(&values[0], values.size(), out);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+
+namespace metrics
+{
+    /// summary of a sample vector, calculated in a single pass
+    struct sample_summary
+    {
+        int min;               ///< minimum value of the samples
+        int max;               ///< maximum value of the samples
+        long long sum;         ///< sum of all the samples
+        long long square_sum;  ///< sum of squares of all the samples
+    };
+
+    /// prototype for a kernel which summarizes `count` samples starting at `values`
+    typedef void (*SUMMARY_FN)(const int* values, size_t count, sample_summary* out);
+
+    /**
+    * Summarizes the samples using the fastest kernel supported by the CPU.
+    * The kernel is selected on first call (AVX2, then SSE4.1, then scalar
+    * fallback) and reused afterwards.
+    * @param values Samples to be summarized. Must not be empty.
+    * @param out Receives min, max, sum and sum of squares of the samples
+    */
+    void summarize(const std::vector<int>& values, sample_summary* out);
+
+    /// scalar implementation, always available
+    void summarize_scalar(const int* values, size_t count, sample_summary* out);
+    /// SSE4.1 implementation, only call if sse41_supported() returns `true`
+    void summarize_sse41(const int* values, size_t count, sample_summary* out);
+    /// AVX2 implementation, only call if avx2_supported() returns `true`
+    void summarize_avx2(const int* values, size_t count, sample_summary* out);
+
+    /// checks whether CPU supports SSE4.1 instructions
+    bool sse41_supported();
+    /// checks whether both CPU and OS support AVX2 instructions
+    bool avx2_supported();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace metrics
+{
+    /**
+    * Schedules keys to expire after a fixed number of ticks. Both scheduling
+    * and advancing are O(1) per key, regardless of how many keys are tracked.
+    *
+    * The wheel doesn't support cancelling: if a key is rescheduled, it will
+    * show up as due twice, so the owner must check whether a due key is
+    * really idle before removing it.
+    */
+    class timing_wheel
+    {
+        std::vector<std::vector<std::string> > m_slots;
+        size_t m_current;
+
+    public:
+        timing_wheel() : m_current(0) { ; }
+
+        /// sets the number of ticks after which scheduled keys expire, and
+        /// drops all currently scheduled keys. 0 disables the wheel
+        void reset(size_t ticks)
+        {
+            m_slots.clear();
+            if (ticks > 0) m_slots.resize(ticks + 1);
+            m_current = 0;
+        }
+
+        /// returns `true` if the wheel is disabled
+        bool empty() const { return m_slots.empty(); }
+
+        /// returns the number of ticks after which scheduled keys expire
+        size_t span() const { return m_slots.empty() ? 0 : m_slots.size() - 1; }
+
+        /// schedules the key to be due `span()` ticks from now
+        void schedule(const std::string& key)
+        {
+            m_slots[(m_current + span()) % m_slots.size()].push_back(key);
+        }
+
+        /// moves the wheel one tick forward. Keys which became due are
+        /// returned in `due`, its previous content is discarded
+        void advance(std::vector<std::string>& due)
+        {
+            due.clear();
+            if (m_slots.empty()) return;
+            m_current = (m_current + 1) % m_slots.size();
+            due.swap(m_slots[m_current]); // slot keeps due's old capacity
+        }
+    };
+}
@@ -0,0 +1,116 @@
+#include "stdafx.h"
+#include "udp_client.h"
+#include "resolver.h"
+
+namespace metrics
+{
+    // how often is the host name resolved again, in seconds
+    const unsigned int RESOLVE_INTERVAL = 60;
+
+    udp_client::udp_client(const std::string& host, unsigned int port) :
+        m_host(host),
+        m_port(port),
+        m_address(NULL),
+        m_socket(INVALID_SOCKET),
+        m_transmit(NULL),
+        m_errors(0)
+    {
+        ensure_winsock_started();
+        m_resolver.reset(new address_resolver(host, port, RESOLVE_INTERVAL));
+    }
+
+    udp_client::~udp_client()
+    {
+        close();
+    }
+
+    void udp_client::close()
+    {
+        if (m_socket != INVALID_SOCKET) closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+        m_address = NULL;
+        m_transmit = NULL;
+    }
+
+    // connects the socket to the latest address, returns false if it isn't known yet
+    bool udp_client::connect()
+    {
+        const resolved_address* address = m_resolver->current();
+        if (!address) return false;
+        if (address == m_address) return true;
+
+        if (m_socket != INVALID_SOCKET && m_address->addr.ss_family != address->addr.ss_family) close();
+        if (m_socket == INVALID_SOCKET) {
+            m_socket = socket(address->addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+            if (m_socket == INVALID_SOCKET) {
+                dbg_print("cannot create UDP socket for %s:%d, error: %d", m_host.c_str(), m_port, WSAGetLastError());
+                return false;
+            }
+
+            // TransmitPackets is a Microsoft extension, it has to be looked up
+            GUID guid = WSAID_TRANSMITPACKETS;
+            DWORD bytes = 0;
+            if (WSAIoctl(m_socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid),
+                &m_transmit, sizeof(m_transmit), &bytes, NULL, NULL) == SOCKET_ERROR) {
+                dbg_print("TransmitPackets not available, datagrams are sent one by one");
+                m_transmit = NULL;
+            }
+        }
+
+        if (::connect(m_socket, (const sockaddr*)&address->addr, address->len) == SOCKET_ERROR) {
+            dbg_print("cannot connect UDP socket to %s:%d, error: %d", m_host.c_str(), m_port, WSAGetLastError());
+            close();
+            return false;
+        }
+        m_address = address;
+        return true;
+    }
+
+    void udp_client::end_datagram()
+    {
+        if (pending() > 0) m_ends.push_back(m_buffer.size());
+    }
+
+    unsigned int udp_client::send()
+    {
+        end_datagram();
+
+        unsigned int failed = 0;
+        if (!connect()) {
+            failed = (unsigned int)m_ends.size();
+        }
+        else if (m_transmit) {
+            // it isn't known which datagrams were sent if the call fails
+            if (!transmit()) failed = (unsigned int)m_ends.size();
+        }
+        else {
+            size_t begin = 0;
+            FOR_EACH (auto end, m_ends) {
+                if (::send(m_socket, m_buffer.data() + begin, (int)(end - begin), 0) == SOCKET_ERROR) failed++;
+                begin = end;
+            }
+        }
+
+        if (failed > 0) dbg_print("%d datagrams to %s:%d not sent, error: %d", failed, m_host.c_str(), m_port, WSAGetLastError());
+        m_errors += failed;
+        m_buffer.clear();
+        m_ends.clear();
+        return failed;
+    }
+
+    bool udp_client::transmit()
+    {
+        if (m_ends.empty()) return true;
+
+        m_elements.resize(m_ends.size());
+        size_t begin = 0;
+        for (size_t i = 0; i < m_ends.size(); ++i) {
+            TRANSMIT_PACKETS_ELEMENT& e = m_elements[i];
+            e.dwElFlags = TP_ELEMENT_MEMORY | TP_ELEMENT_EOP;  // each element is one datagram
+            e.cLength = (ULONG)(m_ends[i] - begin);
+            e.pBuffer = &m_buffer[begin];
+            begin = m_ends[i];
+        }
+        return m_transmit(m_socket, &m_elements[0], (DWORD)m_elements.size(), 0, NULL, TF_USE_DEFAULT_WORKER) != FALSE;
+    }
+}
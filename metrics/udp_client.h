@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "metrics.h"
+#include <mswsock.h> // needs winsock2.h first
+
+namespace metrics
+{
+    class address_resolver;
+    struct resolved_address;
+
+    /**
+    * Connected UDP socket for backends which send many datagrams per flush.
+    * Datagrams are formatted into a single buffer, and then all of them are
+    * sent with one TransmitPackets call. If TransmitPackets is not available,
+    * they are sent one by one.
+    *
+    * Host names are resolved on a background thread and refreshed like the
+    * address of the metrics server (see address_resolver). Datagrams sent
+    * before the name is resolved are counted as errors, and the socket is
+    * connected again when the address changes.
+    */
+    class udp_client
+    {
+        std::string m_host;
+        unsigned int m_port;
+        std::unique_ptr<address_resolver> m_resolver;
+        const resolved_address* m_address; // address the socket is connected to
+        SOCKET m_socket;
+        LPFN_TRANSMITPACKETS m_transmit;  // NULL if not available
+        std::string m_buffer;             // queued datagrams
+        std::vector<size_t> m_ends;       // end offsets of queued datagrams
+        std::vector<TRANSMIT_PACKETS_ELEMENT> m_elements;
+        unsigned int m_errors;
+
+    public:
+        /**
+        * Creates a client. The socket is connected once the address is
+        * known, so that ICMP errors reported by the remote host are returned
+        * by later sends.
+        * @param host Name or address of the remote host
+        * @param port Remote port
+        * @throws config_exception Thrown if host is not a valid host name or address
+        * @throws std::runtime_error Thrown if the resolver thread can't be started
+        */
+        udp_client(const std::string& host, unsigned int port);
+        ~udp_client();
+
+        /// buffer into which the next datagram should be appended
+        std::string& buffer() { return m_buffer; }
+
+        /// marks the end of the datagram appended to buffer() since last call
+        void end_datagram();
+
+        /// size of the datagram which is currently being appended
+        size_t pending() const { return m_buffer.size() - (m_ends.empty() ? 0 : m_ends.back()); }
+
+        /**
+        * Sends all queued datagrams, and clears the queue.
+        * @return Number of datagrams which couldn't be sent
+        */
+        unsigned int send();
+
+        unsigned int errors() const { return m_errors; } ///< datagrams not sent so far
+
+    private:
+        bool connect();
+        void close();
+        bool transmit();
+
+        udp_client(const udp_client&);
+        udp_client& operator=(const udp_client&);
+    };
+}
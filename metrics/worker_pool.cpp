@@ -0,0 +1,106 @@
+#include "stdafx.h"
+#include "worker_pool.h"
+#include <stdexcept>
+
+namespace metrics
+{
+    worker_pool::worker_pool(unsigned int threads) :
+        m_task(NULL),
+        m_next(0),
+        m_count(0),
+        m_pending(0),
+        m_stop(false)
+    {
+        InitializeCriticalSection(&m_lock);
+        m_wakeup = CreateSemaphore(NULL, 0, threads > 0 ? threads : 1, NULL);
+        m_done = CreateEvent(NULL, TRUE, TRUE, NULL);
+        if (!m_wakeup || !m_done) throw std::runtime_error("Failed creating worker pool");
+
+        for (unsigned int i = 0; i < threads; ++i)
+        {
+            HANDLE h = CreateThread(NULL, 0, thread_proc, this, 0, NULL);
+            if (!h) throw std::runtime_error("Failed creating worker thread");
+            m_threads.push_back(h);
+        }
+    }
+
+    worker_pool::~worker_pool()
+    {
+        EnterCriticalSection(&m_lock);
+        m_stop = true;
+        LeaveCriticalSection(&m_lock);
+
+        // any thread can grab the wakeup, so keep waking them until each exits
+        FOR_EACH(auto h, m_threads)
+        {
+            do {
+                ReleaseSemaphore(m_wakeup, 1, NULL);
+            } while (WaitForSingleObject(h, 10) == WAIT_TIMEOUT);
+            CloseHandle(h);
+        }
+
+        CloseHandle(m_wakeup);
+        CloseHandle(m_done);
+        DeleteCriticalSection(&m_lock);
+    }
+
+    void worker_pool::run(size_t count, const TASK_FN& task)
+    {
+        if (count == 0) return;
+
+        EnterCriticalSection(&m_lock);
+        m_task = &task;
+        m_next = 0;
+        m_count = count;
+        m_pending = (LONG)count;
+        ResetEvent(m_done);
+        LeaveCriticalSection(&m_lock);
+
+        // no point in waking up more threads than there are tasks. Release
+        // fails only if a worker didn't consume its previous wakeup, which is
+        // fine, as that worker will join this run anyway
+        size_t wake = count - 1 < m_threads.size() ? count - 1 : m_threads.size();
+        for (size_t i = 0; i < wake; ++i) ReleaseSemaphore(m_wakeup, 1, NULL);
+
+        while (execute_next());
+        WaitForSingleObject(m_done, INFINITE);
+
+        EnterCriticalSection(&m_lock);
+        m_task = NULL;
+        m_count = 0;
+        LeaveCriticalSection(&m_lock);
+    }
+
+    bool worker_pool::execute_next()
+    {
+        EnterCriticalSection(&m_lock);
+        if (m_stop || m_next >= m_count) {
+            LeaveCriticalSection(&m_lock);
+            return false;
+        }
+        size_t index = m_next++;
+        const TASK_FN* task = m_task;
+        LeaveCriticalSection(&m_lock);
+
+        (*task)(index);
+
+        if (InterlockedDecrement(&m_pending) == 0) SetEvent(m_done);
+        return true;
+    }
+
+    DWORD WINAPI worker_pool::thread_proc(LPVOID param)
+    {
+        worker_pool* pool = static_cast<worker_pool*>(param);
+
+        while (true) {
+            WaitForSingleObject(pool->m_wakeup, INFINITE);
+
+            EnterCriticalSection(&pool->m_lock);
+            bool stop = pool->m_stop;
+            LeaveCriticalSection(&pool->m_lock);
+            if (stop) return 0;
+
+            while (pool->execute_next());
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include "metrics.h"
+
+namespace metrics
+{
+    /// prototype for a task executed by worker_pool, receives the task index
+    typedef std::function<void(size_t)> TASK_FN;
+
+    /**
+    * A fixed set of worker threads used to spread CPU heavy work, like
+    * processing of timers during flush, over multiple cores.
+    * Threads are created once and sleep on a semaphore between runs.
+    */
+    class worker_pool
+    {
+        std::vector<HANDLE> m_threads;
+        HANDLE m_wakeup;          // semaphore, released once per worker per run
+        HANDLE m_done;            // event, set when all tasks of a run are done
+        CRITICAL_SECTION m_lock;  // guards m_task, m_next, m_count and m_stop
+
+        const TASK_FN* m_task;
+        size_t m_next;
+        size_t m_count;
+        volatile LONG m_pending;
+        bool m_stop;
+
+    public:
+        /**
+        * Creates a pool and starts its threads.
+        * @param threads Number of worker threads. Calling thread also
+        *        participates in each run, so `threads - 1` would be enough
+        *        to keep `threads` cores busy.
+        */
+        explicit worker_pool(unsigned int threads);
+        ~worker_pool();
+
+        /**
+        * Executes `task(0)`...`task(count - 1)` on the pool threads and on
+        * the calling thread, and blocks until all of them are finished.
+        * Must not be called concurrently from several threads.
+        */
+        void run(size_t count, const TASK_FN& task);
+
+        /// number of worker threads in the pool
+        size_t size() const { return m_threads.size(); }
+
+    private:
+        static DWORD WINAPI thread_proc(LPVOID param);
+        bool execute_next();
+
+        worker_pool(const worker_pool&);
+        worker_pool& operator=(const worker_pool&);
+    };
+}
@@ -0,0 +1,816 @@
+#pragma once
+
+#include "../metrics/metrics_server.h"
+#include "../metrics/rollup_store.h"
+#include "../metrics/json_writer.h"
+#include "../metrics/snapshot.h"
+#include "../metrics/prometheus.h"
+#include "../metrics/reservoir.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+metrics::stats make_stats(double counter, long long gauge, int timer_min, int timer_max)
+{
+    metrics::stats stats;
+    stats.timestamp = metrics::timer::now();
+    stats.counters["c"] = counter;
+    stats.gauges["g"] = gauge;
+
+    metrics::timer_data td = { "t", 2, timer_max, timer_min, timer_min + timer_max, 0, 0 };
+    stats.timers["t"] = td;
+    return stats;
+}
+
+TEST(BackendTest, RollupStoreAggregatesBuckets) {
+    metrics::rollup_store store;
+    store.add_resolution(10, 60).add_resolution(60, 600);
+
+    const long long t0 = 1400000040000LL; // aligned to a minute
+    store.add(make_stats(1, 5, 10, 20), t0);
+    store.add(make_stats(3, 7, 5, 30), t0 + 5000);
+    store.add(make_stats(2, 1, 15, 15), t0 + 10000);
+
+    auto fine = store.query("c", t0, t0 + 60000, 10);
+    ASSERT_EQ(2, fine.size());
+    EXPECT_EQ(t0, fine[0].timestamp);
+    EXPECT_EQ(2, fine[0].count);
+    EXPECT_DOUBLE_EQ(2, fine[0].avg());
+    EXPECT_DOUBLE_EQ(1, fine[0].min);
+    EXPECT_DOUBLE_EQ(3, fine[0].max);
+    EXPECT_EQ(t0 + 10000, fine[1].timestamp);  // bucket still being filled
+
+    auto coarse = store.query("t", t0, t0 + 60000, 60);
+    ASSERT_EQ(1, coarse.size());
+    EXPECT_EQ(6, coarse[0].count);              // timer samples, not flushes
+    EXPECT_DOUBLE_EQ(5, coarse[0].min);
+    EXPECT_DOUBLE_EQ(30, coarse[0].max);
+    EXPECT_DOUBLE_EQ((30 + 35 + 30) / 6.0, coarse[0].avg());
+
+    EXPECT_EQ(0, store.query("unknown", t0, t0 + 60000).size());
+    EXPECT_THROW(store.query("c", t0, t0 + 60000, 30), metrics::config_exception);
+    EXPECT_THROW(store.add_resolution(3600, 7200), metrics::config_exception);
+}
+
+TEST(BackendTest, RollupStoreRingWrapsAround) {
+    metrics::rollup_store store;
+    store.add_resolution(10, 30).add_resolution(60, 600); // 3 buckets of 10s
+
+    const long long t0 = 1400000040000LL;
+    for (int i = 0; i < 10; ++i) store.add(make_stats(i, i, i, i), t0 + i * 10000);
+
+    auto points = store.query("g", t0, t0 + 100000, 10);
+    ASSERT_EQ(4, points.size());                // 3 kept + the open one
+    EXPECT_EQ(t0 + 60000, points[0].timestamp);
+    EXPECT_DOUBLE_EQ(9, points[3].sum);
+
+    // automatic selection falls back to coarser resolution for older data
+    auto all = store.query("g", t0, t0 + 100000);
+    ASSERT_EQ(2, all.size());
+    EXPECT_DOUBLE_EQ(15, all[0].sum);           // 0 + 1 + ... + 5
+    EXPECT_EQ(3, store.names().size());         // c, g, t
+}
+
+TEST(BackendTest, RollupStoreAdvancesIdleMetrics) {
+    metrics::rollup_store store;
+    store.add_resolution(10, 30).add_resolution(60, 120);
+
+    const long long t0 = 1400000040000LL;
+    store.add(make_stats(1, 5, 10, 20), t0);
+    metrics::stats other;
+    other.gauges["other"] = 1;
+    store.add(other, t0 + 40000);
+
+    // periods without data are empty buckets, and the first one was rotated out
+    auto points = store.query("g", t0, t0 + 40000, 10);
+    ASSERT_EQ(4, points.size());
+    EXPECT_EQ(t0 + 10000, points[0].timestamp);
+    EXPECT_EQ(0, points[0].count);
+    EXPECT_EQ(t0 + 40000, points[3].timestamp); // the open bucket
+    EXPECT_EQ(0, points[3].count);
+
+    store.add(other, t0 + 130000);
+    ASSERT_EQ(1, store.names().size());         // c, g and t are idle for longer than 120s
+    EXPECT_EQ("other", store.names()[0]);
+}
+
+std::string read_file(const char* filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+TEST(BackendTest, FileBackendReopensRotatedFile) {
+    const char* filename = "file_backend_test.log";
+    const char* rotated = "file_backend_test.log.1";
+    DeleteFile(filename);
+    DeleteFile(rotated);
+
+    metrics::file_backend backend(filename);
+    EXPECT_THROW(backend.sync(metrics::SyncPeriodically, 0), metrics::config_exception);
+    backend.sync(metrics::SyncEveryWrite);
+
+    backend(make_stats(1, 5, 10, 20));
+    auto copy = backend;  // copies share the open file
+    copy(make_stats(2, 6, 10, 20));
+
+    auto content = read_file(filename);
+    EXPECT_NE(std::string::npos, content.find(" C: c - 11/s\n"));
+    EXPECT_NE(std::string::npos, content.find(" G: g - 6\n"));
+    EXPECT_NE(std::string::npos, content.find(" H: t - cnt: 2, min: 10, max: 20, sum: 30, avg: 0.00, stddev: 0.00\n"));
+
+    ASSERT_TRUE(MoveFileEx(filename, rotated, 0) != 0);
+    backend(make_stats(3, 7, 10, 20));
+
+    EXPECT_EQ(content, read_file(rotated));
+    content = read_file(filename);
+    EXPECT_EQ(0, content.find("@ TS: "));
+    EXPECT_NE(std::string::npos, content.find(" C: c - 31/s\n"));
+    EXPECT_EQ(std::string::npos, content.find(" C: c - 11/s\n"));
+
+    DeleteFile(filename);
+    DeleteFile(rotated);
+}
+
+std::string json_double(double value)
+{
+    std::string out;
+    metrics::json_writer::write_double(out, value);
+    return out;
+}
+
+TEST(BackendTest, JsonWriterFormatsValues) {
+    EXPECT_EQ("0.1", json_double(0.1));
+    EXPECT_EQ("1.0", json_double(1));
+    EXPECT_EQ("-2.5", json_double(-2.5));
+    EXPECT_EQ("1e300", json_double(1e300));
+    EXPECT_EQ("0.000001", json_double(1e-6));
+    EXPECT_EQ("-0.0", json_double(-0.0));
+    EXPECT_EQ("null", json_double(sqrt(-1.0)));
+    double third = 1.0 / 3;
+    EXPECT_EQ(third, strtod(json_double(third).c_str(), NULL)); // round-trips
+
+    std::string out;
+    const char text[] = "a\"b\\c\n\x01";
+    metrics::json_writer::write_string(out, text, strlen(text));
+    EXPECT_EQ("\"a\\\"b\\\\c\\n\\u0001\"", out);
+
+    out.clear();
+    metrics::json_writer json(out);
+    json.begin_object().key("a").value(1).key("b").begin_object().end_object().key("c").value("x").end_object();
+    json.end_line();
+    json.begin_object().end_object();
+    EXPECT_EQ("{\"a\":1,\"b\":{},\"c\":\"x\"}\n{}", out);
+}
+
+TEST(BackendTest, JsonBackendWritesLinePerFlush) {
+    auto stats = make_stats(1.5, 5, 10, 20);
+    std::string out;
+    metrics::json_file_backend::serialize(stats, out);
+
+    // timestamp is formatted relative to current time, so it isn't compared
+    std::string fields = "\"c\":1.5,\"g\":5,\"t\":{\"avg\":0.0,\"count\":2,\"min\":10.0,\"max\":20.0,\"stddev\":0.0}}\n";
+    EXPECT_EQ(0, out.find("{\"_timestamp\":\""));
+    ASSERT_GT(out.size(), fields.size());
+    EXPECT_EQ(fields, out.substr(out.size() - fields.size()));
+    EXPECT_EQ(out.size() - 1, out.find('\n'));
+
+    size_t first_line = out.size();
+    metrics::json_file_backend::serialize(stats, out);
+    EXPECT_EQ(2 * first_line, out.size());  // appended as another line
+}
+
+#ifdef METRICS_USE_ZLIB
+#include <zlib.h>
+
+// decompresses all gzip members in the data
+std::string gunzip(const std::string& data)
+{
+    std::string out;
+    char buf[4096];
+    z_stream zs = { 0 };
+    inflateInit2(&zs, 15 + 16);
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = (uInt)data.size();
+    int rc = Z_OK;
+    while (rc == Z_OK || (rc == Z_STREAM_END && zs.avail_in > 0)) {
+        if (rc == Z_STREAM_END) inflateReset(&zs);
+        zs.next_out = (Bytef*)buf;
+        zs.avail_out = sizeof(buf);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - zs.avail_out);
+    }
+    inflateEnd(&zs);
+    return out;
+}
+#endif
+
+#ifdef METRICS_USE_ZSTD
+#include <zstd.h>
+#endif
+
+TEST(BackendTest, CompressedFileIsReadableAfterEachWrite) {
+    const char* filename = "compressed.data";
+    DeleteFile(filename);
+    std::string first = "first flush\n", second = "second flush\n";
+
+#ifdef METRICS_USE_ZLIB
+    {
+        metrics::file_sink sink(filename);
+        sink.compress(metrics::GzipCompression, 9);
+        sink.buffer() = first;
+        EXPECT_TRUE(sink.write());
+        EXPECT_EQ(first, gunzip(read_file(filename)));
+        sink.buffer() = second;
+        EXPECT_TRUE(sink.write());
+        EXPECT_EQ(first + second, gunzip(read_file(filename)));
+    }
+    DeleteFile(filename);
+    EXPECT_THROW(metrics::compressor gzip(metrics::GzipCompression, 10), metrics::config_exception);
+#else
+    EXPECT_THROW(metrics::compressor gzip(metrics::GzipCompression), metrics::config_exception);
+#endif
+
+#ifdef METRICS_USE_ZSTD
+    {
+        metrics::file_sink sink(filename);
+        sink.compress(metrics::ZstdCompression);
+        sink.buffer() = first;
+        EXPECT_TRUE(sink.write());
+        sink.buffer() = second;
+        EXPECT_TRUE(sink.write());
+
+        auto data = read_file(filename);
+        char buf[256];
+        size_t size = ZSTD_decompress(buf, sizeof(buf), data.data(), data.size());
+        ASSERT_FALSE(ZSTD_isError(size));
+        EXPECT_EQ(first + second, std::string(buf, size));
+    }
+    DeleteFile(filename);
+#else
+    EXPECT_THROW(metrics::compressor zstd(metrics::ZstdCompression), metrics::config_exception);
+#endif
+
+    EXPECT_THROW(metrics::json_file_backend(filename).compress(metrics::ZstdCompression, 23), metrics::config_exception);
+}
+
+TEST(BackendTest, FileSinkRotatesBySizeAndAge) {
+    const char* filename = "rotating.data";
+    const char* rotated[] = { "rotating.data.1", "rotating.data.2", "rotating.data.3" };
+    FOR_EACH (auto name, rotated) DeleteFile(name);
+    DeleteFile(filename);
+
+    {
+        metrics::file_sink sink(filename);
+        sink.rotate(20, 0, 2);
+        for (char i = '1'; i <= '7'; ++i) {
+            sink.buffer() = std::string("flush ") + i + "\n";  // 8 bytes, two fit in a file
+            EXPECT_TRUE(sink.write());
+        }
+        sink.wait_for_rotation();
+    }
+    EXPECT_EQ("flush 7\n", read_file(filename));
+    EXPECT_EQ("flush 5\nflush 6\n", read_file(rotated[0]));
+    EXPECT_EQ("flush 3\nflush 4\n", read_file(rotated[1]));
+    EXPECT_EQ("", read_file(rotated[2]));
+
+    {
+        metrics::file_sink sink(filename);
+        sink.rotate(0, 1, 2);
+        sink.buffer() = "flush 8\n";
+        sink.write();
+        Sleep(1100);
+        sink.buffer() = "flush 9\n";
+        sink.write();
+        sink.wait_for_rotation();
+    }
+    EXPECT_EQ("flush 9\n", read_file(filename));
+    EXPECT_EQ("flush 7\nflush 8\n", read_file(rotated[0]));
+    EXPECT_EQ("flush 5\nflush 6\n", read_file(rotated[1]));
+
+#ifdef METRICS_USE_ZLIB
+    {
+        metrics::file_sink sink(filename);
+        sink.rotate(1, 0, 1, metrics::GzipCompression);
+        sink.buffer() = "flush 10\n";
+        sink.write();
+        sink.wait_for_rotation();
+    }
+    EXPECT_EQ("flush 10\n", read_file(filename));
+    EXPECT_EQ("flush 9\n", gunzip(read_file("rotating.data.1.gz")));
+    DeleteFile("rotating.data.1.gz");
+#endif
+
+    metrics::file_sink sink(filename);
+    EXPECT_THROW(sink.rotate(0, 0, 1), metrics::config_exception);
+    EXPECT_THROW(sink.rotate(100, 0, 0), metrics::config_exception);
+    EXPECT_THROW(sink.rotate(0, 604801, 1), metrics::config_exception);
+
+    DeleteFile(filename);
+    FOR_EACH (auto name, rotated) DeleteFile(name);
+}
+
+TEST(BackendTest, SnapshotsAreReadInPlace) {
+    const char* filename = "snapshot_test.snap";
+    DeleteFile(filename);
+
+    auto first = make_stats(1.5, 5, 10, 20);
+    first.gauges["a.longer.gauge.name"] = -3;
+    {
+        metrics::snapshot_backend backend(filename);
+        backend(first);
+        backend(make_stats(2, 6, 7, 9));
+    }
+
+    {
+        metrics::snapshot_reader reader(filename);
+        metrics::snapshot_view snapshot;
+
+        ASSERT_TRUE(reader.next(snapshot));
+        EXPECT_NEAR((double)metrics::timer::to_unix_ms(first.timestamp), (double)snapshot.timestamp(), 50);
+        ASSERT_EQ(1, snapshot.counter_count());
+        EXPECT_STREQ("c", snapshot.name(snapshot.counter(0).name));
+        EXPECT_EQ(1.5, snapshot.counter(0).value);
+        ASSERT_EQ(2, snapshot.gauge_count());
+        EXPECT_STREQ("a.longer.gauge.name", snapshot.name(snapshot.gauge(0).name));
+        EXPECT_EQ(-3, snapshot.gauge(0).value);
+        EXPECT_STREQ("g", snapshot.name(snapshot.gauge(1).name));
+        ASSERT_EQ(1, snapshot.timer_count());
+        EXPECT_STREQ("t", snapshot.name(snapshot.timer(0).name));
+        EXPECT_EQ(2, snapshot.timer(0).count);
+        EXPECT_EQ(30, snapshot.timer(0).sum);
+        EXPECT_EQ(0, (size_t)&snapshot.timer(0) % 8);
+
+        ASSERT_TRUE(reader.next(snapshot));
+        EXPECT_EQ(6, snapshot.gauge(0).value);
+        EXPECT_EQ(7, snapshot.timer(0).min);
+        EXPECT_FALSE(reader.next(snapshot));
+
+        reader.rewind();
+        ASSERT_TRUE(reader.next(snapshot));
+        EXPECT_EQ(1.5, snapshot.counter(0).value);
+    }
+
+    // a record cut short by a crash is not returned
+    HANDLE file = CreateFile(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, file);
+    LARGE_INTEGER size, end;
+    GetFileSizeEx(file, &size);
+    end.QuadPart = size.QuadPart - 8;
+    SetFilePointerEx(file, end, NULL, FILE_BEGIN);
+    SetEndOfFile(file);
+    CloseHandle(file);
+    {
+        metrics::snapshot_reader reader(filename);
+        metrics::snapshot_view snapshot;
+        EXPECT_TRUE(reader.next(snapshot));
+        EXPECT_FALSE(reader.next(snapshot));
+    }
+
+    // as is a record with a name outside of the name table
+    std::string record;
+    metrics::snapshot_backend::serialize(make_stats(1, 5, 10, 20), record);
+    auto& header = *(metrics::snapshot_header*)&record[0];
+    ((metrics::snapshot_counter*)&record[header.counters_offset])->name = header.names_size;
+    file = CreateFile(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    ASSERT_NE(INVALID_HANDLE_VALUE, file);
+    DWORD written;
+    WriteFile(file, record.c_str(), (DWORD)record.size(), &written, NULL);
+    CloseHandle(file);
+    {
+        metrics::snapshot_reader reader(filename);
+        metrics::snapshot_view snapshot;
+        EXPECT_FALSE(reader.next(snapshot));
+    }
+
+    DeleteFile(filename);
+    EXPECT_THROW(metrics::snapshot_reader reader(filename), std::runtime_error);
+}
+
+// TCP counterpart of fake_server, accepts a single connection
+class fake_tcp_server
+{
+    SOCKET m_sock;
+    SOCKET m_conn;
+
+public:
+    fake_tcp_server(int port = 0) : m_conn(INVALID_SOCKET)
+    {
+        if ((m_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == INVALID_SOCKET) {
+            throw std::runtime_error("cannot create server socket");
+        }
+
+        int reuse = 1;
+        setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
+        metrics::SOCK_ADDR_IN myaddr(AF_INET, INADDR_LOOPBACK, port);
+        if (bind(m_sock, (sockaddr*)&myaddr, sizeof(myaddr)) < 0 || listen(m_sock, 1) < 0) {
+            closesocket(m_sock);
+            throw std::runtime_error("cannot bind server socket");
+        }
+    }
+    ~fake_tcp_server()
+    {
+        if (m_conn != INVALID_SOCKET) closesocket(m_conn);
+        closesocket(m_sock);
+    }
+
+    int port() const
+    {
+        sockaddr_in addr;
+        int len = sizeof(addr);
+        getsockname(m_sock, (sockaddr*)&addr, &len);
+        return ntohs(addr.sin_port);
+    }
+
+    // waits for the client to connect, then returns everything it sends
+    // until no data arrives for timeout_ms
+    std::string receive(int timeout_ms = 200)
+    {
+        std::string data;
+        char buf[4096];
+        while (true) {
+            SOCKET s = m_conn == INVALID_SOCKET ? m_sock : m_conn;
+            fd_set rdset;
+            FD_ZERO(&rdset);
+            FD_SET(s, &rdset);
+            timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+            if (0 == select((int)s + 1, &rdset, NULL, NULL, &timeout)) break;  // timeout
+
+            if (m_conn == INVALID_SOCKET) {
+                m_conn = accept(m_sock, NULL, NULL);
+                continue;
+            }
+            int received = recv(m_conn, buf, sizeof(buf), 0);
+            if (received <= 0) break;
+            data.append(buf, received);
+        }
+        return data;
+    }
+
+    void disconnect()
+    {
+        closesocket(m_conn);
+        m_conn = INVALID_SOCKET;
+    }
+};
+
+TEST(BackendTest, GraphiteSendsPlaintextLines) {
+    auto stats = make_stats(1.5, 5, 10, 20);
+    std::string out;
+    metrics::graphite_backend::serialize(stats, out);
+
+    char ts[32];
+    sprintf_s(ts, " %lld\n", metrics::timer::to_unix_ms(stats.timestamp) / 1000);
+    std::string timestamp = ts;
+    EXPECT_EQ("c 1.5" + timestamp + "g 5" + timestamp + "t.count 2" + timestamp
+        + "t.min 10" + timestamp + "t.max 20" + timestamp + "t.sum 30" + timestamp
+        + "t.avg 0.0" + timestamp + "t.stddev 0.0" + timestamp, out);
+
+    fake_tcp_server carbon;
+    metrics::graphite_backend backend("127.0.0.1", carbon.port());
+    backend(stats);
+    auto received = carbon.receive(); // connection may complete only on next flush
+    backend(stats);
+    received += carbon.receive();
+    EXPECT_EQ(out + out, received);
+    EXPECT_TRUE(backend.client().connected());
+    EXPECT_EQ(0, backend.client().spooled());
+
+    // host names are resolved in the background, flushes are spooled until then
+    fake_tcp_server named_carbon;
+    metrics::graphite_backend named("localhost", named_carbon.port());
+    received.clear();
+    auto started = metrics::timer::now();
+    while (received.size() < 2 * out.size() && metrics::timer::since(started) < 5000) {
+        named(stats);
+        received += named_carbon.receive(20);
+    }
+    EXPECT_EQ(0, received.find(out + out));
+}
+
+TEST(BackendTest, TagsAreWrittenInBackendFormat) {
+    metrics::stats stats;
+    stats.timestamp = metrics::timer::now();
+    stats.period_ms = 1000;
+    stats.counters["req|#canary,code:200"] = 3;
+    stats.gauges["req.size"] = 7;
+    stats.gauges["req|#code:200"] = -2;
+
+    std::string graphite;
+    metrics::graphite_backend::serialize(stats, graphite);
+    EXPECT_EQ(0, graphite.find("req;canary=true;code=200 3.0 "));
+    EXPECT_NE(std::string::npos, graphite.find("\nreq;code=200 -2 "));
+
+    // all samples of a family are together, though "req.size" sorts between them
+    metrics::prometheus_exporter exporter(0);
+    exporter.publish(stats, 1000, NULL);
+    EXPECT_EQ("# TYPE req_total counter\nreq_total{canary=\"true\",code=\"200\"} 3.0\n"
+        "# TYPE req_size gauge\nreq_size 7\n"
+        "# TYPE req gauge\nreq{code=\"200\"} -2\n", *exporter.body());
+
+    fake_server svr(10126);
+    metrics::statsd_backend statsd("127.0.0.1", 10126);
+    statsd(stats);
+    auto messages = svr.get_messages();
+    ASSERT_EQ(1, messages.size());
+    EXPECT_EQ("req:3|c|#canary,code:200\nreq.size:7|g\nreq:0|g|#code:200\nreq:-2|g|#code:200", messages[0]);
+}
+
+TEST(BackendTest, GraphiteTagsAreSanitized) {
+    metrics::stats stats;
+    stats.timestamp = metrics::timer::now();
+    stats.period_ms = 1000;
+    stats.counters["req|#a=b:~x;y z,path:/a b;c,v!:"] = 1;
+
+    std::string graphite;
+    metrics::graphite_backend::serialize(stats, graphite);
+    EXPECT_EQ(0, graphite.find("req;a_b=_x_y_z;path=/a_b_c;v_=true 1.0 "));
+}
+
+TEST(BackendTest, GraphiteSpoolsWhileDisconnected) {
+    int port = fake_tcp_server().port(); // nobody listens on this port now
+    auto stats = make_stats(1, 2, 3, 4);
+    std::string flush;
+    metrics::graphite_backend::serialize(stats, flush);
+
+    metrics::graphite_backend backend("127.0.0.1", port);
+    backend.backoff(10, 10).spool_limit(flush.size() * 3);
+    for (int i = 0; i < 5; ++i) backend(stats);
+    EXPECT_FALSE(backend.client().connected());
+    EXPECT_EQ(3 * flush.size(), backend.client().spooled());
+    EXPECT_EQ(2, backend.client().dropped());
+
+    fake_tcp_server carbon(port);
+
+    // connecting may take a few flushes, refused connection is reported slowly on Windows.
+    // Waiting for data between flushes also lets the backoff expire
+    auto flush_until_connected = [&](std::string& received) -> int {
+        int flushes = 0;
+        auto ts = metrics::timer::now();
+        while ((flushes == 0 || !backend.client().connected()) && metrics::timer::since(ts) < 6000) {
+            backend(stats);
+            flushes++;
+            received += carbon.receive(20);
+        }
+        backend(stats);
+        received += carbon.receive();
+        return flushes + 1;
+    };
+
+    std::string received;
+    int flushes = flush_until_connected(received);
+    EXPECT_TRUE(backend.client().connected());
+    EXPECT_EQ(0, backend.client().spooled());
+    EXPECT_EQ(0, received.size() % flush.size());  // only complete flushes
+    EXPECT_EQ(0, received.find(flush));
+    if (flushes == 2) EXPECT_EQ(5 * flush.size(), received.size());  // 3 spooled and 2 new flushes
+
+    // after the server drops the connection, client reconnects
+    carbon.disconnect();
+    received.clear();
+    flush_until_connected(received);
+    EXPECT_EQ(0, received.size() % flush.size());
+    EXPECT_GE(received.size(), 2 * flush.size());
+}
+
+// connects and sends the request, without waiting for the response
+SOCKET http_request(int port, const std::string& path)
+{
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    metrics::SOCK_ADDR_IN addr(AF_INET, INADDR_LOOPBACK, port);
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        send(s, request.data(), (int)request.size(), 0);
+    }
+    return s;
+}
+
+// reads the response until the server closes the connection
+std::string http_response(SOCKET s)
+{
+    std::string response;
+    char buf[4096];
+    int received;
+    while ((received = recv(s, buf, sizeof(buf), 0)) > 0) response.append(buf, received);
+    closesocket(s);
+    return response;
+}
+
+std::string http_get(int port, const std::string& path)
+{
+    return http_response(http_request(port, path));
+}
+
+TEST(BackendTest, PrometheusServesLatestFlush) {
+    metrics::prometheus_exporter exporter(0);
+    ASSERT_NE(0, exporter.port());
+
+    auto stats = make_stats(1.5, 5, 10, 20);
+    stats.counters["web.requests-ok"] = 2;
+    exporter.publish(stats, 10000, NULL);
+
+    std::string body =
+        "# TYPE c_total counter\nc_total 15.0\n"
+        "# TYPE web_requests_ok_total counter\nweb_requests_ok_total 20.0\n"
+        "# TYPE g gauge\ng 5\n"
+        "# TYPE t summary\nt{quantile=\"0\"} 10\nt{quantile=\"1\"} 20\nt_sum 30\nt_count 2\n";
+    EXPECT_EQ(body, *exporter.body());
+
+    auto response = http_get(exporter.port(), "/metrics");
+    EXPECT_EQ(0, response.find("HTTP/1.1 200 OK\r\n"));
+    EXPECT_NE(std::string::npos, response.find("Content-Type: text/plain; version=0.0.4\r\n"));
+    EXPECT_EQ(response.size() - body.size(), response.find("\r\n\r\n" + body) + 4);
+    EXPECT_EQ(0, http_get(exporter.port(), "/").find("HTTP/1.1 404 Not Found\r\n"));
+
+    // counters and timer totals accumulate, and keep being reported when inactive
+    metrics::stats next;
+    next.timestamp = metrics::timer::now();
+    next.counters["c"] = 0.5;
+    exporter.publish(next, 10000, NULL);
+    EXPECT_EQ("# TYPE c_total counter\nc_total 20.0\n"
+        "# TYPE web_requests_ok_total counter\nweb_requests_ok_total 20.0\n"
+        "# TYPE t summary\nt_sum 30\nt_count 2\n", *exporter.body());
+
+    // timers get all quantiles from live timers, not min and max from the interval
+    metrics::live_timers live(100, 0.015);
+    for (int i = 1; i <= 100; ++i) live.update("t", i);
+    exporter.publish(make_stats(0, 5, 10, 20), 10000, &live);
+    EXPECT_NE(std::string::npos, exporter.body()->find("t{quantile=\"0\"} 1.0\nt{quantile=\"0.5\"} "));
+    EXPECT_NE(std::string::npos, exporter.body()->find("\nt{quantile=\"0.99\"} "));
+    EXPECT_NE(std::string::npos, exporter.body()->find("\nt{quantile=\"1\"} 100.0\nt_sum 60\nt_count 4\n"));
+
+    // scrapers waiting at the same time all get a complete body
+    std::vector<SOCKET> scrapers;
+    for (int i = 0; i < 8; ++i) scrapers.push_back(http_request(exporter.port(), "/metrics"));
+    FOR_EACH (auto s, scrapers) {
+        auto response = http_response(s);
+        EXPECT_EQ(response.size() - exporter.body()->size(), response.find("\r\n\r\n" + *exporter.body()) + 4);
+    }
+
+    EXPECT_THROW(metrics::prometheus_exporter taken(exporter.port()), std::runtime_error);
+}
+
+TEST(BackendTest, PrometheusSummariesAccumulate) {
+    metrics::prometheus_exporter exporter(0);
+    exporter.publish(make_stats(0, 5, 10, 20), 10000, NULL);
+    EXPECT_NE(std::string::npos, exporter.body()->find("\nt_sum 30\nt_count 2\n"));
+
+    // _sum and _count are monotonic, as Prometheus rate() requires
+    exporter.publish(make_stats(0, 5, 5, 7), 10000, NULL);
+    EXPECT_NE(std::string::npos, exporter.body()->find("t{quantile=\"0\"} 5\nt{quantile=\"1\"} 7\nt_sum 42\nt_count 4\n"));
+
+    // totals of idle timers are dropped like those of counters
+    metrics::stats idle;
+    idle.timestamp = metrics::timer::now();
+    for (int i = 1; i < 360; ++i) exporter.publish(idle, 10000, NULL);
+    EXPECT_NE(std::string::npos, exporter.body()->find("\nt_sum 42\nt_count 4\n"));
+    exporter.publish(idle, 10000, NULL);
+    EXPECT_EQ(std::string::npos, exporter.body()->find("t_sum"));
+}
+
+TEST(BackendTest, PrometheusMergesSanitizedFamilies) {
+    metrics::stats stats;
+    stats.timestamp = metrics::timer::now();
+    stats.counters["a.c"] = 1;
+    stats.gauges["a.b"] = 1;
+    stats.gauges["a.c_total"] = 2;  // taken by the counter family
+    stats.gauges["a_b"] = 3;        // same series as "a.b"
+    stats.gauges["a_b|#x:1"] = 4;
+    metrics::timer_data td = { "t", 1, 7, 7, 7, 7, 0 };
+    stats.timers["t"] = td;
+    stats.timers["a.b"] = td;       // family a_b is a gauge
+
+    metrics::prometheus_exporter exporter(0);
+    exporter.publish(stats, 1000, NULL);
+    EXPECT_EQ("# TYPE a_c_total counter\na_c_total 1.0\n"
+        "# TYPE a_b gauge\na_b 1\na_b{x=\"1\"} 4\n"
+        "# TYPE t summary\nt{quantile=\"0\"} 7\nt{quantile=\"1\"} 7\nt_sum 7\nt_count 1\n", *exporter.body());
+
+    // a summary takes also its _sum and _count names
+    stats.gauges["t_sum"] = 5;
+    exporter.publish(stats, 1000, NULL);
+    EXPECT_NE(std::string::npos, exporter.body()->find("# TYPE t_sum gauge\nt_sum 5\n"));
+    EXPECT_EQ(std::string::npos, exporter.body()->find("# TYPE t summary"));
+
+    // totals of counters and timers which are not flushed anymore are dropped eventually
+    metrics::stats empty;
+    empty.timestamp = metrics::timer::now();
+    for (int i = 0; i < 359; ++i) exporter.publish(empty, 1000, NULL);
+    EXPECT_EQ("# TYPE a_c_total counter\na_c_total 2.0\n"
+        "# TYPE a_b summary\na_b_sum 14\na_b_count 2\n"
+        "# TYPE t summary\nt_sum 14\nt_count 2\n", *exporter.body());
+    exporter.publish(empty, 1000, NULL);
+    EXPECT_EQ("", *exporter.body());
+}
+
+TEST(BackendTest, SyslogSendsRfc5424Messages) {
+    fake_server collector(10514);
+    auto stats = make_stats(1.5, 5, 10, 20);
+    metrics::syslog_udp_backend backend("127.0.0.1", 10514);
+    backend.app_name("test");
+    backend(stats);
+
+    auto messages = collector.get_messages();
+    ASSERT_EQ(3, messages.size());
+    char app[32];
+    sprintf_s(app, " test %lu ", GetCurrentProcessId());
+    const char* expected[] = { "counter - c 1.5", "gauge - g 5", "timer - t count=2 min=10 max=20 sum=30 avg=0.0 stddev=0.0" };
+    for (int i = 0; i < 3; ++i) {
+        auto& m = messages[i];
+        EXPECT_EQ(0, m.find("<134>1 "));  // local0.info
+        EXPECT_EQ(" ", m.substr(31, 1));    // after the timestamp, e.g. 2014-05-02T10:20:30.000Z
+        EXPECT_EQ("Z", m.substr(30, 1));
+        EXPECT_NE(std::string::npos, m.find(app));
+        EXPECT_EQ(m.size() - strlen(expected[i]), m.find(std::string(app) + expected[i]) + strlen(app));
+    }
+
+    // all messages fit in a single datagram
+    backend.priority(1, 3).pack(480);
+    backend(stats);
+    messages = collector.get_messages();
+    ASSERT_EQ(1, messages.size());
+    EXPECT_EQ(0, messages[0].find("<11>1 "));
+    EXPECT_EQ(2, std::count(messages[0].begin(), messages[0].end(), '\n'));
+    EXPECT_EQ(0, backend.client().errors());
+
+    EXPECT_THROW(backend.priority(24, 0), metrics::config_exception);
+    EXPECT_THROW(backend.priority(0, 8), metrics::config_exception);
+    EXPECT_THROW(backend.app_name("my app"), metrics::config_exception);
+    EXPECT_THROW(backend.app_name(""), metrics::config_exception);
+    EXPECT_THROW(backend.pack(479), metrics::config_exception);
+    EXPECT_THROW(backend.pack(65508), metrics::config_exception);
+
+    // nobody listens, port unreachable arrives asynchronously and makes one of the following sends fail
+    metrics::syslog_udp_backend lost("127.0.0.1", 10515);
+    auto started = metrics::timer::now();
+    while (lost.client().errors() == 0 && metrics::timer::since(started) < 5000) {
+        lost(stats);
+        Sleep(10);
+    }
+    EXPECT_GT(lost.client().errors(), 0u);
+
+    // host names are resolved in the background, the socket is connected once they are
+    metrics::syslog_udp_backend named("localhost", 10514);
+    messages.clear();
+    started = metrics::timer::now();
+    while (messages.empty() && metrics::timer::since(started) < 5000) {
+        named(stats);
+        messages = collector.get_messages(true, 10);
+    }
+    EXPECT_EQ(3, messages.size());
+}
+
+TEST(BackendTest, StatsdForwardsPackedLines) {
+    fake_server upstream(10125);
+    auto stats = make_stats(1.5, -5, 10, 20);
+    stats.period_ms = 10000;
+
+    metrics::statsd_backend backend("127.0.0.1", 10125);
+    backend.prefix("host1.");
+    backend(stats);
+
+    auto messages = upstream.get_messages();
+    ASSERT_EQ(1, messages.size());
+    EXPECT_EQ("host1.c:15|c\nhost1.g:0|g\nhost1.g:-5|g\n"
+        "host1.t.count:2|c\nhost1.t.sum:30|c\nhost1.t.min:10|ms\nhost1.t.max:20|ms", messages[0]);
+
+    // negative counters are rounded away from zero, like positive ones
+    metrics::stats negative;
+    negative.timestamp = metrics::timer::now();
+    negative.period_ms = 10000;
+    negative.counters["n"] = -0.5;
+    negative.counters["r"] = -0.26;
+    backend(negative);
+    messages = upstream.get_messages();
+    ASSERT_EQ(1, messages.size());
+    EXPECT_EQ("host1.n:-5|c\nhost1.r:-3|c", messages[0]);
+
+    // lines are never split between datagrams
+    char name[32];
+    for (int i = 0; i < 50; ++i) {
+        sprintf_s(name, "counter.%d", i);
+        stats.counters[name] = i;
+    }
+    backend.mtu(64)(stats);
+    messages = upstream.get_messages();
+    EXPECT_GT(messages.size(), 10);
+    size_t lines = 0;
+    FOR_EACH (auto& m, messages) {
+        EXPECT_LE(m.size(), 64);
+        EXPECT_NE('\n', m[0]);
+        lines += std::count(m.begin(), m.end(), '\n') + 1;
+    }
+    EXPECT_EQ(stats.counters.size() + 2 + 4, lines); // negative gauge takes two lines
+
+    // only the first lines fit into 2 B/s for 10 s
+    backend.rate_limit(2)(stats);
+    messages = upstream.get_messages();
+    ASSERT_EQ(1, messages.size());
+    EXPECT_EQ("host1.c:15|c", messages[0]);
+
+    EXPECT_THROW(backend.mtu(63), metrics::config_exception);
+    EXPECT_THROW(backend.mtu(65508), metrics::config_exception);
+}
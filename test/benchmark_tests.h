@@ -0,0 +1,256 @@
+#pragma once
+
+#include "../metrics/metrics_server.h"
+#include "../metrics/timer_kernel.h"
+#include "../metrics/worker_pool.h"
+#include "../metrics/compressor.h"
+#include "../metrics/direct_sink.h"
+#include "../metrics/local_metrics.h"
+#include "gtest/gtest.h"
+#include <memory>
+
+// Benchmarks are disabled by default, as they take a while. To run them use:
+//     test.exe --gtest_also_run_disabled_tests --gtest_filter=Benchmark.*
+// Release configuration should be used to get meaningful numbers.
+
+// high resolution stopwatch, GetTickCount is too coarse for benchmarks
+class stopwatch
+{
+    LARGE_INTEGER m_start;
+
+public:
+    stopwatch() { QueryPerformanceCounter(&m_start); }
+
+    /// microseconds elapsed since construction
+    double elapsed_us() const
+    {
+        LARGE_INTEGER now, freq;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&freq);
+        return (now.QuadPart - m_start.QuadPart) * 1000000.0 / freq.QuadPart;
+    }
+};
+
+// runs the kernel repeatedly and returns average duration of a run, in us
+double bench_kernel(metrics::SUMMARY_FN kernel, const std::vector<int>& values)
+{
+    const size_t total_samples = 50000000; // keep each measurement ~similar
+    size_t runs = total_samples / values.size();
+    if (runs < 3) runs = 3;
+
+    metrics::sample_summary summary;
+    stopwatch sw;
+    for (size_t i = 0; i < runs; ++i) kernel(&values[0], values.size(), &summary);
+    return sw.elapsed_us() / runs;
+}
+
+TEST(Benchmark, DISABLED_TimerKernels) {
+    size_t sizes[] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+
+    printf("%10s %14s %14s %14s\n", "samples", "scalar [us]", "sse4.1 [us]", "avx2 [us]");
+    FOR_EACH(auto size, sizes)
+    {
+        std::vector<int> values(size);
+        for (size_t i = 0; i < size; ++i) values[i] = rand();
+
+        double scalar = bench_kernel(&metrics::summarize_scalar, values);
+        double sse41 = metrics::sse41_supported() ? bench_kernel(&metrics::summarize_sse41, values) : 0;
+        double avx2 = metrics::avx2_supported() ? bench_kernel(&metrics::summarize_avx2, values) : 0;
+
+        printf("%10u %14.3f %14.3f %14.3f\n", (unsigned int)size, scalar, sse41, avx2);
+    }
+}
+
+namespace metrics
+{
+    stats flush_metrics(const storage& storage, unsigned int period_ms, worker_pool* pool);
+}
+
+TEST(Benchmark, DISABLED_ParallelFlush) {
+    metrics::storage store;
+    char name[32];
+    for (int i = 0; i < 100000; ++i) {
+        sprintf_s(name, "app.timer.%d", i);
+        auto& values = store.timers[name];
+        for (int j = 0; j < 100; ++j) values.push_back(rand());
+    }
+
+    unsigned int threads[] = { 0, 1, 2, 4, 8, 16 };
+    printf("%10s %14s\n", "threads", "flush [ms]");
+    FOR_EACH(auto count, threads)
+    {
+        std::unique_ptr<metrics::worker_pool> pool;
+        if (count > 0) pool.reset(new metrics::worker_pool(count));
+
+        stopwatch sw;
+        auto stats = metrics::flush_metrics(store, 10000, pool.get());
+        printf("%10u %14.3f\n", count, sw.elapsed_us() / 1000);
+    }
+}
+
+// stats with the given number of metrics, equally split between types
+metrics::stats make_benchmark_stats(int count)
+{
+    metrics::stats stats;
+    stats.timestamp = metrics::timer::now();
+    char name[32];
+    for (int i = 0; i < count; ++i) {
+        sprintf_s(name, "app.metric.%d", i);
+        switch (i % 3) {
+            case 0: stats.counters[name] = rand() / 7.0; break;
+            case 1: stats.gauges[name] = rand(); break;
+            default: {
+                metrics::timer_data td = { name, 100, rand(), 0, rand(), rand() / 3.0, rand() / 9.0 };
+                stats.timers[name] = td;
+            }
+        }
+    }
+    return stats;
+}
+
+TEST(Benchmark, DISABLED_JsonSerialization) {
+    auto stats = make_benchmark_stats(100000);
+
+    std::string buffer;
+    metrics::json_file_backend::serialize(stats, buffer); // grow the buffer first
+    const int runs = 10;
+    stopwatch sw;
+    for (int i = 0; i < runs; ++i) {
+        buffer.clear();
+        metrics::json_file_backend::serialize(stats, buffer);
+    }
+    printf("%10s %14s %14s\n", "metrics", "bytes", "serialize [ms]");
+    printf("%10u %14u %14.3f\n", 100000, (unsigned int)buffer.size(), sw.elapsed_us() / runs / 1000);
+}
+
+TEST(Benchmark, DISABLED_FileCompression) {
+    std::string flush;
+    metrics::json_file_backend::serialize(make_benchmark_stats(10000), flush);
+
+    struct { metrics::file_compression method; const char* name; int level; } configs[] = {
+        { metrics::GzipCompression, "gzip", 1 },
+        { metrics::GzipCompression, "gzip", 6 },
+        { metrics::ZstdCompression, "zstd", 1 },
+        { metrics::ZstdCompression, "zstd", 3 },
+        { metrics::ZstdCompression, "zstd", 9 },
+    };
+
+    printf("%6s %6s %12s %12s %8s %14s\n", "method", "level", "bytes in", "bytes out", "ratio", "compress [ms]");
+    for (int i = 0; i < _countof(configs); ++i) {
+        std::unique_ptr<metrics::compressor> compressor;
+        try {
+            compressor.reset(new metrics::compressor(configs[i].method, configs[i].level));
+        }
+        catch (const metrics::config_exception&) {
+            printf("%6s %6d %12s\n", configs[i].name, configs[i].level, "not built in");
+            continue;
+        }
+
+        std::string out;
+        compressor->compress(flush.data(), flush.size(), out); // grow the buffer first
+        const int runs = 20;
+        stopwatch sw;
+        for (int run = 0; run < runs; ++run) {
+            out.clear();
+            compressor->compress(flush.data(), flush.size(), out);
+        }
+        printf("%6s %6d %12u %12u %8.2f %14.3f\n", configs[i].name, configs[i].level, (unsigned int)flush.size(),
+            (unsigned int)out.size(), (double)flush.size() / out.size(), sw.elapsed_us() / runs / 1000);
+    }
+}
+
+TEST(Benchmark, DISABLED_DirectVsLoopback) {
+    const int count = 200000; // fits into the direct buffer of one thread
+    volatile bool started = false;
+    auto cfg = metrics::server_config(10240)
+        .flush_every(1)
+        .add_server_listener([&](metrics::server_events e) { if (e == metrics::Started) started = true; });
+    auto svr = metrics::server::run(cfg);
+    while (!started) Sleep(10);
+    metrics::setup_client("127.0.0.1", 10240).set_namespace("stats");
+
+    // cost of the client call, the server runs on its own thread
+    double client_ns[2];
+    for (int direct = 0; direct < 2; ++direct) {
+        metrics::g_client.set_direct(direct != 0);
+        stopwatch sw;
+        for (int i = 0; i < count; ++i) metrics::inc("bench.requests", 1, "code:200");
+        client_ns[direct] = sw.elapsed_us() * 1000 / count;
+    }
+    metrics::g_client.set_direct(false);
+    svr.stop();
+    Sleep(500);
+
+    // cost of storing the metrics on the server: parsing vs draining
+    metrics::storage parsed;
+    stopwatch parse_sw;
+    for (int i = 0; i < count; ++i) {
+        char line[] = "stats.bench.requests:1|c|#code:200";
+        metrics::process_metric(&parsed, line, sizeof(line) - 1);
+    }
+    double parse_ns = parse_sw.elapsed_us() * 1000 / count;
+
+    metrics::enable_direct(true);
+    for (int i = 0; i < count; ++i) metrics::record_direct(metrics::counter, "stats", "bench.requests", 1, "code:200");
+    metrics::storage drained;
+    stopwatch drain_sw;
+    metrics::drain_direct(&drained);
+    double drain_ns = drain_sw.elapsed_us() * 1000 / count;
+    metrics::enable_direct(false);
+
+    printf("%10s %14s %14s\n", "mode", "client [ns]", "server [ns]");
+    printf("%10s %14.1f %14.1f\n", "udp", client_ns[0], parse_ns);
+    printf("%10s %14.1f %14.1f\n", "direct", client_ns[1], drain_ns);
+}
+
+struct counter_bench
+{
+    HANDLE start;          // set when all threads should start counting
+    int iterations;
+    volatile LONG shared;  // baseline, updated with interlocked operations
+    bool local;
+};
+
+DWORD WINAPI count_in_thread(LPVOID params)
+{
+    counter_bench* bench = static_cast<counter_bench*>(params);
+    metrics::local_counter counter("bench.local");
+    counter.inc(0); // creates the slots of this thread
+    WaitForSingleObject(bench->start, INFINITE);
+    if (bench->local) {
+        for (int i = 0; i < bench->iterations; ++i) counter.inc();
+    }
+    else {
+        for (int i = 0; i < bench->iterations; ++i) InterlockedIncrement(&bench->shared);
+    }
+    return 0;
+}
+
+TEST(Benchmark, DISABLED_LocalCounterScaling) {
+    const int iterations = 10000000;
+    unsigned int thread_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+    printf("%10s %18s %18s\n", "threads", "interlocked [ns]", "local [ns]");
+    FOR_EACH(auto count, thread_counts)
+    {
+        double ns[2];
+        for (int local = 0; local < 2; ++local) {
+            counter_bench bench = { CreateEvent(NULL, TRUE, FALSE, NULL), iterations, 0, local != 0 };
+            std::vector<HANDLE> threads;
+            for (unsigned int i = 0; i < count; ++i) threads.push_back(CreateThread(NULL, 0, count_in_thread, &bench, 0, NULL));
+            Sleep(50); // let the threads get ready
+
+            stopwatch sw;
+            SetEvent(bench.start);
+            FOR_EACH(auto h, threads) WaitForSingleObject(h, INFINITE);
+            ns[local] = sw.elapsed_us() * 1000 / iterations; // per update, as seen by one thread
+            FOR_EACH(auto h, threads) CloseHandle(h);
+            CloseHandle(bench.start);
+        }
+        printf("%10u %18.2f %18.2f\n", count, ns[0], ns[1]);
+    }
+
+    metrics::stats stats;
+    stats.period_ms = 1000;
+    metrics::flush_local(stats); // releases the slots of finished threads
+}
@@ -65,6 +65,7 @@ TEST(ClientTest, CheckClientSettings) {
     auto cfg = metrics::setup_client("127.0.0.1");
 
     ASSERT_THROW(cfg.track_default_metrics(metrics::all, 0), metrics::config_exception);
+    ASSERT_THROW(cfg.set_resolve_interval(0), metrics::config_exception);
 
     EXPECT_STREQ("stats", cfg.get_namespace());
     cfg.set_namespace("test_ns");
@@ -86,6 +87,7 @@ TEST(ClientTest, CheckClientApi) {
     metrics::measure("timer", 22);
     metrics::set_delta("gauge", 3);
     metrics::set_delta("gauge", -2);
+    metrics::inc("counter", 2, "code:200,method:get");
 
     auto messages = svr.get_messages();
 
@@ -95,6 +97,69 @@ TEST(ClientTest, CheckClientApi) {
     EXPECT_EQ("stats.timer:22|ms", messages[3]);
     EXPECT_EQ("stats.gauge:+3|g", messages[4]);
     EXPECT_EQ("stats.gauge:-2|g", messages[5]);
+    EXPECT_EQ("stats.counter:2|c|#code:200,method:get", messages[6]);
+}
+
+TEST(ClientTest, HostNameIsResolvedInBackground) {
+    fake_server svr;
+    metrics::setup_client("localhost").set_resolve_interval(1);
+
+    auto ts = metrics::timer::now();
+    while (!metrics::g_client.server_address() && metrics::timer::since(ts) < 5000) Sleep(10);
+    ASSERT_TRUE(metrics::g_client.server_address() != NULL);
+
+    metrics::inc("resolved");
+    auto messages = svr.get_messages();
+    metrics::setup_client("127.0.0.1"); // stops the refresh thread
+
+    ASSERT_EQ(1, messages.size());
+    EXPECT_EQ("stats.resolved:1|c", messages[0]);
+}
+
+TEST(ClientTest, DefaultMetricsArePackedIntoOneDatagram) {
+    fake_server svr;
+    metrics::setup_client("127.0.0.1").track_default_metrics(metrics::process, 1);
+
+    auto messages = svr.get_messages(true, 1500);
+    metrics::g_client.track_default_metrics(metrics::none);
+
+    ASSERT_EQ(1, messages.size());
+    auto& dg = messages[0];
+    EXPECT_EQ(0, dg.find("stats.proc.mem.wset:"));
+    EXPECT_NE(std::string::npos, dg.find("\nstats.proc.cpu.total:"));
+    EXPECT_EQ(std::string::npos, dg.find("stats.sys."));
+
+    // 5 memory and 3 CPU gauges, one per line
+    size_t lines = 0, gauges = 0;
+    for (size_t pos = 0; pos != std::string::npos; pos = dg.find('\n', pos + 1)) lines++;
+    for (size_t pos = dg.find("|g"); pos != std::string::npos; pos = dg.find("|g", pos + 1)) gauges++;
+    EXPECT_EQ(8, lines);
+    EXPECT_EQ(8, gauges);
+
+    EXPECT_TRUE(svr.get_messages(true, 1100).empty()); // collection is stopped
+}
+
+TEST(ClientTest, DroppedMetricsAreCounted) {
+    fake_server svr;
+    metrics::setup_client("127.0.0.1").set_namespace("stats").track_default_metrics(metrics::client, 1);
+    auto before = metrics::get_client_errors();
+
+    std::string name(300, 'x');
+    metrics::inc(name.c_str());
+    metrics::inc("tagged", 1, name.c_str());
+    metrics::inc("fits");
+
+    auto errors = metrics::get_client_errors();
+    EXPECT_EQ(before.oversized + 2, errors.oversized);
+    EXPECT_EQ(before.send_errors, errors.send_errors);
+
+    auto messages = svr.get_messages(true, 1500);
+    metrics::g_client.track_default_metrics(metrics::none);
+
+    ASSERT_EQ(2, messages.size());
+    EXPECT_EQ("stats.fits:1|c", messages[0]);
+    EXPECT_EQ("stats.client.dropped.send_errors:0|c\nstats.client.dropped.would_block:0|c\n"
+        "stats.client.dropped.oversized:2|c\nstats.client.dropped.unresolved:0|c", messages[1]);
 }
 
 namespace metrics
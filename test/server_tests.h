@@ -1,7 +1,18 @@
 #pragma once
 
 #include "../metrics/metrics_server.h"
+#include "../metrics/timer_kernel.h"
+#include "../metrics/worker_pool.h"
+#include "../metrics/reservoir.h"
+#include "../metrics/prefix_rollups.h"
+#include "../metrics/cardinality_limiter.h"
+#include "../metrics/direct_sink.h"
+#include "../metrics/persisted_interval.h"
+#include "../metrics/local_metrics.h"
+#include "../metrics/sync.h"
 #include "gtest/gtest.h"
+#include <climits>
+#include <fstream>
 
 namespace metrics
 {
@@ -9,7 +20,10 @@ namespace metrics
     // therefore we need to provide declarations to make compiler happy
     timer_data process_timer(const std::string& name, const std::vector<int>& values);
     stats flush_metrics(const storage& storage, unsigned int period_ms);
+    stats flush_metrics(const storage& storage, unsigned int period_ms, worker_pool* pool);
     void process_metric(storage* storage, char* buff, size_t len);
+    void run_encoded_backends(const stats& stats, const std::vector<encoded_backend>& backends);
+    void process_datagram(storage* storage, char* buff, size_t len);
 }
 
 using metrics::server_events;
@@ -83,6 +97,37 @@ TEST(ServerTest, TimerDataCalculation) {
     EXPECT_NEAR(1.72047, data.stddev, 0.00001);
 }
 
+TEST(ServerTest, TimerKernelsMatchScalar) {
+    // sizes cover empty vector tails and values which overflow 32 bit squares
+    size_t sizes[] = { 1, 3, 4, 7, 8, 9, 15, 16, 17, 1000, 1003 };
+    FOR_EACH(auto size, sizes)
+    {
+        std::vector<int> values(size);
+        for (size_t i = 0; i < size; ++i) {
+            values[i] = (rand() - RAND_MAX / 2) * (i % 3 == 0 ? 7919 : 1);
+        }
+
+        metrics::sample_summary expected, actual;
+        metrics::summarize_scalar(&values[0], size, &expected);
+
+        if (metrics::sse41_supported()) {
+            metrics::summarize_sse41(&values[0], size, &actual);
+            EXPECT_EQ(expected.min, actual.min);
+            EXPECT_EQ(expected.max, actual.max);
+            EXPECT_EQ(expected.sum, actual.sum);
+            EXPECT_EQ(expected.square_sum, actual.square_sum);
+        }
+
+        if (metrics::avx2_supported()) {
+            metrics::summarize_avx2(&values[0], size, &actual);
+            EXPECT_EQ(expected.min, actual.min);
+            EXPECT_EQ(expected.max, actual.max);
+            EXPECT_EQ(expected.sum, actual.sum);
+            EXPECT_EQ(expected.square_sum, actual.square_sum);
+        }
+    }
+}
+
 TEST(ServerTest, FlushLogicForEmptyStor) {
     metrics::storage store;
     auto before = metrics::timer::now();
@@ -221,6 +266,387 @@ TEST(ServerTest, CounterProcessing) {
     EXPECT_EQ(0, store.timers.size());
 }
 
+TEST(ServerTest, DatagramWithSeveralMetrics) {
+    metrics::storage store;
+    char datagram[] = "c:15|c\ng:0|g\ng:-5|g\n\nt.min:10|ms\nt.min:7|ms";
+    process_datagram(&store, datagram, strlen(datagram));
+
+    EXPECT_EQ(15, store.counters["c"]);
+    EXPECT_EQ(-5, store.gauges["g"]);
+    ASSERT_EQ(2, store.timers["t.min"].size());
+    EXPECT_EQ(7, store.timers["t.min"][1]);
+    EXPECT_EQ(5, store.counters[metrics::builtin::internal_metrics_count]);
+}
+
+TEST(ServerTest, LargeValuesAreNotTruncated) {
+    metrics::storage store;
+    char datagram[] = "c:5000000000|c\nc:5000000000|c\ng:-6000000000|g\nt:5000000000|ms";
+    process_datagram(&store, datagram, strlen(datagram));
+
+    EXPECT_EQ(10000000000LL, store.counters["c"]);
+    EXPECT_EQ(-6000000000LL, store.gauges["g"]);
+    ASSERT_EQ(1, store.timers["t"].size());
+    EXPECT_EQ(INT_MAX, store.timers["t"][0]);
+}
+
+TEST(ServerTest, TagsAreCanonicalised) {
+    metrics::storage store;
+    char datagram[] = "c:1|c|#b:2,a:1\nc:2|c|#a:1,b:2,a:1\nc:4|c\nc:8|c|#\nt:5|ms|#a:1,,url:/x:y";
+    process_datagram(&store, datagram, strlen(datagram));
+
+    EXPECT_EQ(3, store.counters["c|#a:1,b:2"]);
+    EXPECT_EQ(12, store.counters["c"]);
+    ASSERT_EQ(1, store.timers["t|#a:1,url:/x:y"].size());
+    EXPECT_EQ(5, store.timers["t|#a:1,url:/x:y"][0]);
+    EXPECT_EQ(4, store.tag_sets.size()); // each distinct tag list is sorted once
+    EXPECT_EQ(1, metrics::name_length("t|#a:1,url:/x:y"));
+}
+
+DWORD WINAPI record_direct_metrics(LPVOID)
+{
+    metrics::inc("direct.counter", 2, "b:2,a:1");
+    metrics::measure("direct.timer", 30);
+    return 0;
+}
+
+TEST(ServerTest, DirectModeBypassesSockets) {
+    // nothing listens on the port, so only direct metrics can be stored
+    metrics::setup_client("127.0.0.1", 10230).set_namespace("direct").set_direct(true);
+    metrics::enable_direct(true);
+
+    std::string name = "direct.counter"; // copied, doesn't have to outlive the call
+    metrics::inc(name.c_str(), 3, "a:1,b:2");
+    name = "overwritten";
+    metrics::set("direct.gauge", 17);
+    metrics::set_delta("direct.gauge", -2);
+    {
+        metrics::auto_timer _("direct.timer");
+    }
+    HANDLE h = CreateThread(NULL, 0, record_direct_metrics, NULL, 0, NULL);
+    WaitForSingleObject(h, INFINITE);
+    CloseHandle(h);
+
+    metrics::storage store;
+    metrics::drain_direct(&store);
+    metrics::enable_direct(false);
+    metrics::setup_client("127.0.0.1").set_namespace("stats").set_direct(false);
+
+    EXPECT_EQ(5, store.counters["direct.direct.counter|#a:1,b:2"]);
+    EXPECT_EQ(15, store.gauges["direct.direct.gauge"]);
+    ASSERT_EQ(2, store.timers["direct.direct.timer"].size());
+    EXPECT_EQ(30, store.timers["direct.direct.timer"][1]);
+    EXPECT_EQ(6, store.counters[metrics::builtin::internal_metrics_count]);
+
+    metrics::storage empty;
+    metrics::drain_direct(&empty);
+    EXPECT_TRUE(empty.counters.empty());
+}
+
+TEST(ServerTest, PersistedIntervalSurvivesRestart) {
+    const char* filename = "interval.dat";
+    DeleteFile(filename);
+    long long started;
+    {
+        metrics::persisted_interval persisted(filename, 16);
+        started = persisted.started();
+        EXPECT_GT(started, 0);
+        metrics::storage store;
+        store.persisted = &persisted;
+        char datagram[] = "stats.c:5|c\nstats.c:2|c\nstats.g:7|g\nstats.g:+3|g\nstats.t:10|ms\nstats.t:20|ms\nstats.c:1|c|#a:1";
+        process_datagram(&store, datagram, strlen(datagram));
+    } // storage is lost, as if the server crashed
+
+    {
+        metrics::persisted_interval persisted(filename, 32);
+        metrics::storage store;
+        EXPECT_EQ(4, persisted.restore(store));
+        EXPECT_EQ(started, persisted.started()); // the interval is resumed
+        store.persisted = &persisted;
+        EXPECT_EQ(7, store.counters["stats.c"]);
+        EXPECT_EQ(1, store.counters["stats.c|#a:1"]);
+        EXPECT_EQ(10, store.gauges["stats.g"]);
+
+        char datagram[] = "stats.t:30|ms\nstats.c:3|c";
+        process_datagram(&store, datagram, strlen(datagram));
+        auto stats = metrics::flush_metrics(store, 1000);
+        EXPECT_EQ(10, stats.counters["stats.c"]);
+        auto& t = stats.timers["stats.t"];
+        EXPECT_EQ(3, t.count);
+        EXPECT_EQ(10, t.min);
+        EXPECT_EQ(30, t.max);
+        EXPECT_EQ(60, t.sum);
+        EXPECT_NEAR(8.165, t.stddev, 0.001);
+        store.keep_gauges = true;
+        store.next_interval();
+        EXPECT_GE(persisted.started(), started);
+    }
+
+    {
+        metrics::persisted_interval persisted(filename, 2);
+        metrics::storage store;
+        EXPECT_EQ(1, persisted.restore(store)); // interval was flushed, the kept gauge remains
+        EXPECT_EQ(10, store.gauges["stats.g"]);
+        store.persisted = &persisted;
+        // only the slot of the flushed counter is free for new metrics
+        char datagram[] = "stats.a:1|c\nstats.b:1|c\nstats.g:10|g\nstats.a:1|c";
+        process_datagram(&store, datagram, strlen(datagram));
+        EXPECT_EQ(1, store.counters[metrics::builtin::internal_persist_dropped]);
+    }
+    DeleteFile(filename);
+}
+
+DWORD WINAPI update_local_metrics(LPVOID)
+{
+    metrics::local_counter("local.requests").inc(3);
+    metrics::local_gauge("local.inflight").add(2);
+    return 0;
+}
+
+TEST(ServerTest, LocalMetricsSumThreadSlots) {
+    metrics::setup_client("127.0.0.1").set_namespace("stats");
+    metrics::local_counter requests("local.requests");
+    metrics::local_gauge inflight("local.inflight");
+
+    requests.inc(5);
+    inflight.add(1);
+    HANDLE h = CreateThread(NULL, 0, update_local_metrics, NULL, 0, NULL);
+    WaitForSingleObject(h, INFINITE);
+    CloseHandle(h);
+
+    metrics::stats stats;
+    stats.period_ms = 1000;
+    metrics::flush_local(stats);
+    EXPECT_EQ(8, stats.counters["stats.local.requests"]);
+    EXPECT_EQ(3, stats.gauges["stats.local.inflight"]);
+
+    // slots of the exited thread are released, but their values are kept
+    requests.inc(2);
+    inflight.add(-3);
+    metrics::stats next;
+    next.period_ms = 2000;
+    metrics::flush_local(next);
+    EXPECT_EQ(1, next.counters["stats.local.requests"]);
+    EXPECT_EQ(0, next.gauges["stats.local.inflight"]);
+}
+
+TEST(ServerTest, SparseFlushOfKeptGauges) {
+    metrics::storage store;
+    store.keep_gauges = true;
+    store.sparse = true;
+
+    char metric1[] = "stats.a:5|g";
+    char metric2[] = "stats.b:7|g";
+    process_metric(&store, metric1, strlen(metric1));
+    process_metric(&store, metric2, strlen(metric2));
+
+    auto stats = metrics::flush_metrics(store, 10000);
+    EXPECT_EQ(3, stats.gauges.size());  // including last_seen
+    EXPECT_EQ(5, stats.gauges["stats.a"]);
+    EXPECT_EQ(7, stats.gauges["stats.b"]);
+
+    store.next_interval();
+    char metric3[] = "stats.a:+2|g";
+    process_metric(&store, metric3, strlen(metric3));
+
+    stats = metrics::flush_metrics(store, 10000);
+    EXPECT_EQ(2, stats.gauges.size());
+    EXPECT_EQ(7, stats.gauges["stats.a"]);  // delta applied to kept value
+    EXPECT_EQ(0, stats.gauges.count("stats.b"));
+    EXPECT_EQ(7, store.gauges["stats.b"]);  // but it is still kept
+
+    store.next_interval();
+    store.sparse = false;
+    stats = metrics::flush_metrics(store, 10000);
+    EXPECT_EQ(3, stats.gauges.size());
+}
+
+TEST(ServerTest, IdleGaugesExpire) {
+    metrics::storage store;
+    store.keep_gauges = true;
+    store.gauge_expiry.reset(2);
+
+    store.gauge("idle") = 1;
+    store.gauge("busy") = 1;
+
+    store.next_interval();
+    store.gauge("busy") = 2;
+    EXPECT_EQ(1, store.gauges.count("idle"));
+
+    store.next_interval();
+    store.gauge("busy") = 3;
+    EXPECT_EQ(0, store.gauges.count("idle"));
+    EXPECT_EQ(0, store.gauge_updates.count("idle"));
+
+    store.next_interval();
+    EXPECT_EQ(1, store.gauges.count("busy"));
+    store.next_interval();
+    EXPECT_EQ(0, store.gauges.count("busy"));
+}
+
+TEST(ServerTest, DecayingReservoirQuantiles) {
+    metrics::decaying_reservoir reservoir(2000, 0.015, 0);
+    EXPECT_EQ(0, reservoir.quantile(0.5));
+
+    for (int i = 1000; i > 0; --i) reservoir.update(i, 10);
+    EXPECT_EQ(1000, reservoir.size());
+    EXPECT_EQ(1, reservoir.quantile(0));
+    EXPECT_NEAR(500, reservoir.quantile(0.5), 1);
+    EXPECT_NEAR(990, reservoir.quantile(0.99), 1);
+    EXPECT_EQ(1000, reservoir.quantile(1));
+}
+
+TEST(ServerTest, DecayingReservoirFavorsRecentValues) {
+    metrics::decaying_reservoir reservoir(100, 0.015, 0);
+    for (int i = 0; i < 1000; ++i) reservoir.update(10, 0);
+    EXPECT_EQ(100, reservoir.size());
+    EXPECT_EQ(10, reservoir.quantile(0.99));
+
+    // ten minutes later, new values weigh e^9 times more
+    for (int i = 0; i < 1000; ++i) reservoir.update(1000, 600);
+    EXPECT_EQ(100, reservoir.size());
+    EXPECT_EQ(1000, reservoir.quantile(0.01));
+
+    // landmark is rescaled after an hour, weights must stay finite
+    for (int i = 0; i < 10; ++i) reservoir.update(5, 4000);
+    EXPECT_EQ(100, reservoir.size());
+    EXPECT_EQ(5, reservoir.quantile(0.5));
+}
+
+TEST(ServerTest, LiveTimersSurviveFlush) {
+    metrics::live_timers live(1028, 0.015);
+    metrics::storage store;
+    store.live = &live;
+
+    char metric1[] = "stats.t:20|ms";
+    char metric2[] = "stats.t:40|ms";
+    process_metric(&store, metric1, strlen(metric1));
+    process_metric(&store, metric2, strlen(metric2));
+
+    double value = 0;
+    EXPECT_FALSE(live.quantile("stats.unknown", 0.5, &value));
+    EXPECT_TRUE(live.quantile("stats.t", 1, &value));
+    EXPECT_EQ(40, value);
+
+    auto stats = metrics::flush_metrics(store, 10000);
+    store.next_interval();
+    EXPECT_EQ(2, stats.timers["stats.t"].count);
+    EXPECT_TRUE(live.quantile("stats.t", 0, &value));
+    EXPECT_EQ(20, value);
+}
+
+TEST(ServerTest, IdleLiveTimersAreEvicted) {
+    metrics::live_timers live(1028, 0.015, 2);
+    metrics::storage store;
+    store.live = &live;
+
+    char metric1[] = "stats.idle:20|ms";
+    char metric2[] = "stats.busy:40|ms";
+    process_metric(&store, metric1, strlen(metric1));
+    store.next_interval();
+    process_metric(&store, metric2, strlen(metric2));
+    EXPECT_EQ(2, live.size());
+
+    store.next_interval();
+    double value = 0;
+    EXPECT_FALSE(live.quantile("stats.idle", 0.5, &value)); // no values in 2 intervals
+    EXPECT_TRUE(live.quantile("stats.busy", 0.5, &value));
+    EXPECT_EQ(1, live.size());
+}
+
+TEST(ServerTest, PrefixRollupsSumSubtrees) {
+    std::vector<std::string> prefixes;
+    prefixes.push_back("stats.comm.rq");
+    prefixes.push_back("stats.comm");
+    prefixes.push_back("stats.comm.rq"); // duplicates are ignored
+    metrics::prefix_rollups rollups(prefixes);
+    metrics::storage store;
+    store.rollups = &rollups;
+
+    char datagram[] = "stats.comm.rq.iso:3|c\nstats.comm.rq.eth.tx:4|c|#a:1\nstats.comm.rqx:100|c\n"
+        "stats.comm.rq:1|c\nstats.comm.lat:10|ms\nstats.comm.rq.lat:30|ms\nstats.comm.g:5|g\nstats.other:7|c";
+    process_datagram(&store, datagram, strlen(datagram));
+
+    auto stats = metrics::flush_metrics(store, 1000);
+    EXPECT_EQ(8, stats.counters["stats.comm.rq._all"]);
+    EXPECT_EQ(108, stats.counters["stats.comm._all"]);
+    EXPECT_EQ(1, stats.timers["stats.comm.rq._all"].count);
+    EXPECT_EQ(30, stats.timers["stats.comm.rq._all"].max);
+    EXPECT_EQ(2, stats.timers["stats.comm._all"].count);
+    EXPECT_EQ(20, stats.timers["stats.comm._all"].avg);
+    EXPECT_EQ(10, stats.timers["stats.comm._all"].min);
+    EXPECT_EQ(40, stats.timers["stats.comm._all"].sum);
+    EXPECT_EQ(10, stats.timers["stats.comm._all"].stddev);
+    EXPECT_EQ(0, stats.gauges.count("stats.comm._all"));
+
+    store.next_interval();
+    stats = metrics::flush_metrics(store, 1000);
+    EXPECT_EQ(0, stats.counters.count("stats.comm._all"));
+    EXPECT_EQ(0, stats.timers.count("stats.comm._all"));
+}
+
+TEST(ServerTest, CardinalityLimitFoldsNewMetrics) {
+    metrics::cardinality_limiter limiter(5, 2, 2);
+    metrics::storage store;
+    store.limiter = &limiter;
+
+    EXPECT_EQ("stats.api", limiter.prefix("stats.api.rq.get|#a:1.2"));
+    EXPECT_EQ("stats.api", limiter.prefix("stats.api|#a:1.2"));
+
+    char datagram[] = "stats.api.rq.1:1|c\nstats.api.rq.2:1|c\nstats.api.rq.3:1|c\nstats.api.rq.1:1|c\n"
+        "stats.api.rq.4:10|ms\nstats.db.q:1|c\nstats.db.q:2|c|#t:x\nstats.fs.w:7|g\nstats.fs.r:1|c";
+    process_datagram(&store, datagram, strlen(datagram));
+
+    EXPECT_EQ(2, store.counters["stats.api.rq.1"]);
+    EXPECT_EQ(1, store.counters["stats.api.rq.2"]);
+    EXPECT_EQ(0, store.counters.count("stats.api.rq.3"));
+    EXPECT_EQ(2, store.counters["stats.db.q|#t:x"]);
+    EXPECT_EQ(7, store.gauges["stats.fs.w"]);
+    EXPECT_EQ(2, store.counters[metrics::builtin::internal_cardinality_overflow_counter]); // rq.3 and fs.r
+    ASSERT_EQ(1, store.timers[metrics::builtin::internal_cardinality_overflow_timer].size());
+    EXPECT_EQ(0, store.gauges.count(metrics::builtin::internal_cardinality_overflow_gauge));
+
+    auto stats = metrics::flush_metrics(store, 1000);
+    std::string rejected = metrics::builtin::internal_cardinality_rejected;
+    EXPECT_EQ(3, stats.counters[rejected]);
+    EXPECT_EQ(2, stats.counters[rejected + "|#prefix:stats.api"]);
+    EXPECT_EQ(1, stats.counters[rejected + "|#prefix:stats.fs"]);
+
+    store.next_interval();
+    char metric[] = "stats.api.rq.3:1|c";
+    process_metric(&store, metric, strlen(metric));
+    EXPECT_EQ(1, store.counters["stats.api.rq.3"]);
+    stats = metrics::flush_metrics(store, 1000);
+    EXPECT_EQ(0, stats.counters.count(rejected));
+}
+
+TEST(ServerTest, KeptGaugesCountAgainstCardinalityLimit) {
+    metrics::cardinality_limiter limiter(2, 0, 2);
+    metrics::storage store;
+    store.limiter = &limiter;
+    store.keep_gauges = true;
+    store.gauge_expiry.reset(2);
+
+    char first[] = "g.1:1|g\ng.2:2|g";
+    process_datagram(&store, first, strlen(first));
+    store.next_interval();
+
+    // the kept gauges still take the whole limit in the next interval
+    char second[] = "g.3:3|g\nc:1|c\ng.1:+1|g";
+    process_datagram(&store, second, strlen(second));
+    EXPECT_EQ(0, store.gauges.count("g.3"));
+    EXPECT_EQ(3, store.gauges[metrics::builtin::internal_cardinality_overflow_gauge]);
+    EXPECT_EQ(1, store.counters[metrics::builtin::internal_cardinality_overflow_counter]);
+    EXPECT_EQ(2, store.gauges["g.1"]);
+
+    // expired gauges free their places
+    store.next_interval();
+    store.next_interval();
+    EXPECT_EQ(0, store.gauges.count("g.2"));
+    char third[] = "g.3:3|g";
+    process_datagram(&store, third, strlen(third));
+    EXPECT_EQ(3, store.gauges["g.3"]);
+}
+
 bool operator == (const metrics::timer_data& lhs, const metrics::timer_data& rhs)
 {
     return lhs.count == rhs.count
@@ -264,6 +690,90 @@ TEST(ServerTest, Flushing) {
     EXPECT_TRUE(td2 == stats.timers["t.2"]);
 }
 
+int g_encode_count = 0;
+void counting_encoder(const metrics::stats& stats, std::string& out)
+{
+    g_encode_count++;
+    metrics::json_file_backend::serialize(stats, out);
+}
+
+TEST(ServerTest, EncodedBackendsShareEncoding) {
+    metrics::storage store;
+    store.counters["c"] = 5;
+    store.gauges["g"] = 42;
+    auto stats = metrics::flush_metrics(store, 10000);
+
+    std::vector<std::shared_ptr<const std::string> > received;
+    auto backend = [&](const metrics::stats&, const std::shared_ptr<const std::string>& encoded) {
+        received.push_back(encoded);
+    };
+    const char* filename = "encoded.json";
+    DeleteFile(filename);
+
+    auto cfg = metrics::server_config()
+        .add_backend(&counting_encoder, backend)
+        .add_backend(&metrics::graphite_backend::serialize, backend)
+        .add_backend(&counting_encoder, metrics::json_file_backend(filename))
+        .add_backend(&counting_encoder, backend);
+
+    g_encode_count = 0;
+    metrics::run_encoded_backends(stats, cfg.encoded_backends());
+    EXPECT_EQ(1, g_encode_count);
+    ASSERT_EQ(3, received.size());
+    EXPECT_EQ(received[0].get(), received[2].get());
+
+    // JSON timestamp is derived from the current time, so only the rest is compared
+    std::string json, graphite;
+    metrics::json_file_backend::serialize(stats, json);
+    metrics::graphite_backend::serialize(stats, graphite);
+    EXPECT_EQ(json.substr(json.find(',')), received[0]->substr(received[0]->find(',')));
+    EXPECT_EQ(graphite, *received[1]);
+
+    cfg = metrics::server_config(); // closes the file
+    std::ifstream ifs(filename, std::ios::binary);
+    EXPECT_EQ(*received[0], std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()));
+    ifs.close();
+    DeleteFile(filename);
+
+    EXPECT_THROW(cfg.add_backend(NULL, backend), metrics::config_exception);
+}
+
+TEST(ServerTest, WorkerPoolRunsEachTaskOnce) {
+    metrics::worker_pool pool(3);
+    std::vector<LONG> executed(1000);
+
+    for (int run = 0; run < 10; ++run) {
+        pool.run(executed.size(), [&](size_t i) { InterlockedIncrement(&executed[i]); });
+    }
+
+    FOR_EACH(auto count, executed) EXPECT_EQ(10, count);
+}
+
+TEST(ServerTest, ParallelFlushingMatchesSerial) {
+    metrics::storage store;
+    char name[32];
+    for (int i = 0; i < 1000; ++i) {
+        sprintf_s(name, "t.%d", i);
+        for (int j = 0; j <= i % 50; ++j) store.timers[name].push_back(rand());
+    }
+    store.counters["c.1"] = 5;
+    store.gauges["g.1"] = 42;
+
+    metrics::worker_pool pool(4);
+    auto serial = metrics::flush_metrics(store, 10000);
+    auto parallel = metrics::flush_metrics(store, 10000, &pool);
+
+    EXPECT_EQ(serial.counters, parallel.counters);
+    EXPECT_EQ(serial.gauges, parallel.gauges);
+    ASSERT_EQ(serial.timers.size(), parallel.timers.size());
+    auto it = parallel.timers.begin();
+    FOR_EACH(auto& t, serial.timers) {
+        EXPECT_EQ(t.first, it->first);
+        EXPECT_TRUE(t.second == it->second);
+        ++it;
+    }
+}
+
 TEST(ServerTest, PreFlushCalled) {
     bool flush_called = false;
     auto cfg = metrics::server_config()
@@ -283,6 +793,38 @@ TEST(ServerTest, CheckConfigSettings) {
     EXPECT_NO_THROW(cfg.flush_every(1));
     EXPECT_NO_THROW(cfg.flush_every(3600));
     EXPECT_THROW(cfg.flush_every(3601), metrics::config_exception);
+
+    EXPECT_NO_THROW(cfg.flush_threads(0));
+    EXPECT_NO_THROW(cfg.flush_threads(64));
+    EXPECT_THROW(cfg.flush_threads(65), metrics::config_exception);
+
+    EXPECT_THROW(cfg.track_live_timers(0), metrics::config_exception);
+    EXPECT_THROW(cfg.track_live_timers(100, 0), metrics::config_exception);
+    EXPECT_THROW(cfg.track_live_timers(100, 0.015, 0), metrics::config_exception);
+    EXPECT_EQ(NULL, cfg.live().get());
+    EXPECT_NO_THROW(cfg.track_live_timers());
+    EXPECT_NE((metrics::live_timers*)NULL, cfg.live().get());
+
+    EXPECT_EQ(0, cfg.prometheus_port());
+    EXPECT_THROW(cfg.serve_prometheus(0), metrics::config_exception);
+    EXPECT_THROW(cfg.serve_prometheus(65536), metrics::config_exception);
+    EXPECT_NO_THROW(cfg.serve_prometheus());
+    EXPECT_EQ(9102, cfg.prometheus_port());
+
+    EXPECT_THROW(cfg.rollup_prefix(""), metrics::config_exception);
+    EXPECT_THROW(cfg.rollup_prefix(".*"), metrics::config_exception);
+    cfg.rollup_prefix("stats.comm.*").rollup_prefix("stats.db");
+    ASSERT_EQ(2, cfg.rollup_prefixes().size());
+    EXPECT_EQ("stats.comm", cfg.rollup_prefixes()[0]);
+
+    EXPECT_THROW(cfg.limit_cardinality(0, 0), metrics::config_exception);
+    EXPECT_THROW(cfg.limit_cardinality(100, 10, 0), metrics::config_exception);
+    EXPECT_NO_THROW(cfg.limit_cardinality(0, 10));
+    EXPECT_EQ(0, cfg.max_names());
+    EXPECT_EQ(10, cfg.max_names_per_prefix());
+
+    EXPECT_THROW(cfg.persist_interval(""), metrics::config_exception);
+    EXPECT_THROW(cfg.persist_interval("interval.dat", 0), metrics::config_exception);
 }
 
 TEST(ServerTest, NamespaceIsUsed) {
@@ -339,6 +881,97 @@ TEST(ServerTest, ServerEvents) {
 
 
 
+TEST(ServerTest, ReloadAppliesAtFlushBoundary) {
+    // one auto-reset event per server event, and one for flushes of the new configuration
+    HANDLE events[metrics::ReloadFailed + 1], flushed = CreateEvent(NULL, FALSE, FALSE, NULL);
+    for (int i = 0; i <= metrics::ReloadFailed; ++i) events[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    volatile LONG reloads = 0;
+    CRITICAL_SECTION lock; // guards the flushes, which are added on the server thread
+    InitializeCriticalSection(&lock);
+    std::vector<metrics::stats> old_flushes, new_flushes;
+    auto listener = [&](metrics::server_events e) {
+        if (e == metrics::Reloaded) InterlockedIncrement(&reloads);
+        SetEvent(events[e]);
+    };
+    auto wait_for = [](HANDLE event) { return WaitForSingleObject(event, 3000) == WAIT_OBJECT_0; };
+    auto flushes = [&](std::vector<metrics::stats>& v) -> std::vector<metrics::stats> {
+        metrics::scoped_lock _(&lock);
+        return v;
+    };
+
+    metrics::server svr = metrics::server::run(metrics::server_config(10200)
+        .flush_every(1)
+        .add_server_listener(listener)
+        .add_backend([&](const metrics::stats& s) { metrics::scoped_lock _(&lock); old_flushes.push_back(s); }));
+    ASSERT_TRUE(wait_for(events[metrics::Started]));
+    metrics::setup_client("127.0.0.1", 10200).set_namespace("reload");
+    metrics::inc("before");
+
+    svr.reload(metrics::server_config(10201)
+        .flush_every(1)
+        .add_server_listener(listener)
+        .add_backend([&](const metrics::stats& s) {
+            metrics::scoped_lock _(&lock);
+            new_flushes.push_back(s);
+            SetEvent(flushed);
+        }));
+    // the configuration is applied by the server thread, at the flush
+    EXPECT_EQ(10200, svr.config().port());
+    ASSERT_TRUE(wait_for(events[metrics::Reloaded]));
+    EXPECT_EQ(10201, svr.config().port());
+    EXPECT_TRUE(svr.config().backends().empty()); // owned by the server thread only
+
+    // the interval in progress was flushed with the old configuration
+    auto old = flushes(old_flushes);
+    ASSERT_EQ(1, old.size());
+    EXPECT_EQ(1, old[0].counters.count("reload.before"));
+
+    // old port still receives until the next flush
+    metrics::inc("late");
+    metrics::setup_client("127.0.0.1", 10201);
+    metrics::inc("after");
+    ASSERT_TRUE(wait_for(flushed));
+    auto current = flushes(new_flushes);
+    ASSERT_EQ(1, current.size());
+    EXPECT_EQ(1, current[0].counters.count("reload.late"));
+    EXPECT_EQ(1, current[0].counters.count("reload.after"));
+
+    // a port which can't be bound keeps the current configuration
+    SOCKET taken = socket(AF_INET, SOCK_DGRAM, 0);
+    metrics::SOCK_ADDR_IN addr(AF_INET, INADDR_ANY, 10202);
+    ASSERT_EQ(0, bind(taken, (sockaddr*)&addr, sizeof(addr)));
+    svr.reload(metrics::server_config(10202).add_server_listener(listener));
+    ASSERT_TRUE(wait_for(events[metrics::ReloadFailed]));
+    EXPECT_EQ(1, reloads);
+    EXPECT_EQ(10201, svr.config().port());
+    closesocket(taken);
+
+    // watched configuration file is loaded again when it changes
+    const char* filename = "reload.cfg";
+    std::ofstream("reload.cfg") << "1";
+    volatile LONG loads = 0;
+    auto loader = [&](const std::string& file) -> metrics::server_config {
+        InterlockedIncrement(&loads);
+        return metrics::server_config(10201).flush_every(1).add_server_listener(listener);
+    };
+    svr.reload(metrics::server_config(10201).flush_every(1).add_server_listener(listener).reload_from(filename, loader));
+    ASSERT_TRUE(wait_for(events[metrics::Reloaded]));
+    std::ofstream("reload.cfg") << "22";
+    ASSERT_TRUE(wait_for(events[metrics::Reloaded]));
+    EXPECT_EQ(1, loads);
+    EXPECT_EQ(3, reloads);
+    DeleteFile(filename);
+
+    svr.stop();
+    EXPECT_TRUE(wait_for(events[metrics::Stopped]));
+    EXPECT_EQ(metrics::server_config().port(), svr.config().port()); // released with the server
+    metrics::setup_client("127.0.0.1").set_namespace("stats");
+
+    FOR_EACH (auto e, events) CloseHandle(e);
+    CloseHandle(flushed);
+    DeleteCriticalSection(&lock);
+}
+
 //TEST(ServerTest, JsonFileBackend) {
 //	metrics::json_file_backend jfb = metrics::json_file_backend("test.json");
 //
@@ -4,6 +4,8 @@
 #include "stdafx.h"
 #include "client_tests.h"
 #include "server_tests.h"
+#include "backend_tests.h"
+#include "benchmark_tests.h"
 
 int _tmain(int argc, _TCHAR* argv[])
 {